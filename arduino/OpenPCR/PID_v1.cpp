@@ -15,6 +15,11 @@
 PID::PID(double* Input, double* Output, double* Setpoint,
         double Kp, double Ki, double Kd, int ControllerDirection)
 {
+    myOutput = Output;                          //links must be in place before
+    myInput = Input;                            //SetOutputLimits() can touch them
+    mySetpoint = Setpoint;
+    inAuto = false;
+
 	PID::SetOutputLimits(0, 255);				//default output limit corresponds to 
 												//the arduino pwm limits
 
@@ -24,10 +29,6 @@ PID::PID(double* Input, double* Output, double* Setpoint,
     PID::SetTunings(Kp, Ki, Kd);
 
     lastTime = millis()-SampleTime;				
-    inAuto = false;
-    myOutput = Output;
-    myInput = Input;
-    mySetpoint = Setpoint;
 		
 }
  
@@ -66,6 +67,7 @@ void PID::Compute()
 	  
       /*Remember some variables for next time*/
       lastInput = input;
+      lastError = error;
       lastTime = now;
    }
 }
@@ -82,6 +84,7 @@ void PID::SetTunings(double Kp, double Ki, double Kd)
  
    dispKp = Kp; dispKi = Ki; dispKd = Kd;
    
+   double oldKp = kp;
    double SampleTimeInSec = ((double)SampleTime)/1000;  
    kp = Kp;
    ki = Ki * SampleTimeInSec;
@@ -93,6 +96,14 @@ void PID::SetTunings(double Kp, double Ki, double Kd)
       ki = (0 - ki);
       kd = (0 - kd);
    }
+ 
+   if(inAuto)
+   {  /*move the change in the proportional term into the integral so the
+        output does not jump when gains are scheduled during operation*/
+      ITerm += (oldKp - kp) * lastError;
+      if(ITerm > outMax) ITerm= outMax;
+      else if(ITerm < outMin) ITerm= outMin;
+   }
 }
   
 /* SetSampleTime(...) *********************************************************
@@ -157,6 +168,7 @@ void PID::Initialize()
 {
    ITerm = *myOutput;
    lastInput = *myInput;
+   lastError = *mySetpoint - *myInput;
    lastTime = millis() -SampleTime;
    if(ITerm > outMax) ITerm = outMax;
    else if(ITerm < outMin) ITerm = outMin;
@@ -72,7 +72,7 @@ class PID
                                   //   what these values are.  with pointers we'll just know.
 			  
 	unsigned long lastTime;
-	double ITerm, lastInput;
+	double ITerm, lastInput, lastError;
 
 	int SampleTime;
 	double outMin, outMax;
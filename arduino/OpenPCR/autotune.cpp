@@ -0,0 +1,136 @@
+/*
+ *  autotune.cpp - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcr_includes.h"
+#include "autotune.h"
+
+#include "program.h"
+
+#define RELAY_SETTLE_MS 20000 //time in tolerance before the bias is taken
+#define RELAY_TIMEOUT_MS 900000 //15 minutes, the lid is slow
+#define RELAY_SKIP_CYCLES 1 //let the limit cycle establish itself
+#define RELAY_MEASURE_CYCLES 4
+
+////////////////////////////////////////////////////////////////////
+// Class RelayTuner
+RelayTuner::RelayTuner():
+  iState(ERelayIdle),
+  iMeasuredCycles(0) {
+}
+
+void RelayTuner::Start(double setpoint, double tolerance, double amplitude, double hysteresis,
+                       double outMin, double outMax) {
+  iState = ERelaySettling;
+  iSetpoint = setpoint;
+  iTolerance = tolerance;
+  iAmplitude = amplitude;
+  iHysteresis = hysteresis;
+  iOutMin = outMin;
+  iOutMax = outMax;
+  iStartTimeMs = millis();
+  iSettleStartMs = iStartTimeMs;
+  iBiasSum = 0;
+  iBiasSamples = 0;
+}
+
+double RelayTuner::Compute(double input, double controllerOutput) {
+  if (!Running())
+    return controllerOutput;
+
+  unsigned long now = millis();
+  if (now - iStartTimeMs > RELAY_TIMEOUT_MS) {
+    iState = ERelayFailed; //never settled or never oscillated
+    return controllerOutput;
+  }
+
+  if (iState == ERelaySettling) {
+    if (absf(input - iSetpoint) > iTolerance) {
+      iSettleStartMs = now;
+      iBiasSum = 0;
+      iBiasSamples = 0;
+    } else {
+      iBiasSum += controllerOutput;
+      iBiasSamples++;
+    }
+    if (now - iSettleStartMs < RELAY_SETTLE_MS)
+      return controllerOutput;
+
+    //settled, start switching
+    iState = ERelayRunning;
+    iBias = iBiasSum / iBiasSamples;
+    iOutputHigh = input < iSetpoint;
+    iLastRiseMs = now;
+    iCycleMax = input;
+    iCycleMin = input;
+    iRises = 0;
+    iMeasuredCycles = 0;
+    iPeriodSumMs = 0;
+    iPeakSum = 0;
+  }
+
+  if (input > iCycleMax)
+    iCycleMax = input;
+  if (input < iCycleMin)
+    iCycleMin = input;
+
+  if (iOutputHigh && input > iSetpoint + iHysteresis) {
+    iOutputHigh = false;
+
+  } else if (!iOutputHigh && input < iSetpoint - iHysteresis) {
+    //each rising switch closes a cycle
+    iOutputHigh = true;
+    if (iRises > RELAY_SKIP_CYCLES) {
+      iPeriodSumMs += now - iLastRiseMs;
+      iPeakSum += iCycleMax - iCycleMin;
+      iMeasuredCycles++;
+    }
+    iRises++;
+    iLastRiseMs = now;
+    iCycleMax = input;
+    iCycleMin = input;
+
+    if (iMeasuredCycles == RELAY_MEASURE_CYCLES)
+      iState = ERelayDone;
+  }
+
+  double output = iOutputHigh ? iBias + iAmplitude : iBias - iAmplitude;
+  return constrain(output, iOutMin, iOutMax);
+}
+
+double RelayTuner::GetUltimateGain() {
+  //hysteresis shifts the switching points, so correct the measured amplitude
+  double a = iPeakSum / 2 / iMeasuredCycles;
+  double effective = a > iHysteresis ? sqrt(a * a - iHysteresis * iHysteresis) : a;
+  return 4 * iAmplitude / (PI * effective);
+}
+
+void RelayTuner::GetPidGains(SPidGains& gains) {
+  double ku = GetUltimateGain();
+  double tu = GetUltimatePeriodS();
+  gains.kp = 0.6 * ku;
+  gains.ki = 1.2 * ku / tu;
+  gains.kd = 0.075 * ku * tu;
+}
+
+void RelayTuner::GetPiGains(SPidGains& gains) {
+  double ku = GetUltimateGain();
+  double tu = GetUltimatePeriodS();
+  gains.kp = 0.45 * ku;
+  gains.ki = 0.54 * ku / tu;
+  gains.kd = 0;
+}
@@ -0,0 +1,84 @@
+/*
+ *  autotune.h - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+struct SPidGains;
+
+////////////////////////////////////////////////////////////////////
+// Class RelayTuner
+//
+// Astrom-Hagglund relay experiment. The normal controller first holds the
+// input at the setpoint while its average output is taken as the bias. Then
+// the output is switched between bias +/- amplitude each time the input
+// crosses the setpoint (with hysteresis), and the resulting limit cycle is
+// measured. Its amplitude a and period Tu give the ultimate gain
+// Ku = 4 * amplitude / (pi * a), from which Ziegler-Nichols gains follow.
+//
+class RelayTuner {
+public:
+  RelayTuner();
+
+  void Start(double setpoint, double tolerance, double amplitude, double hysteresis,
+             double outMin, double outMax);
+  void Stop() { iState = ERelayIdle; }
+  double Compute(double input, double controllerOutput); //once per control period
+
+  // accessors
+  boolean Running() { return iState == ERelaySettling || iState == ERelayRunning; }
+  boolean Done() { return iState == ERelayDone; }
+  boolean Failed() { return iState == ERelayFailed; }
+  double GetUltimateGain();
+  double GetUltimatePeriodS() { return iPeriodSumMs / 1000.0 / iMeasuredCycles; }
+  void GetPidGains(SPidGains& gains); //classic Ziegler-Nichols PID
+  void GetPiGains(SPidGains& gains); //Ziegler-Nichols PI
+
+private:
+  enum RelayState {
+    ERelayIdle,
+    ERelaySettling,
+    ERelayRunning,
+    ERelayDone,
+    ERelayFailed
+  };
+
+  RelayState iState;
+  double iSetpoint;
+  double iTolerance;
+  double iBias;
+  double iAmplitude;
+  double iHysteresis;
+  double iOutMin;
+  double iOutMax;
+  unsigned long iStartTimeMs;
+  unsigned long iSettleStartMs;
+  double iBiasSum;
+  int iBiasSamples;
+
+  boolean iOutputHigh;
+  unsigned long iLastRiseMs;
+  double iCycleMax;
+  double iCycleMin;
+  int iRises; //rising switches so far
+  int iMeasuredCycles;
+  unsigned long iPeriodSumMs;
+  double iPeakSum; //sum of peak to peak swings
+};
+
+#endif
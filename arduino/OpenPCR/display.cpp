@@ -23,12 +23,16 @@
 #include "program.h"
 
 #define RESET_INTERVAL 30000 //ms
+#define RENDER_INTERVAL 250 //ms
+#define WRITE_BUDGET 8 //LCD bus writes per Update(), about 2ms
+#define DISPLAY_NO_CELL 0xFF
 
 //progmem strings
 const char HEATING_STR[] PROGMEM = "Heating";
 const char COOLING_STR[] PROGMEM = "Cooling";
 const char LIDWAIT_STR[] PROGMEM = "Heating Lid";
 const char STOPPED_STR[] PROGMEM = "Ready";
+const char TUNING_STR[] PROGMEM = "Tuning";
 const char RUN_COMPLETE_STR[] PROGMEM = "*** Run Complete ***";
 const char OPENPCR_STR[] PROGMEM = "OpenPCR";
 const char POWERED_OFF_STR[] PROGMEM = "Powered Off";
@@ -44,11 +48,19 @@ const char STATE_FORM_STR[] PROGMEM = "%-13s";
 
 Display::Display():
   iLcd(6, 7, 8, A5, 16, 17),
+  iNumDirty(0),
+  iFlushCell(0),
+  iCursorCell(DISPLAY_NO_CELL),
+  iLastRender(0),
   iLastState(Thermocycler::EOff) {
 
-  iLcd.begin(20, 4);
+  memset(iFrame, ' ', sizeof(iFrame));
+  memset(iDirty, 0, sizeof(iDirty));
+  iLcd.begin(DISPLAY_COLS, DISPLAY_ROWS);
   iLastReset = millis();
+#ifdef DEBUG_DISPLAY
   iszDebugMsg[0] = '\0';
+#endif
   
   // Set contrast
   iContrast = ProgramStore::RetrieveContrast();
@@ -62,74 +74,85 @@ void Display::Clear() {
 void Display::SetContrast(uint8_t contrast) {
   iContrast = contrast;
   analogWrite(5, iContrast);
-  iLcd.begin(20, 4);
+  BeginLcd();
 }
   
+#ifdef DEBUG_DISPLAY
 void Display::SetDebugMsg(char* szDebugMsg) {
   strcpy(iszDebugMsg, szDebugMsg);
-  iLcd.clear();
-  Update();
+  ClearFrame();
+  Render();
+  Flush(2 * DISPLAY_CELLS); //all of it, as the caller may not return
 }
+#endif
 
 void Display::Update() {
-  Thermocycler::ProgramState state = GetThermocycler().GetProgramState();
-  if (iLastState != state)
-    iLcd.clear();
-  iLastState = state;
-  
   // check for reset
   if (millis() - iLastReset > RESET_INTERVAL) {  
-    iLcd.begin(20, 4);
+    BeginLcd();
     iLastReset = millis();
   }
   
+  if (GetThermocycler().GetProgramState() != iLastState || millis() - iLastRender >= RENDER_INTERVAL)
+    Render();
+  Flush(WRITE_BUDGET);
+}
+
+void Display::Render() {
+  //the control tick can move on at any point, so take everything at once
+  Thermocycler::SStatus status;
+  GetThermocycler().GetStatus(status);
+  Thermocycler::ProgramState state = status.state;
+  if (iLastState != state)
+    ClearFrame();
+  iLastState = state;
+  iLastRender = millis();
+  
   switch (state) {
   case Thermocycler::ERunning:
   case Thermocycler::EComplete:
   case Thermocycler::ELidWait:
   case Thermocycler::EStopped:
-    iLcd.setCursor(0, 1);
+  case Thermocycler::ETuning:
  #ifdef DEBUG_DISPLAY
-    iLcd.print(iszDebugMsg);
+    Print(0, 1, iszDebugMsg);
  #else
-    iLcd.print(GetThermocycler().GetProgName());
+    Print(0, 1, GetThermocycler().GetProgName());
  #endif
            
-    DisplayLidTemp();
-    DisplayBlockTemp();
-    DisplayState();
+    DisplayLidTemp(status);
+    DisplayBlockTemp(status);
+    DisplayState(status);
 
-    if (state == Thermocycler::ERunning && !GetThermocycler().GetCurrentStep()->IsFinal()) {
-      DisplayCycle();
-      DisplayEta();
+    if (state == Thermocycler::ERunning && status.pStep != NULL && !status.pStep->IsFinal()) {
+      DisplayCycle(status);
+      DisplayEta(status);
     } else if (state == Thermocycler::EComplete) {
-      iLcd.setCursor(0, 3);
-      iLcd.print(rps(RUN_COMPLETE_STR));
+      Print(0, 3, rps(RUN_COMPLETE_STR));
     }
     break;
   
   case Thermocycler::EOff:
   case Thermocycler::EStartup:
-    iLcd.setCursor(6, 1);
-    iLcd.print(rps(OPENPCR_STR));
+    Print(6, 1, rps(OPENPCR_STR));
 
-    if (state == Thermocycler::EOff) {
-      iLcd.setCursor(4, 2);
-      iLcd.print(rps(POWERED_OFF_STR));
-    } else {
-      iLcd.setCursor(2, 2);
-      iLcd.print(rps(VERSION_STR));
-    }
+    if (state == Thermocycler::EOff)
+      Print(4, 2, rps(POWERED_OFF_STR));
+    else
+      Print(2, 2, rps(VERSION_STR));
+    break;
+    
+  default:
     break;
   }
 }
 
-void Display::DisplayEta() {
+void Display::DisplayEta(const Thermocycler::SStatus& status) {
   char timeString[16];
-  unsigned long timeRemaining = GetThermocycler().GetTimeRemainingS();
-  int hours = timeRemaining / 3600;
-  int mins = (timeRemaining % 3600) / 60;
-  int secs = timeRemaining % 60;
+  unsigned long timeRemaining = status.remainingS;
+  uint8_t hours = timeRemaining < 10 * 3600UL ? timeRemaining / 3600 : 10;
+  uint8_t mins = (timeRemaining % 3600) / 60;
+  uint8_t secs = timeRemaining % 60;
   
   if (hours >= 10)
     strcpy_P(timeString, ETA_OVER_10H_STR);
@@ -138,49 +161,45 @@ void Display::DisplayEta() {
   else
     sprintf_P(timeString, ETA_SEC_FORM_STR, secs);
     
-  iLcd.setCursor(11, 3);
-  iLcd.print(timeString);
+  Print(11, 3, timeString);
 }
 
-void Display::DisplayLidTemp() {
+void Display::DisplayLidTemp(const Thermocycler::SStatus& status) {
   char buf[16];
-  sprintf_P(buf, LID_FORM_STR, (int)(GetThermocycler().GetLidTemp() + 0.5));
+  sprintf_P(buf, LID_FORM_STR, (int)(status.lidTemp + 0.5));
 
-  iLcd.setCursor(10, 2);
-  iLcd.print(buf);
+  Print(10, 2, buf);
 }
 
-void Display::DisplayBlockTemp() {
-  char buf[16];
+void Display::DisplayBlockTemp(const Thermocycler::SStatus& status) {
+  char buf[20]; //floatStr and " C"
   char floatStr[16];
   
-  sprintFloat(floatStr, GetThermocycler().GetPlateTemp(), 1, true);
+  sprintFloat(floatStr, status.plateTemp, 1, true);
   sprintf_P(buf, BLOCK_TEMP_FORM_STR, floatStr);
  
-  iLcd.setCursor(13, 0);
-  iLcd.print(buf);
+  Print(13, 0, buf);
 }
 
-void Display::DisplayCycle() {
+void Display::DisplayCycle(const Thermocycler::SStatus& status) {
   char buf[16];
   
-  iLcd.setCursor(0, 3);
-  sprintf_P(buf, CYCLE_FORM_STR, GetThermocycler().GetCurrentCycleNum(), GetThermocycler().GetNumCycles());
-  iLcd.print(buf);
+  sprintf_P(buf, CYCLE_FORM_STR, status.cycleNum, status.numCycles);
+  Print(0, 3, buf);
 }
 
-void Display::DisplayState() {
+void Display::DisplayState(const Thermocycler::SStatus& status) {
   char buf[32];
   char* stateStr;
   
-  switch (GetThermocycler().GetProgramState()) {
+  switch (status.state) {
   case Thermocycler::ELidWait:
     stateStr = rps(LIDWAIT_STR);
     break;
     
   case Thermocycler::ERunning:
   case Thermocycler::EComplete:
-    switch (GetThermocycler().GetThermalState()) {
+    switch (status.thermalState) {
     case Thermocycler::EHeating:
       stateStr = rps(HEATING_STR);
       break;
@@ -188,9 +207,10 @@ void Display::DisplayState() {
       stateStr = rps(COOLING_STR);
       break;
     case Thermocycler::EHolding:
-      stateStr = GetThermocycler().GetCurrentStep()->GetName();
+      stateStr = status.pStep != NULL ? status.pStep->GetName() : rps(STOPPED_STR);
       break;
     case Thermocycler::EIdle:
+    default:
       stateStr = rps(STOPPED_STR);
       break;
     }
@@ -199,9 +219,79 @@ void Display::DisplayState() {
   case Thermocycler::EStopped:
     stateStr = rps(STOPPED_STR);
     break;
+    
+  case Thermocycler::ETuning:
+    stateStr = rps(TUNING_STR);
+    break;
+    
+  default:
+    stateStr = rps(STOPPED_STR);
+    break;
   }
   
-  iLcd.setCursor(0, 0);
   sprintf_P(buf, STATE_FORM_STR, stateStr);
-  iLcd.print(buf);
+  Print(0, 0, buf);
+}
+
+// frame
+void Display::BeginLcd() {
+  //blank now, so only what isn't blank in the frame needs writing
+  iLcd.begin(DISPLAY_COLS, DISPLAY_ROWS);
+  iCursorCell = DISPLAY_NO_CELL;
+  iNumDirty = 0;
+  for (int cell = 0; cell < DISPLAY_CELLS; cell++) {
+    if (iFrame[cell / DISPLAY_COLS][cell % DISPLAY_COLS] != ' ') {
+      iDirty[cell / 8] |= 1 << (cell % 8);
+      iNumDirty++;
+    } else {
+      iDirty[cell / 8] &= ~(1 << (cell % 8));
+    }
+  }
+}
+
+void Display::ClearFrame() {
+  for (int row = 0; row < DISPLAY_ROWS; row++) {
+    for (int col = 0; col < DISPLAY_COLS; col++)
+      Print(col, row, " ");
+  }
+}
+
+// marks the characters that change as dirty, without writing to the LCD
+void Display::Print(int col, int row, const char* szText) {
+  for (; *szText != '\0' && col < DISPLAY_COLS; szText++, col++) {
+    if (iFrame[row][col] == *szText)
+      continue;
+    iFrame[row][col] = *szText;
+    
+    int cell = row * DISPLAY_COLS + col;
+    if (!(iDirty[cell / 8] & (1 << (cell % 8)))) {
+      iDirty[cell / 8] |= 1 << (cell % 8);
+      iNumDirty++;
+    }
+  }
+}
+
+// writes dirty cells for up to budget bus writes, each character being one
+// and moving the cursor another, carrying on from where the last stopped
+void Display::Flush(int budget) {
+  for (int i = 0; i < DISPLAY_CELLS && iNumDirty > 0; i++) {
+    int cell = iFlushCell;
+    if (iDirty[cell / 8] & (1 << (cell % 8))) {
+      int cost = cell == iCursorCell ? 1 : 2;
+      if (cost > budget)
+        return;
+      budget -= cost;
+      
+      int row = cell / DISPLAY_COLS;
+      int col = cell % DISPLAY_COLS;
+      if (cell != iCursorCell)
+        iLcd.setCursor(col, row);
+      iLcd.write(iFrame[row][col]);
+      iDirty[cell / 8] &= ~(1 << (cell % 8));
+      iNumDirty--;
+      //the next line doesn't follow on in the LCD's memory
+      iCursorCell = col < DISPLAY_COLS - 1 ? cell + 1 : DISPLAY_NO_CELL;
+    }
+    iFlushCell = (cell + 1) % DISPLAY_CELLS;
+  }
 }
@@ -22,8 +22,17 @@
 #include <LiquidCrystal.h>
 #include "thermocycler.h"
 
-class Cycle;
+#define DISPLAY_COLS  20
+#define DISPLAY_ROWS  4
+#define DISPLAY_CELLS (DISPLAY_COLS * DISPLAY_ROWS)
 
+////////////////////////////////////////////////////////////////////
+// Class Display
+//
+// Rendered into a frame of what the LCD should show a few times a second,
+// and only the characters that changed are written out, a few each
+// Update() so the loop never waits on the LCD for long.
+//
 class Display {
 public:
   Display();
@@ -33,19 +42,36 @@ public:
   
   void SetContrast(uint8_t contrast);
   void Clear();
+#ifdef DEBUG_DISPLAY
   void SetDebugMsg(char* szDebugMsg);
+#endif
   void Update();
   
 private:
-  void DisplayEta();
-  void DisplayLidTemp();
-  void DisplayBlockTemp();
-  void DisplayCycle();
-  void DisplayState();
+  void Render();
+  void DisplayEta(const Thermocycler::SStatus& status);
+  void DisplayLidTemp(const Thermocycler::SStatus& status);
+  void DisplayBlockTemp(const Thermocycler::SStatus& status);
+  void DisplayCycle(const Thermocycler::SStatus& status);
+  void DisplayState(const Thermocycler::SStatus& status);
+  
+  // frame
+  void BeginLcd();
+  void ClearFrame();
+  void Print(int col, int row, const char* szText);
+  void Flush(int budget);
   
 private:
   LiquidCrystal iLcd;
+  char iFrame[DISPLAY_ROWS][DISPLAY_COLS];
+  uint8_t iDirty[DISPLAY_CELLS / 8]; //a bit per cell not yet written to the LCD
+  uint8_t iNumDirty;
+  uint8_t iFlushCell; //to look at first next Flush()
+  uint8_t iCursorCell; //where the LCD writes next, DISPLAY_NO_CELL if not known
+  unsigned long iLastRender;
+#ifdef DEBUG_DISPLAY
   char iszDebugMsg[21];
+#endif
   Thermocycler::ProgramState iLastState;
   unsigned long iLastReset;
   uint8_t iContrast;
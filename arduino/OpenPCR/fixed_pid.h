@@ -0,0 +1,216 @@
+/*
+ *  fixed_pid.h - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FIXED_PID_H_
+#define _FIXED_PID_H_
+
+#include "PID_v1.h" //for AUTOMATIC, MANUAL, DIRECT and REVERSE
+
+////////////////////////////////////////////////////////////////////
+// Class FixedPID
+//
+// PID's algorithm and API in fixed point. The linked input, setpoint and
+// output, the output limits and the integral are all values in T with
+// FRAC_BITS fraction bits, so Compute() works only in integers; callers
+// convert with ToFixed() and ToInt() where values enter and leave control.
+// Gains stay double in the API and are converted when set; they read back
+// at T's resolution.
+//
+// A gain times a value is formed in two parts, the value's whole and its
+// fraction, so nothing wider than T is needed as long as gains stay under
+// 2^(bits - FRAC_BITS - 1) in T, 32767 for int32_t with 8 bits. Each term
+// is kept under TERM_MAX by clamping its operand, far past any real output,
+// so the three terms and the integral add up without overflowing.
+//
+template <class T, class TProduct, int FRAC_BITS>
+class FixedPID {
+public:
+  FixedPID(T* Input, T* Output, T* Setpoint,
+           double Kp, double Ki, double Kd, int ControllerDirection):
+    myInput(Input),
+    myOutput(Output),
+    mySetpoint(Setpoint),
+    inAuto(false),
+    controllerDirection(ControllerDirection),
+    kp(0),
+    ki(0),
+    kd(0),
+    iTerm(0),
+    lastInput(0),
+    lastError(0),
+    SampleTime(100) {
+    SetOutputLimits(0, ToFixed(255));
+    SetTunings(Kp, Ki, Kd);
+    lastTime = millis() - SampleTime;
+  }
+
+  void SetMode(int Mode) {
+    bool newAuto = (Mode == AUTOMATIC);
+    if (newAuto && !inAuto)
+      Initialize(); //we just went from manual to auto
+    inAuto = newAuto;
+  }
+
+  void Compute() {
+    if (!inAuto)
+      return;
+    unsigned long now = millis();
+    if (now - lastTime < (unsigned long)SampleTime)
+      return;
+
+    T input = *myInput;
+    T error = *mySetpoint - input;
+    iTerm = Clamp(iTerm + Multiply(ki, Clamp(error, -kiErrLimit, kiErrLimit)), outMin, outMax);
+    T dInput = input - lastInput;
+
+    T output = Multiply(kp, Clamp(error, -kpErrLimit, kpErrLimit)) + iTerm
+      - Multiply(kd, Clamp(dInput, -kdErrLimit, kdErrLimit));
+    *myOutput = Clamp(output, outMin, outMax);
+
+    lastInput = input;
+    lastError = error;
+    lastTime = now;
+  }
+
+  void SetOutputLimits(T Min, T Max) {
+    if (Min >= Max)
+      return;
+    outMin = Min;
+    outMax = Max;
+
+    if (inAuto) {
+      *myOutput = Clamp(*myOutput, outMin, outMax);
+      iTerm = Clamp(iTerm, outMin, outMax);
+    }
+  }
+
+  void ResetI() { iTerm = 0; }
+  T GetI() { return iTerm; }
+
+  void SetTunings(double Kp, double Ki, double Kd) {
+    if (Kp < 0 || Ki < 0 || Kd < 0)
+      return;
+
+    T oldKp = kp;
+    double sampleTimeInSec = ((double)SampleTime) / 1000;
+    kp = ToFixed(Kp);
+    ki = ToFixed(Ki * sampleTimeInSec);
+    kd = ToFixed(Kd / sampleTimeInSec);
+    if (controllerDirection == REVERSE) {
+      kp = -kp;
+      ki = -ki;
+      kd = -kd;
+    }
+    UpdateErrLimits();
+    
+    if (inAuto) {
+      //move the change in the proportional term into the integral so the
+      //output does not jump when gains are scheduled during operation
+      T limit = ErrLimit(oldKp - kp);
+      iTerm = Clamp(iTerm + Multiply(oldKp - kp, Clamp(lastError, -limit, limit)), outMin, outMax);
+    }
+  }
+
+  void SetControllerDirection(int Direction) {
+    if (inAuto && Direction != controllerDirection) {
+      kp = -kp;
+      ki = -ki;
+      kd = -kd;
+    }
+    controllerDirection = Direction;
+  }
+
+  void SetSampleTime(int NewSampleTime) {
+    if (NewSampleTime > 0) {
+      ki = (T)((TProduct)ki * NewSampleTime / SampleTime);
+      kd = (T)((TProduct)kd * SampleTime / NewSampleTime);
+      SampleTime = NewSampleTime;
+      UpdateErrLimits();
+    }
+  }
+
+  double GetKp() { return FromGain(kp); }
+  double GetKi() { return FromGain(ki) * 1000 / SampleTime; }
+  double GetKd() { return FromGain(kd) * SampleTime / 1000; }
+  int GetMode() { return inAuto ? AUTOMATIC : MANUAL; }
+  int GetDirection() { return controllerDirection; }
+
+  static T ToFixed(double val) {
+    return (T)(val * ((TProduct)1 << FRAC_BITS) + (val < 0 ? -0.5 : 0.5));
+  }
+
+  static int ToInt(T val) { //toward zero, as assigning a double to an int
+    return val / ((T)1 << FRAC_BITS);
+  }
+
+private:
+
+  static const T TERM_MAX = (T)1 << (sizeof(T) * 8 - 4);
+
+  // gain times value, exactly as (gain * value) >> FRAC_BITS
+  static T Multiply(T gain, T val) {
+    return gain * (val >> FRAC_BITS) + ((gain * (val & (((T)1 << FRAC_BITS) - 1))) >> FRAC_BITS);
+  }
+
+  static T Clamp(T val, T min, T max) {
+    return val > max ? max : (val < min ? min : val);
+  }
+
+  // largest operand for a gain that keeps the term under TERM_MAX
+  static T ErrLimit(T gain) {
+    if (gain < 0)
+      gain = -gain;
+    if (gain <= ((T)1 << FRAC_BITS))
+      return TERM_MAX;
+    return (TERM_MAX / gain) << FRAC_BITS;
+  }
+
+  double FromGain(T gain) {
+    return (controllerDirection == REVERSE ? -gain : gain) / (double)((TProduct)1 << FRAC_BITS);
+  }
+
+  void UpdateErrLimits() {
+    kpErrLimit = ErrLimit(kp);
+    kiErrLimit = ErrLimit(ki);
+    kdErrLimit = ErrLimit(kd);
+  }
+
+  void Initialize() {
+    iTerm = Clamp(*myOutput, outMin, outMax);
+    lastInput = *myInput;
+    lastError = *mySetpoint - lastInput;
+    lastTime = millis() - SampleTime;
+  }
+
+private:
+  T* myInput;
+  T* myOutput;
+  T* mySetpoint;
+
+  bool inAuto;
+  int controllerDirection;
+  T kp, ki, kd;
+  T kpErrLimit, kiErrLimit, kdErrLimit;
+  T iTerm, lastInput, lastError;
+  T outMin, outMax;
+
+  unsigned long lastTime;
+  int SampleTime;
+};
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ *  hardware.cpp - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcr_includes.h"
+#include "hardware.h"
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+static void (*spControlTick)() = NULL;
+static unsigned int sControlTickOverflows = 0;
+static unsigned int sControlOverflowCount = 0;
+static volatile uint32_t sAdcSum = 0;
+static volatile uint16_t sAdcCount = 0;
+static void (*spEepromReady)() = NULL;
+static void (*spSerialReady)() = NULL;
+
+#define ADC_MAX_SAMPLES 4096 //stop summing if nobody takes them, ~0.4s
+#define STACK_CANARY 0xC5
+
+extern uint8_t __heap_start; //end of the static data, from the linker
+
+// fills the RAM above the static data with STACK_CANARY before anything
+// runs, so the bytes the stack has never reached can be counted
+static void PaintStack() __attribute__((naked, used, section(".init3")));
+static void PaintStack() {
+  for (uint8_t* p = &__heap_start; p <= (uint8_t*)RAMEND; p++)
+    *p = STACK_CANARY;
+}
+
+////////////////////////////////////////////////////////////////////
+// Class Hardware
+void Hardware::InitSpi() {
+  // SPCR = 01010000
+  //interrupt disabled,spi enabled,msb 1st,master,clk low when idle,
+  //sample on leading edge of clk,system clock/4 rate (fastest)
+  byte clr;
+  SPCR = (1<<SPE)|(1<<MSTR)|(1<<4);
+  clr=SPSR;
+  clr=SPDR;
+  delay(10);
+}
+
+uint8_t Hardware::SpiTransfer(uint8_t data) {
+  SPDR = data;                    // Start the transmission
+  while (!(SPSR & (1<<SPIF)))     // Wait the end of the transmission
+  {
+  };
+  return SPDR;                    // return the received byte
+}
+
+void Hardware::InitPwm() {
+  // Peltier PWM
+  TCCR1A |= (1<<WGM11) | (1<<WGM10);
+  TCCR1B = _BV(CS21);
+  
+  // Lid PWM
+  TCCR2A = _BV(COM2A1) | _BV(COM2B1) | _BV(WGM21) | _BV(WGM20);
+  TCCR2B = _BV(CS22);
+}
+
+boolean Hardware::CheckRestarted() {
+  boolean restarted = !(MCUSR & 1);
+  MCUSR &= 0xFE;
+  return restarted;
+}
+
+void Hardware::Idle() {
+  //timer 0 wakes it for millis() at least every 1.024ms
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+}
+
+int Hardware::GetFreeRam() {
+  return SP - (int)&__heap_start;
+}
+
+int Hardware::GetLowestFreeRam() {
+  const uint8_t* p = &__heap_start;
+  while (p < (const uint8_t*)SP && *p == STACK_CANARY)
+    p++;
+  return p - &__heap_start;
+}
+
+void Hardware::StartControlTimer(unsigned int periodMs, void (*pTick)()) {
+  //timer 1 runs the Peltier PWM 10-bit phase correct at clk/8, so it
+  //overflows every 2 * 1023 * 0.5us = 1.023ms. Round up with 1ms to spare
+  //so the period never reads short against millis().
+  spControlTick = pTick;
+  sControlTickOverflows = ((unsigned long)(periodMs + 1) * 1000 + 1022) / 1023;
+  sControlOverflowCount = 0;
+  TIMSK1 |= _BV(TOIE1);
+}
+
+void Hardware::LockControl() {
+  TIMSK1 &= ~_BV(TOIE1);
+}
+
+void Hardware::UnlockControl() {
+  TIMSK1 |= _BV(TOIE1);
+}
+
+void Hardware::StartAdcSampling(uint8_t pin) {
+  //AVcc reference, free running at clk/128, 13 cycles per conversion gives
+  //a sample every 104us
+  ADMUX = _BV(REFS0) | (pin & 0x07);
+  ADCSRB = 0;
+  ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+void Hardware::TakeAdcSamples(uint32_t& sum, uint16_t& count) {
+  uint8_t oldSREG = SREG;
+  cli();
+  sum = sAdcSum;
+  count = sAdcCount;
+  sAdcSum = 0;
+  sAdcCount = 0;
+  SREG = oldSREG;
+}
+
+void Hardware::StartEepromWrites(void (*pReady)()) {
+  spEepromReady = pReady;
+  EECR |= _BV(EERIE);
+}
+
+void Hardware::StopEepromWrites() {
+  EECR &= ~_BV(EERIE);
+}
+
+void Hardware::WriteEeprom(int address, uint8_t val) {
+  EEAR = address;
+  EEDR = val;
+  EECR |= _BV(EEMPE);
+  EECR |= _BV(EEPE);
+}
+
+uint8_t Hardware::ReadEeprom(int address) {
+  uint8_t sreg = SREG;
+  cli();
+  uint8_t writing = EECR & _BV(EERIE);
+  EECR &= ~_BV(EERIE);
+  SREG = sreg;
+  while (EECR & _BV(EEPE)) //at most one write, ~3.4ms
+    ;
+  
+  //nothing may move EEAR between setting it and reading EEDR
+  cli();
+  EEAR = address;
+  EECR |= _BV(EERE);
+  uint8_t val = EEDR;
+  EECR |= writing;
+  SREG = sreg;
+  return val;
+}
+
+void Hardware::StartSerialWrites(void (*pReady)()) {
+  spSerialReady = pReady;
+  UCSR0B |= _BV(UDRIE0);
+}
+
+void Hardware::StopSerialWrites() {
+  UCSR0B &= ~_BV(UDRIE0);
+}
+
+void Hardware::WriteSerial(uint8_t val) {
+  UDR0 = val;
+}
+
+ISR(USART_UDRE_vect) {
+  spSerialReady();
+}
+
+ISR(EE_READY_vect) {
+  spEepromReady();
+}
+
+ISR(ADC_vect) {
+  if (sAdcCount < ADC_MAX_SAMPLES) {
+    sAdcSum += ADC;
+    sAdcCount++;
+  }
+}
+
+ISR(TIMER1_OVF_vect) {
+  if (++sControlOverflowCount < sControlTickOverflows)
+    return;
+  sControlOverflowCount = 0;
+  
+  //run the tick with interrupts enabled so millis() and serial receive keep
+  //working, but keep this interrupt off until it completes
+  TIMSK1 &= ~_BV(TOIE1);
+  sei();
+  spControlTick();
+  cli();
+  TIMSK1 |= _BV(TOIE1);
+}
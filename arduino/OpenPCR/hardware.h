@@ -0,0 +1,75 @@
+/*
+ *  hardware.h - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HARDWARE_H_
+#define _HARDWARE_H_
+
+////////////////////////////////////////////////////////////////////
+// Class Hardware
+//
+// Register-level access to the ATmega peripherals. Everything else goes
+// through the Arduino core (millis, analogRead, analogWrite, digitalWrite...),
+// so together with the core this is the whole hardware abstraction layer.
+// hardware.cpp implements it for the AVR, sim/ implements it for the host
+// simulator.
+//
+class Hardware {
+public:
+  static void InitSpi();
+  static uint8_t SpiTransfer(uint8_t data);
+  static void InitPwm();
+  static boolean CheckRestarted(); //reads and clears the power-on reset flag
+  static void Idle(); //until the next interrupt, for waits on one
+  
+  // RAM between the static data and the stack, now and the least there has
+  // been since reset. Nothing is allocated on the heap.
+  static int GetFreeRam();
+  static int GetLowestFreeRam();
+  
+  // Calls pTick from the timer interrupt at least periodMs apart as seen by
+  // millis(), with other interrupts enabled. The background must hold the
+  // lock while changing anything the tick uses.
+  static void StartControlTimer(unsigned int periodMs, void (*pTick)());
+  static void LockControl();
+  static void UnlockControl();
+  
+  // Free-running conversions of one analog pin, summed from the ADC
+  // interrupt until taken. analogRead() must not be used once started.
+  static void StartAdcSampling(uint8_t pin);
+  static void TakeAdcSamples(uint32_t& sum, uint16_t& count);
+  
+  // Calls pReady from the EEPROM ready interrupt whenever no write is
+  // programming, until stopped. pReady writes the next byte with
+  // WriteEeprom() or calls StopEepromWrites(). Everything else reads with
+  // ReadEeprom(), which holds the interrupt off and waits out any write, so
+  // the control tick works from copies in RAM instead.
+  static void StartEepromWrites(void (*pReady)());
+  static void StopEepromWrites();
+  static void WriteEeprom(int address, uint8_t val); //from pReady only
+  static uint8_t ReadEeprom(int address);
+  
+  // Calls pReady from the UART data register empty interrupt whenever the
+  // transmitter can take a byte, until stopped. pReady sends the next byte
+  // with WriteSerial() or calls StopSerialWrites(). Serial.write() must not
+  // be used once started.
+  static void StartSerialWrites(void (*pReady)());
+  static void StopSerialWrites();
+  static void WriteSerial(uint8_t val); //from pReady only
+};
+
+#endif
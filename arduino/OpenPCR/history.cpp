@@ -0,0 +1,141 @@
+/*
+ *  history.cpp - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcr_includes.h"
+#include "history.h"
+
+#ifdef RUN_HISTORY
+
+#define DEFAULT_HISTORY_INTERVAL_S 10
+
+static uint8_t sSamples[HISTORY_SAMPLES][HISTORY_ENTRY_SIZE];
+static uint8_t sMarks[HISTORY_MARKS][HISTORY_ENTRY_SIZE];
+static uint8_t sNumSamples = 0;
+static uint8_t sNumMarks = 0;
+static uint16_t sSamplesOffered = 0;
+static uint16_t sMarksOffered = 0;
+static uint16_t sSampleStride = 1; //samples taken per sample kept
+static uint16_t sMarkStride = 1;
+static unsigned long sStartMs = 0;
+static uint8_t sIntervalS = DEFAULT_HISTORY_INTERVAL_S;
+static uint8_t sNextIntervalS = DEFAULT_HISTORY_INTERVAL_S;
+static uint8_t sEndState = 0;
+static boolean sRecording = false;
+
+////////////////////////////////////////////////////////////////////
+// Class RunHistory
+void RunHistory::Begin() {
+  sNumSamples = 0;
+  sNumMarks = 0;
+  sSamplesOffered = 0;
+  sMarksOffered = 0;
+  sSampleStride = 1;
+  sMarkStride = 1;
+  sStartMs = millis();
+  sIntervalS = sNextIntervalS;
+  sEndState = 0;
+  sRecording = true;
+}
+
+void RunHistory::AddSample(float plateTemp, float lidTemp, int peltierPwm) {
+  uint8_t* pEntry = NextEntry(sSamples, sNumSamples, HISTORY_SAMPLES, sSamplesOffered, sSampleStride);
+  if (pEntry == NULL)
+    return;
+  
+  long centiTemp = plateTemp * 100 + 0.5;
+  int halfTemp = lidTemp * 2 + 0.5;
+  uint16_t plate = constrain(centiTemp, 0, 0xFFFF);
+  pEntry[0] = plate & 0xff;
+  pEntry[1] = plate >> 8;
+  pEntry[2] = constrain(halfTemp, 0, 0xFF);
+  pEntry[3] = peltierPwm / 8;
+}
+
+void RunHistory::AddMark(uint8_t stepIndex, uint16_t cycle) {
+  uint8_t* pEntry = NextEntry(sMarks, sNumMarks, HISTORY_MARKS, sMarksOffered, sMarkStride);
+  if (pEntry == NULL)
+    return;
+  
+  uint16_t timeS = (millis() - sStartMs) / 1000;
+  pEntry[0] = timeS & 0xff;
+  pEntry[1] = timeS >> 8;
+  pEntry[2] = stepIndex;
+  pEntry[3] = cycle < 0xFF ? cycle : 0xFF;
+}
+
+void RunHistory::End(uint8_t programState) {
+  sEndState = programState;
+  sRecording = false;
+}
+
+boolean RunHistory::IsRecording() {
+  return sRecording;
+}
+
+uint8_t RunHistory::GetIntervalS() {
+  return sIntervalS;
+}
+
+void RunHistory::SetIntervalS(uint8_t intervalS) {
+  sNextIntervalS = intervalS;
+}
+
+uint16_t RunHistory::GetSampleIntervalS() {
+  return sIntervalS * sSampleStride;
+}
+
+uint8_t RunHistory::GetEndState() {
+  return sEndState;
+}
+
+int RunHistory::GetNumSamples() {
+  return sNumSamples;
+}
+
+int RunHistory::GetNumMarks() {
+  return sNumMarks;
+}
+
+const uint8_t* RunHistory::GetSample(int index) {
+  return sSamples[index];
+}
+
+const uint8_t* RunHistory::GetMark(int index) {
+  return sMarks[index];
+}
+
+// Private
+// the entry for the next one offered to a table, NULL if it is one skipped;
+// once the table is full every other entry goes and only every other one
+// offered from then on is kept (the one offered then among them, as the
+// table size is even)
+uint8_t* RunHistory::NextEntry(uint8_t table[][HISTORY_ENTRY_SIZE], uint8_t& count, uint8_t size,
+    uint16_t& offered, uint16_t& stride) {
+  if (offered++ % stride != 0)
+    return NULL;
+  
+  if (count == size) {
+    for (int i = 1; i < size / 2; i++)
+      memcpy(table[i], table[i * 2], HISTORY_ENTRY_SIZE);
+    count = size / 2;
+    stride *= 2;
+  }
+  return table[count++];
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ *  history.h - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+////////////////////////////////////////////////////////////////////
+// Class RunHistory
+//
+// The current or last run, for the host to read once it is over (see
+// HISTORY_REQ). EEPROM is all taken, so it is kept in RAM until the next run
+// or a reset, in two tables of 4 byte entries, little endian:
+//
+//   sample  plate temp (u16 0.01 C), lid temp (u8 0.5 C), Peltier PWM / 8
+//           (i8)
+//   mark    time into the run (u16 s), step index, cycle (u8, 255 and up
+//           are 255)
+//
+// The nth sample is from n sample intervals into the run. When the samples
+// fill, every other one goes and the interval doubles, so they always span
+// the whole run. There is a mark the first time through each step and at
+// the start of every cycle after that, as the host has the program and can
+// tell the rest from those; they go every other one in the same way, so a
+// run with more than HISTORY_MARKS of them keeps its start and end.
+//
+// Kept with RUN_HISTORY defined, otherwise there is no history.
+//
+#define HISTORY_ENTRY_SIZE 4
+
+class RunHistory {
+public:
+  // recording, from Thermocycler::Loop()
+  static void Begin(); //clears the last run
+  static void AddSample(float plateTemp, float lidTemp, int peltierPwm);
+  static void AddMark(uint8_t stepIndex, uint16_t cycle);
+  static void End(uint8_t programState);
+  
+  // accessors
+  static boolean IsRecording();
+  static uint8_t GetIntervalS(); //between samples taken, of the run recorded
+  static void SetIntervalS(uint8_t intervalS); //from the next run
+  static uint16_t GetSampleIntervalS(); //between samples kept
+  static uint8_t GetEndState(); //program state the run ended in
+  static int GetNumSamples();
+  static int GetNumMarks();
+  static const uint8_t* GetSample(int index); //0 is the first
+  static const uint8_t* GetMark(int index);
+  
+private:
+  static uint8_t* NextEntry(uint8_t table[][HISTORY_ENTRY_SIZE], uint8_t& count, uint8_t size,
+    uint16_t& offered, uint16_t& stride);
+};
+
+#endif
@@ -20,9 +20,11 @@
 #include <EEPROM.h>
 
 #include "pcr_includes.h"
+#include "hardware.h"
 #include "thermocycler.h"
 
 Thermocycler* gpThermocycler = NULL;
+static uint8_t sThermocyclerStorage[sizeof(Thermocycler)] __attribute__((aligned)); //constructed in setup(), once the core is up
 
 boolean InitialStart() {
   for (int i = 0; i < 50; i++) {
@@ -40,10 +42,9 @@ void setup() {
   }
   
   //restart detection
-  boolean restarted = !(MCUSR & 1);
-  MCUSR &= 0xFE;
+  boolean restarted = Hardware::CheckRestarted();
     
-  gpThermocycler = new Thermocycler(restarted);
+  gpThermocycler = new (sThermocyclerStorage) Thermocycler(restarted);
 }
 
 void loop() {
@@ -20,6 +20,10 @@
 #define _PCR_INCLUDES_H_
 
 //#define DEBUG_DISPLAY
+#define FIXED_POINT_PID //plate and lid PID in fixed point, comment out for PID_v1
+#define PLATE_FEEDFORWARD //model-based plate ramps, comment out for bang-bang then PID
+//#define LOOP_PROFILER //phase timings for PROFILE_REQ, ~280 bytes of RAM
+//#define RUN_HISTORY //run history for HISTORY_REQ, ~280 bytes of RAM, NAKed without
 
 #include "WProgram.h"
 #include <avr/pgmspace.h>
@@ -29,14 +33,26 @@ extern Thermocycler* gpThermocycler;
 inline Thermocycler& GetThermocycler() { return *gpThermocycler; }
 
 //fixes for incomplete C++ implementation, defined in util.cpp
-void* operator new(size_t size);
-void operator delete(void * ptr);
+#ifdef __AVR__
+inline void* operator new(size_t size, void* pMem) { return pMem; } //placement, there is no <new>
 extern "C" void __cxa_pure_virtual(void);
+#else
+#include <new>
+#endif
 
-//defines
+//defines, the tables sized to leave ~430 of the 2K of RAM for the stack
 #define STEP_NAME_LENGTH       16
-#define MAX_CYCLE_ITEMS        16
+#define MAX_PROGRAM_STEPS      20
+#define MAX_PROGRAM_LOOPS       4
+#define MAX_PROGRAM_INCREMENTS  4
+#define PROGRAM_NAME_BYTES     64
 #define MAX_COMMAND_SIZE      256
+#define MAX_LIBRARY_PROGRAMS    8
+#define HISTORY_SAMPLES        24 //even, see RunHistory
+#define HISTORY_MARKS          40 //even
+#define MAX_PLATE_GAIN_POINTS  4
+#define ETA_NUM_BANDS          5
+#define ETA_BAND_WIDTH         20 //C, the last band is open ended
 
 enum PcrStatus {
   ESuccess = 0,
@@ -49,6 +65,7 @@ enum PcrStatus {
 
 void sprintFloat(char* str, float val, int decimalDigits, boolean pad);
 unsigned short htons(unsigned short val);
+uint16_t crc16Update(uint16_t crc, uint8_t val);
 double absf(double val);
 char* rps(const char* progString);
 
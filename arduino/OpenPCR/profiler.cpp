@@ -0,0 +1,81 @@
+/*
+ *  profiler.cpp - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcr_includes.h"
+#include "profiler.h"
+
+#ifdef LOOP_PROFILER
+
+#include "hardware.h"
+
+#define PROFILE_FIRST_BUCKET_US 64 //each bucket after is 4 times wider
+
+// the tick phases are added from the control timer interrupt and the loop
+// ones from the background, so each is only ever written from one of them
+static SProfileStats sStats[PROFILE_PHASES];
+static unsigned long sLastMarkUs[PROFILE_PHASES]; //0 until the first since a reset
+
+////////////////////////////////////////////////////////////////////
+// Class LoopProfiler
+// with the control tick locked out
+void LoopProfiler::Reset() {
+  memset(sStats, 0, sizeof(sStats));
+  memset(sLastMarkUs, 0, sizeof(sLastMarkUs));
+}
+
+void LoopProfiler::Add(uint8_t phase, unsigned long us) {
+  SProfileStats& stats = sStats[phase];
+  if (stats.count == 0xFFFF) {
+    //halve everything rather than wrap, keeping the average and shape
+    stats.sum /= 2;
+    stats.count /= 2;
+    for (int i = 0; i < PROFILE_BUCKETS; i++)
+      stats.buckets[i] /= 2;
+  }
+  
+  unsigned long ticks = us / PROFILE_TICK_US;
+  uint16_t time = ticks > 0xFFFF ? 0xFFFF : ticks;
+  if (stats.count == 0 || time < stats.min)
+    stats.min = time;
+  if (time > stats.max)
+    stats.max = time;
+  stats.sum += time;
+  stats.count++;
+  
+  int bucket = 0;
+  for (unsigned long limit = PROFILE_FIRST_BUCKET_US; us >= limit && bucket < PROFILE_BUCKETS - 1; limit *= 4)
+    bucket++;
+  stats.buckets[bucket]++;
+}
+
+void LoopProfiler::Mark(uint8_t phase, unsigned long periodUs) {
+  unsigned long now = micros();
+  if (sLastMarkUs[phase] != 0) {
+    unsigned long elapsedUs = now - sLastMarkUs[phase];
+    Add(phase, elapsedUs > periodUs ? elapsedUs - periodUs : periodUs - elapsedUs);
+  }
+  sLastMarkUs[phase] = now | 1; //never 0
+}
+
+void LoopProfiler::GetStats(uint8_t phase, SProfileStats& stats) {
+  Hardware::LockControl();
+  stats = sStats[phase];
+  Hardware::UnlockControl();
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ *  profiler.h - OpenPCR control software.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+enum ProfilePhase {
+  EProfileCheckPower = 0, //control tick
+  EProfileReadPlateTemp,
+  EProfileReadLidTemp,
+  EProfileControlPeltier,
+  EProfileControlLid,
+  EProfileUpdateEta, //loop
+  EProfileDisplay,
+  EProfileSerial,
+  EProfileTickJitter, //difference of the control tick period from CONTROL_PERIOD_MS
+  EProfileLoopPeriod,
+  PROFILE_PHASES
+};
+
+#define PROFILE_TICK_US  4 //resolution of micros() on the 16MHz board
+#define PROFILE_BUCKETS  7 //under 64us, 256us, 1ms, 4ms, 16ms, 64ms, and the rest
+
+////////////////////////////////////////////////////////////////////
+// Class LoopProfiler
+//
+// Times of each phase of the control tick and loop, and the jitter and
+// period of each, with LOOP_PROFILER defined. Without it the macros below
+// are just the call, and nothing is kept.
+//
+#ifdef LOOP_PROFILER
+
+#define PROFILE_PHASE(phase, call) { \
+  unsigned long profileStartUs = micros(); \
+  call; \
+  LoopProfiler::Add(phase, micros() - profileStartUs); \
+}
+#define PROFILE_MARK(phase, periodUs) LoopProfiler::Mark(phase, periodUs)
+
+struct SProfileStats {
+  uint16_t min; //PROFILE_TICK_US
+  uint16_t max;
+  uint32_t sum;
+  uint16_t count;
+  uint16_t buckets[PROFILE_BUCKETS];
+};
+
+class LoopProfiler {
+public:
+  static void Reset(); //with the control tick locked out
+  static void Add(uint8_t phase, unsigned long us);
+  static void Mark(uint8_t phase, unsigned long periodUs); //time since the last, less periodUs
+  static void GetStats(uint8_t phase, SProfileStats& stats);
+};
+
+#else
+
+#define PROFILE_PHASE(phase, call) call
+#define PROFILE_MARK(phase, periodUs)
+
+#endif
+
+#endif
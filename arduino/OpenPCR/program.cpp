@@ -19,233 +19,800 @@
 #include "pcr_includes.h"
 #include "program.h"
 
-#include <EEPROM.h>
-
 #include "display.h"
+#include "hardware.h"
 
 ////////////////////////////////////////////////////////////////////
-// Class Step
-void Step::SetName(const char* szName) {
-  strncpy(iName, szName, sizeof(iName));
-  iName[sizeof(iName) - 1] = '\0';
-}
-
-void Step::Reset() {
-  iStepReturned = false;
-  iDuration = 0;
-  iTemp = 0;
-  iName[0] = '\0'; 
-}
-
-void Step::BeginIteration() {
-  iStepReturned = false;
-}
-
-Step* Step::GetNextStep() {
-  if (iStepReturned) {
-    return NULL;
-  } else {
-    iStepReturned = true;
-    return this;
-  }
+// Class BinaryReader
+uint8_t BinaryReader::Get(int offset) const {
+  return ipBuffer != NULL ? ipBuffer[offset] : Hardware::ReadEeprom(iAddress + offset);
 }
 
 ////////////////////////////////////////////////////////////////////
-// Class Cycle
-ProgramComponent* Cycle::GetComponent(int index) {
-  return iComponents[index];
-}
-
-PcrStatus Cycle::AddComponent(ProgramComponent* pComponent) {
-  if (iNumComponents >= MAX_CYCLE_ITEMS)
-    return ETooManySteps;
-  
-  iComponents[iNumComponents++] = pComponent;
-  return ESuccess;
-}
-
-void Cycle::Reset() {
-  iNumComponents = 0;
-  iNumCycles = 0;
-  iCurrentCycle = 0;
-  iCurrentComponent = 0;
-}
-
-// iteration
-void Cycle::BeginIteration() {
-  iCurrentCycle = 0;
-  RestartCycle();
+// Class CommandParser
+static uint16_t ReadUint16(const uint8_t* pBytes) {
+  return pBytes[0] | (pBytes[1] << 8);
 }
 
-Step* Cycle::GetNextStep() {
-  //check for next step of existing component
-  Step* pNextStep = iComponents[iCurrentComponent]->GetNextStep();
-  
-  //advance to next component if current component done
-  if (pNextStep == NULL && ++iCurrentComponent < iNumComponents)
-    pNextStep = iComponents[iCurrentComponent]->GetNextStep(); //should never be NULL
+// a rejected command is left as ENone
+boolean CommandParser::ParseCommand(SCommand& command, const char* pCommandBuf, int length) {
+  memset(&command, 0, sizeof(command));
+  if ((uint8_t)pCommandBuf[0] == BINARY_COMMAND_MAGIC)
+    return ParseBinaryCommand(command, BinaryReader((const uint8_t*)pCommandBuf, length));
   
-  //advance to next cycle if current cycle done
-  if (pNextStep == NULL && ++iCurrentCycle < iNumCycles) {
-    RestartCycle();
+  //key=value params separated by '&', read in place and left as they were
+  //so the command can still be stored
+  const char* pParam = pCommandBuf;
+  while (pParam != NULL) {
+    const char* pNextParam = strchr(pParam, '&');
+    const char* pParamEnd = pNextParam != NULL ? pNextParam++ : pParam + strlen(pParam);
+    if (pParam[0] != '\0' && pParam[1] == '=' && !AddComponent(&command, pParam[0], pParam + 2, pParamEnd - pParam - 2)) {
+      memset(&command, 0, sizeof(command));
+      return false;
+    }
+    pParam = pNextParam;
+  }
   
-    //return first component of that cycle
-    pNextStep = iComponents[iCurrentComponent]->GetNextStep(); //should never be NULL
+  if (command.command == SCommand::EDelete) {
+    if (command.programId == 0)
+      command.command = SCommand::ENone;
+    return true; //leaves any run alone
   }
-      
-  return pNextStep;
+  
+  gpThermocycler->Stop();
+  if (command.command == SCommand::EStart && command.pProgram == NULL && command.programId != 0)
+    LoadLibraryProgram(command);
+  return true;
 }
 
-void Cycle::RestartCycle() {
-  iCurrentComponent = 0;
+// length of the command, ASCII or binary, to store
+int CommandParser::GetCommandLength(const char* pCommandBuf, int length) {
+  if ((uint8_t)pCommandBuf[0] != BINARY_COMMAND_MAGIC)
+    return strnlen(pCommandBuf, length);
   
-  for (int i = 0; i < iNumComponents; i++)
-    iComponents[i]->BeginIteration();
+  int commandLength = length >= BINARY_V1_HEADER_SIZE ? ReadUint16((const uint8_t*)pCommandBuf + 2) : 0;
+  return commandLength <= length ? commandLength : 0;
 }
 
-////////////////////////////////////////////////////////////////////
-// Class CommandParser
-void CommandParser::ParseCommand(SCommand& command, char* pCommandBuf) {
-  char* pValue;
-  memset(&command, NULL, sizeof(command));
-  char buf[32];
-
-  gpThermocycler->Stop(); //need to stop here to reset program pools
-    
-  char* pParam = strtok(pCommandBuf, "&");
-  while (pParam) {  
-    pValue = strchr(pParam, '=');
-    *pValue++ = '\0';
-    AddComponent(&command, pParam[0], pValue);
-    pParam = strtok(NULL, "&");
-  }
+static boolean ValueIs_P(const char* pValue, int length, const char* szMatch) {
+  return length == (int)strlen_P(szMatch) && strncmp_P(pValue, szMatch, length) == 0;
 }
 
-void CommandParser::AddComponent(SCommand* pCommand, char key, char* szValue) {
+// false if the value can't be taken
+boolean CommandParser::AddComponent(SCommand* pCommand, char key, const char* pValue, int length) {
   switch(key) {
   case 'n':
-    strncpy(pCommand->name, szValue, sizeof(pCommand->name) - 1);
-    pCommand->name[sizeof(pCommand->name) - 1] = '\0';
+    if (length > (int)sizeof(pCommand->name) - 1)
+      length = sizeof(pCommand->name) - 1;
+    memcpy(pCommand->name, pValue, length);
+    pCommand->name[length] = '\0';
     break;
   case 'c':
-    if (strcmp(szValue, "start") == 0)
+    if (ValueIs_P(pValue, length, PSTR("start")))
       pCommand->command = SCommand::EStart;
-    else if (strcmp(szValue, "stop") == 0)
+    else if (ValueIs_P(pValue, length, PSTR("stop")))
       pCommand->command = SCommand::EStop;
-    else if (strcmp(szValue, "cfg") == 0)
+    else if (ValueIs_P(pValue, length, PSTR("cfg")))
       pCommand->command = SCommand::EConfig;
+    else if (ValueIs_P(pValue, length, PSTR("tune")))
+      pCommand->command = SCommand::ETune;
+    else if (ValueIs_P(pValue, length, PSTR("delete")))
+      pCommand->command = SCommand::EDelete;
+    break;
+  case 'i':
+    pCommand->programId = atoi(pValue);
+    if (pCommand->programId > MAX_LIBRARY_PROGRAMS)
+      pCommand->programId = 0;
     break;
   case 'l':
-    pCommand->lidTemp = atoi(szValue);
+    pCommand->lidTemp = atoi(pValue);
     break;
   case 'o':
-    pCommand->contrast = atoi(szValue);
+    pCommand->contrast = atoi(pValue);
   case 'd':
-    pCommand->commandId = atoi(szValue);
+    pCommand->commandId = atoi(pValue);
     break;
   case 'p':
-    pCommand->pProgram = ParseProgram(szValue);
-    break;
+    gpThermocycler->Stop(); //need to stop here before the program is replaced
+    pCommand->pProgram = ParseProgram(pValue, pValue + length);
+    return pCommand->pProgram != NULL;
   }
+  return true;
 }
 
-Cycle* CommandParser::ParseProgram(char* pBuffer) {
-  Cycle* pProgram = gpThermocycler->GetCyclePool().AllocateComponent();
-  pProgram->SetNumCycles(1);
-	
-  char* pCycBuf = strtok(pBuffer, "()");
-  while (pCycBuf != NULL) {
-    pProgram->AddComponent(ParseCycle(pCycBuf));
-    pCycBuf = strtok(NULL, "()");
+// (count[step][step]...) groups, which may nest; NULL if the program doesn't
+// fit, as ValidateBinaryProgram() rejects a binary one
+Program* CommandParser::ParseProgram(const char* pBuffer, const char* pEnd) {
+  Program* pProgram = &gpThermocycler->GetProgram();
+  pProgram->Reset();
+  
+  const char* pNext = pBuffer;
+  while (pNext < pEnd) {
+    if (*pNext == '(') {
+      if (!SUCCEEDED(pProgram->BeginLoop(strtol(pNext + 1, (char**)&pNext, 10))))
+        return NULL;
+      
+    } else if (*pNext == '[') {
+      const char* pStepEnd = (const char*)memchr(pNext, ']', pEnd - pNext);
+      if (pStepEnd == NULL)
+        break;
+      if (!SUCCEEDED(ParseStep(pProgram, pNext + 1, pStepEnd)))
+        return NULL;
+      pNext = pStepEnd + 1;
+      
+    } else {
+      if (*pNext == ')')
+        pProgram->EndLoop();
+      pNext++;
+    }
   }
   
+  pProgram->Compile();
   return pProgram;
 }
 
-ProgramComponent* CommandParser::ParseCycle(char* pBuffer) {
-  char countBuf[5];
-	
-  //find first step
-  char* pStep = strchr(pBuffer, '[');
-	
-  //get cycle count
-  int countLen = pStep - pBuffer;
-  strncpy(countBuf, pBuffer, countLen);
-  countBuf[countLen] = '\0';
-  int cycCount = atoi(countBuf);
+// duration|temp|name, then optional per cycle increments: temp delta, temp
+// limit (empty for none) and duration delta, e.g. [30|65|Anneal|-0.5|55]
+#define STEP_FIELDS 6
+PcrStatus CommandParser::ParseStep(Program* pProgram, const char* pBuffer, const char* pEnd) {
+  const char* pFields[STEP_FIELDS + 1];
+  int numFields = 0;
+  const char* pField = pBuffer;
+  while (pField != NULL && numFields < STEP_FIELDS) {
+    pFields[numFields++] = pField;
+    pField = (const char*)memchr(pField, '|', pEnd - pField);
+    if (pField != NULL)
+      pField++;
+  }
+  if (numFields < 3)
+    return ESuccess; //not a step, skipped
+  pFields[numFields] = pField != NULL ? pField : pEnd + 1; //one past each field's end
+  
+  const char* pName = pFields[2];
+  PcrStatus status = pProgram->AddStep(atoi(pFields[0]), ParseCentiTemp(pFields[1]), pName, pFields[3] - 1 - pName);
   
-  Cycle* pCycle = gpThermocycler->GetCyclePool().AllocateComponent();
-  pCycle->SetNumCycles(cycCount);
-	
-  //add steps
-  while (pStep != NULL) {
-    *pStep++ = '\0';
-    char* pStepEnd = strchr(pStep, ']');
-    *pStepEnd++ = '\0';
+  if (SUCCEEDED(status) && numFields > 3) {
+    int centiTempLimit = NO_CENTI_TEMP_LIMIT;
+    if (numFields > 4 && pFields[5] - 1 > pFields[4])
+      centiTempLimit = ParseCentiTemp(pFields[4]);
+    int durationDelta = numFields > 5 ? atoi(pFields[5]) : 0;
+    status = pProgram->AddIncrement(ParseCentiTemp(pFields[3]), centiTempLimit, durationDelta);
+  }
+  return status;
+}
 
-    Step* pNewStep = ParseStep(pStep);
-    pCycle->AddComponent(pNewStep);
-    pStep = strchr(pStepEnd, '[');
+// decimal C to 0.01 C, rounded, without pulling in the float parser
+int CommandParser::ParseCentiTemp(const char* szValue) {
+  while (*szValue == ' ')
+    szValue++;
+  boolean negative = *szValue == '-';
+  if (negative || *szValue == '+')
+    szValue++;
+  
+  long value = 0;
+  while (*szValue >= '0' && *szValue <= '9')
+    value = value * 10 + *szValue++ - '0';
+  value *= 100;
+  if (*szValue == '.') {
+    szValue++;
+    for (int scale = 10; scale > 0 && *szValue >= '0' && *szValue <= '9'; scale /= 10)
+      value += (*szValue++ - '0') * scale;
+    if (*szValue >= '5' && *szValue <= '9')
+      value++;
   }
+  return negative ? -value : value;
+}
+
+// header fields into command and where the ops are, false if the header
+// is not one this firmware can read
+boolean CommandParser::ReadBinaryHeader(SCommand& command, const BinaryReader& reader, int& opsOffset, int& opsLength) {
+  int length = reader.GetLength();
+  if (length < BINARY_V1_HEADER_SIZE || reader.Get(0) != BINARY_COMMAND_MAGIC)
+    return false;
+  uint8_t version = reader.Get(1);
+  int headerSize = version == 1 ? BINARY_V1_HEADER_SIZE : BINARY_HEADER_SIZE;
+  if (version < 1 || version > BINARY_COMMAND_VERSION || length < headerSize)
+    return false;
+  int commandLength = reader.GetUint16(2);
+  int nameLength = reader.Get(headerSize - 1);
+  if (commandLength > length || headerSize + nameLength > commandLength || reader.Get(6) > SCommand::EDelete)
+    return false;
+  
+  command.commandId = reader.GetUint16(4);
+  command.command = (SCommand::TCommandType)reader.Get(6);
+  command.lidTemp = reader.Get(7);
+  command.contrast = reader.Get(8);
+  command.programId = version == 1 ? 0 : reader.Get(9);
+  if (command.programId > MAX_LIBRARY_PROGRAMS)
+    return false;
+  
+  int copyLength = nameLength < (int)sizeof(command.name) - 1 ? nameLength : sizeof(command.name) - 1;
+  for (int i = 0; i < copyLength; i++)
+    command.name[i] = reader.Get(headerSize + i);
+  command.name[copyLength] = '\0';
+  
+  opsOffset = headerSize + nameLength;
+  opsLength = commandLength - opsOffset;
+  return true;
+}
 
-  return pCycle;
+boolean CommandParser::ParseBinaryCommand(SCommand& command, const BinaryReader& reader) {
+  int opsOffset, opsLength;
+  if (!ReadBinaryHeader(command, reader, opsOffset, opsLength) || !ValidateBinaryProgram(reader, opsOffset, opsLength)
+      || ((command.command == SCommand::EStore || command.command == SCommand::EDelete) && command.programId == 0)
+      || (command.command == SCommand::EStore && opsLength == 0)) {
+    memset(&command, 0, sizeof(command));
+    return false;
+  }
+  if (command.command == SCommand::EStore || command.command == SCommand::EDelete)
+    return true; //leaves any run alone
+    
+  gpThermocycler->Stop(); //need to stop here before the program is replaced
+  
+  if (opsLength > 0)
+    command.pProgram = LoadBinaryProgram(reader, opsOffset, opsLength);
+  else if (command.command == SCommand::EStart && command.programId != 0)
+    LoadLibraryProgram(command);
+  return true;
 }
 
-Step* CommandParser::ParseStep(char* pBuffer) {
-  char* pTemp = strchr(pBuffer, '|');
-  *pTemp++ = '\0';
-  char* pName = strchr(pTemp, '|');
-  *pName++ = '\0';
-  char* pEnd = strchr(pName, ']');
-  *pEnd = '\0';
-	
-  int duration = atoi(pBuffer);
-  float temp = atof(pTemp);
+// everything LoadBinaryProgram() relies on: complete ops, balanced loops
+// and a program that fits
+boolean CommandParser::ValidateBinaryProgram(const BinaryReader& reader, int offset, int length) {
+  int steps = 0, loops = 0, increments = 0, depth = 0;
+  uint8_t lastOp = 0;
+  
+  while (length > 0) {
+    int opSize = GetBinaryOpSize(reader, offset, length);
+    if (opSize == 0)
+      return false;
+    
+    uint8_t op = reader.Get(offset);
+    switch (op) {
+    case BINARY_OP_STEP:
+      if (++steps > MAX_PROGRAM_STEPS)
+        return false;
+      break;
+    case BINARY_OP_LOOP:
+      if (++depth > PROGRAM_MAX_DEPTH)
+        return false;
+      if (reader.GetUint16(offset + 1) > 1 && ++loops > MAX_PROGRAM_LOOPS)
+        return false;
+      break;
+    case BINARY_OP_END_LOOP:
+      if (--depth < 0)
+        return false;
+      break;
+    case BINARY_OP_INCREMENT:
+      if (lastOp != BINARY_OP_STEP || ++increments > MAX_PROGRAM_INCREMENTS)
+        return false;
+      break;
+    }
+    lastOp = op;
+    offset += opSize;
+    length -= opSize;
+  }
+  return depth == 0;
+}
 
-  Step* pStep = gpThermocycler->GetStepPool().AllocateComponent();
+Program* CommandParser::LoadBinaryProgram(const BinaryReader& reader, int offset, int length) {
+  Program* pProgram = &gpThermocycler->GetProgram();
+  pProgram->Reset();
+  
+  while (length > 0) {
+    int opSize = GetBinaryOpSize(reader, offset, length);
+    switch (reader.Get(offset)) {
+    case BINARY_OP_STEP: {
+      char name[STEP_NAME_LENGTH];
+      int nameLength = reader.Get(offset + 5) < STEP_NAME_LENGTH ? reader.Get(offset + 5) : STEP_NAME_LENGTH;
+      for (int i = 0; i < nameLength; i++)
+        name[i] = reader.Get(offset + 6 + i);
+      pProgram->AddStep(reader.GetUint16(offset + 1), (int16_t)reader.GetUint16(offset + 3), name, nameLength);
+      break;
+    }
+    case BINARY_OP_LOOP:
+      pProgram->BeginLoop(reader.GetUint16(offset + 1));
+      break;
+    case BINARY_OP_END_LOOP:
+      pProgram->EndLoop();
+      break;
+    case BINARY_OP_INCREMENT:
+      pProgram->AddIncrement((int16_t)reader.GetUint16(offset + 1), (int16_t)reader.GetUint16(offset + 3),
+                             (int16_t)reader.GetUint16(offset + 5));
+      break;
+    }
+    offset += opSize;
+    length -= opSize;
+  }
   
-  pStep->SetName(pName);
-  pStep->SetDuration(duration);
-  pStep->SetTemp(temp);
-  return pStep;
+  pProgram->Compile();
+  return pProgram;
 }
 
+// 0 if unknown or cut short
+int CommandParser::GetBinaryOpSize(const BinaryReader& reader, int offset, int remaining) {
+  int size;
+  switch (reader.Get(offset)) {
+  case BINARY_OP_STEP:
+    size = remaining < 6 ? 6 : 6 + reader.Get(offset + 5);
+    break;
+  case BINARY_OP_LOOP:
+    size = 3;
+    break;
+  case BINARY_OP_END_LOOP:
+    size = 1;
+    break;
+  case BINARY_OP_INCREMENT:
+    size = 7;
+    break;
+  default:
+    return 0;
+  }
+  return size <= remaining ? size : 0;
+}
+
+// the program stored under command.programId, read in place from EEPROM,
+// with its name and lid temperature unless the command has its own
+void CommandParser::LoadLibraryProgram(SCommand& command) {
+  int address, length;
+  if (!ProgramStore::FindLibraryProgram(command.programId, address, length))
+    return;
+  
+  SCommand stored;
+  BinaryReader reader(address, length);
+  int opsOffset, opsLength;
+  if (!ReadBinaryHeader(stored, reader, opsOffset, opsLength) || opsLength == 0
+      || !ValidateBinaryProgram(reader, opsOffset, opsLength))
+    return;
+  
+  if (command.name[0] == '\0')
+    strcpy(command.name, stored.name);
+  if (command.lidTemp == 0)
+    command.lidTemp = stored.lidTemp;
+  command.pProgram = LoadBinaryProgram(reader, opsOffset, opsLength);
+}
 
 ////////////////////////////////////////////////////////////////////
 // Class ProgramStore
 //
 // Note: Byte 0 of EEPROM is used for contrast
-//       Bytes 1 and onwards are used for stored program string
+//       Bytes 1 to MAX_COMMAND_SIZE are the program library
+//       Bytes after that hold the tuned gain schedule: a marker byte, the
+//       SGainSchedule and a checksum byte
+//       Then the learned ETA rates, the same way with an SEtaRates
+//       PROGRAM_LOG_ADDRESS to the end of EEPROM is the command log
+//
+// The command log keeps the last start command for restart after a reset.
+// Each store is a new record on the next PROGRAM_LOG_PAGE boundary after
+// the latest, so writes work their way round the whole log instead of
+// wearing the same cells:
+//
+//   marker, sequence (u16), length (u16), CRC-16 of the sequence, length
+//   and data (u16), then the data
+//
+// The marker is cleared first and written last, so a record cut short by
+// a reset is never valid and the one before it still is. The valid record
+// with the highest sequence is the latest; one with no data means nothing
+// to restart. A record is at most 17 pages of the 40, so a new one never
+// overlaps the latest.
 //
+// The library keeps binary commands by id in LIBRARY_PAGE pages, each
+// program first fit in as many pages as it needs:
+//
+//   marker, id, length, CRC-16 of the id, length and data (u16), then the
+//   data
+//
+// written the same way as log records. A program replacing one with the
+// same id goes into free pages, and the old one is cleared once the new
+// one is written. If a reset comes in between, the first found is kept.
+//
+// All writes are queued and made from the EEPROM ready interrupt, skipping
+// bytes that already hold the right value, so they cost the loop nothing.
+// Record headers, the gains and the ETA rates are copied into the queue
+// with their checksums. Command data is read from the caller's buffer as it
+// is written, so callers leave it as it is until Flush().
+//
+#define GAINS_ADDRESS (MAX_COMMAND_SIZE + 1)
+#define GAINS_MARKER 0x47
+#define ETA_RATES_ADDRESS (GAINS_ADDRESS + sizeof(SGainSchedule) + 2)
+#define ETA_RATES_MARKER 0x45
+
+#define PROGRAM_LOG_ADDRESS   384
+#define PROGRAM_LOG_SIZE      640
+#define PROGRAM_LOG_PAGE      16
+#define PROGRAM_RECORD_MARKER 0xC5
+
+#define LIBRARY_ADDRESS       1
+#define LIBRARY_SIZE          MAX_COMMAND_SIZE
+#define LIBRARY_PAGE          16
+#define LIBRARY_NUM_PAGES     (LIBRARY_SIZE / LIBRARY_PAGE)
+#define LIBRARY_RECORD_HEADER 5
+#define LIBRARY_RECORD_MARKER 0xB3
+#define LIBRARY_MAX_LENGTH    (LIBRARY_SIZE - LIBRARY_RECORD_HEADER)
+#define LIBRARY_NO_PAGE       0xFF
+
+#define EEPROM_QUEUE_SIZE     8 //one less can be queued
+#define EEPROM_MAX_SKIPS      16 //unchanged bytes checked per interrupt
+#define EEPROM_DATA_SIZE      (sizeof(SGainSchedule) + PROGRAM_RECORD_HEADER) //queued copies
+
+// a run of bytes, or one value when pData is NULL
+struct SEepromWrite {
+  uint16_t address;
+  const uint8_t* pData;
+  uint16_t length;
+  uint8_t value;
+};
+
+static SEepromWrite sEepromQueue[EEPROM_QUEUE_SIZE];
+static volatile uint8_t sEepromHead = 0; //next to write, moved by the interrupt
+static volatile uint8_t sEepromTail = 0; //next free, moved by the background
+static uint16_t sEepromOffset = 0; //into the write at the head
+static uint8_t sEepromData[EEPROM_DATA_SIZE]; //QueueData(), until the queue empties
+static uint8_t sEepromDataUsed = 0;
+
+int ProgramStore::iLatestRecord = -1;
+uint16_t ProgramStore::iLatestSequence = 0;
+uint16_t ProgramStore::iLatestLength = 0;
+boolean ProgramStore::iLogScanned = false;
+uint8_t ProgramStore::iLibraryPages[MAX_LIBRARY_PROGRAMS];
+uint8_t ProgramStore::iLibraryLengths[MAX_LIBRARY_PROGRAMS];
+boolean ProgramStore::iLibraryScanned = false;
+
 uint8_t ProgramStore::RetrieveContrast() {
-  return EEPROM.read(0);
+  return Hardware::ReadEeprom(0);
 }
 
-#define PROG_START_STR "&c=start"
-const char PROG_START_STR_P[] PROGMEM = PROG_START_STR;
 boolean ProgramStore::RetrieveProgram(SCommand& command, char* pBuffer) {
-  for (int i = 0; i < MAX_COMMAND_SIZE; i++)
-    pBuffer[i] = EEPROM.read(i + 1);
+  ScanLog();
+  if (iLatestRecord == -1 || iLatestLength == 0)
+    return false;
   
-  if (strncmp_P(pBuffer, PROG_START_STR_P, strlen(PROG_START_STR)) == 0) {
-    //previous program stored
-    CommandParser::ParseCommand(command, pBuffer);   
+  for (int i = 0; i < iLatestLength; i++)
+    pBuffer[i] = ReadLog(iLatestRecord + PROGRAM_RECORD_HEADER + i);
+  pBuffer[iLatestLength] = '\0';
+  
+  CommandParser::ParseCommand(command, pBuffer, iLatestLength);
+  return command.command == SCommand::EStart;
+}
+
+boolean ProgramStore::RetrieveGains(SGainSchedule& gains) {
+  return ReadRecord(GAINS_ADDRESS, GAINS_MARKER, &gains, sizeof(gains))
+    && gains.numPlatePoints > 0 && gains.numPlatePoints <= MAX_PLATE_GAIN_POINTS;
+}
+
+boolean ProgramStore::RetrieveEtaRates(SEtaRates& rates) {
+  return ReadRecord(ETA_RATES_ADDRESS, ETA_RATES_MARKER, &rates, sizeof(rates));
+}
+
+void ProgramStore::StoreContrast(uint8_t contrast) {
+  QueueWrite(0, NULL, 1, contrast);
+}
+
+void ProgramStore::StoreGains(const SGainSchedule& gains) {
+  WriteRecord(GAINS_ADDRESS, GAINS_MARKER, &gains, sizeof(gains));
+}
+
+void ProgramStore::StoreEtaRates(const SEtaRates& rates) {
+  WriteRecord(ETA_RATES_ADDRESS, ETA_RATES_MARKER, &rates, sizeof(rates));
+}
+
+boolean ProgramStore::StoreCommand(const SCommand& command, const char* pCommandBuf, int length) {
+  if (command.command == SCommand::EConfig || command.command == SCommand::ENone)
+    return true; //leaves the stored program as it was
+  if (command.command == SCommand::EStore)
+    return StoreLibraryProgram(command.programId, pCommandBuf, CommandParser::GetCommandLength(pCommandBuf, length));
+  if (command.command == SCommand::EDelete) {
+    DeleteLibraryProgram(command.programId);
     return true;
-    
-  } else {
+  }
+  
+  ScanLog();
+  if (command.command == SCommand::EStart)
+    length = CommandParser::GetCommandLength(pCommandBuf, length);
+  else
+    length = 0; //nothing to restart
+  
+  //already stored?
+  if (iLatestRecord != -1 && length == iLatestLength) {
+    int i;
+    for (i = 0; i < length && ReadLog(iLatestRecord + PROGRAM_RECORD_HEADER + i) == (uint8_t)pCommandBuf[i]; i++);
+    if (i == length)
+      return true;
+  } else if (iLatestRecord == -1 && length == 0) {
+    return true;
+  }
+  
+  int record = 0;
+  if (iLatestRecord != -1) {
+    int pages = (PROGRAM_RECORD_HEADER + iLatestLength + PROGRAM_LOG_PAGE - 1) / PROGRAM_LOG_PAGE;
+    record = (iLatestRecord + pages * PROGRAM_LOG_PAGE) % PROGRAM_LOG_SIZE;
+  }
+  
+  uint16_t sequence = iLatestSequence + 1;
+  uint8_t* pHeader = QueueData(PROGRAM_RECORD_HEADER);
+  pHeader[0] = PROGRAM_RECORD_MARKER;
+  pHeader[1] = sequence & 0xff;
+  pHeader[2] = sequence >> 8;
+  pHeader[3] = length & 0xff;
+  pHeader[4] = length >> 8;
+  uint16_t crc = 0xFFFF;
+  for (int i = 1; i < 5; i++)
+    crc = crc16Update(crc, pHeader[i]);
+  for (int i = 0; i < length; i++)
+    crc = crc16Update(crc, pCommandBuf[i]);
+  pHeader[5] = crc & 0xff;
+  pHeader[6] = crc >> 8;
+  
+  //marker cleared first, then the data, the rest of the header and the
+  //marker
+  if (ReadLog(record) == PROGRAM_RECORD_MARKER)
+    QueueLog(record, NULL, 1);
+  QueueLog(record + PROGRAM_RECORD_HEADER, (const uint8_t*)pCommandBuf, length);
+  QueueLog(record + 1, pHeader + 1, PROGRAM_RECORD_HEADER - 1);
+  QueueLog(record, pHeader, 1);
+  
+  iLatestRecord = record;
+  iLatestSequence = sequence;
+  iLatestLength = length;
+  return true;
+}
+
+void ProgramStore::Flush() {
+  while (sEepromHead != sEepromTail)
+    Hardware::Idle();
+}
+
+boolean ProgramStore::FindLibraryProgram(uint8_t id, int& address, int& length) {
+  ScanLibrary();
+  if (id == 0 || id > MAX_LIBRARY_PROGRAMS || iLibraryPages[id - 1] == LIBRARY_NO_PAGE)
+    return false;
+  
+  address = LIBRARY_ADDRESS + iLibraryPages[id - 1] * LIBRARY_PAGE + LIBRARY_RECORD_HEADER;
+  length = iLibraryLengths[id - 1];
+  return true;
+}
+
+int ProgramStore::GetLibraryRoom() {
+  ScanLibrary();
+  int largest = 0, run = 0;
+  for (int page = 0; page < LIBRARY_NUM_PAGES; page++) {
+    run = IsLibraryPageFree(page) ? run + 1 : 0;
+    if (run > largest)
+      largest = run;
+  }
+  return largest > 0 ? largest * LIBRARY_PAGE - LIBRARY_RECORD_HEADER : 0;
+}
+
+boolean ProgramStore::StoreLibraryProgram(uint8_t id, const char* pCommandBuf, int length) {
+  ScanLibrary();
+  if (length == 0 || length > LIBRARY_MAX_LENGTH)
     return false;
+  
+  //already stored?
+  int oldPage = iLibraryPages[id - 1];
+  if (oldPage != LIBRARY_NO_PAGE && iLibraryLengths[id - 1] == length) {
+    int address = LIBRARY_ADDRESS + oldPage * LIBRARY_PAGE + LIBRARY_RECORD_HEADER;
+    int i;
+    for (i = 0; i < length && Hardware::ReadEeprom(address + i) == (uint8_t)pCommandBuf[i]; i++);
+    if (i == length)
+      return true;
   }
+  
+  //first fit, leaving the old one until the new one is written
+  int pages = GetLibraryPages(length);
+  int page, run = 0;
+  for (page = 0; page < LIBRARY_NUM_PAGES && run < pages; page++)
+    run = IsLibraryPageFree(page) ? run + 1 : 0;
+  if (run < pages)
+    return false; //no room
+  page -= pages;
+  
+  uint8_t* pHeader = QueueData(LIBRARY_RECORD_HEADER);
+  pHeader[0] = LIBRARY_RECORD_MARKER;
+  pHeader[1] = id;
+  pHeader[2] = length;
+  uint16_t crc = 0xFFFF;
+  for (int i = 1; i < 3; i++)
+    crc = crc16Update(crc, pHeader[i]);
+  for (int i = 0; i < length; i++)
+    crc = crc16Update(crc, pCommandBuf[i]);
+  pHeader[3] = crc & 0xff;
+  pHeader[4] = crc >> 8;
+  
+  int address = LIBRARY_ADDRESS + page * LIBRARY_PAGE;
+  if (Hardware::ReadEeprom(address) == LIBRARY_RECORD_MARKER)
+    QueueWrite(address, NULL, 1, 0);
+  QueueWrite(address + LIBRARY_RECORD_HEADER, (const uint8_t*)pCommandBuf, length, 0);
+  QueueWrite(address + 1, pHeader + 1, LIBRARY_RECORD_HEADER - 1, 0);
+  QueueWrite(address, pHeader, 1, 0);
+  if (oldPage != LIBRARY_NO_PAGE)
+    QueueWrite(LIBRARY_ADDRESS + oldPage * LIBRARY_PAGE, NULL, 1, 0);
+  
+  iLibraryPages[id - 1] = page;
+  iLibraryLengths[id - 1] = length;
+  return true;
 }
 
+void ProgramStore::DeleteLibraryProgram(uint8_t id) {
+  ScanLibrary();
+  if (iLibraryPages[id - 1] == LIBRARY_NO_PAGE)
+    return;
+  
+  QueueWrite(LIBRARY_ADDRESS + iLibraryPages[id - 1] * LIBRARY_PAGE, NULL, 1, 0);
+  iLibraryPages[id - 1] = LIBRARY_NO_PAGE;
+}
+
+// finds the valid programs, once, and clears any left twice by a reset
+void ProgramStore::ScanLibrary() {
+  if (iLibraryScanned)
+    return;
+  iLibraryScanned = true;
+  memset(iLibraryPages, LIBRARY_NO_PAGE, sizeof(iLibraryPages));
+  
+  int page = 0;
+  while (page < LIBRARY_NUM_PAGES) {
+    int address = LIBRARY_ADDRESS + page * LIBRARY_PAGE;
+    uint8_t id = Hardware::ReadEeprom(address + 1);
+    uint8_t length = Hardware::ReadEeprom(address + 2);
+    if (Hardware::ReadEeprom(address) != LIBRARY_RECORD_MARKER || id == 0 || id > MAX_LIBRARY_PROGRAMS
+        || length == 0 || page + GetLibraryPages(length) > LIBRARY_NUM_PAGES) {
+      page++;
+      continue;
+    }
+    
+    uint16_t crc = 0xFFFF;
+    crc = crc16Update(crc, id);
+    crc = crc16Update(crc, length);
+    for (int i = 0; i < length; i++)
+      crc = crc16Update(crc, Hardware::ReadEeprom(address + LIBRARY_RECORD_HEADER + i));
+    if (crc != (Hardware::ReadEeprom(address + 3) | (Hardware::ReadEeprom(address + 4) << 8))) {
+      page++;
+      continue;
+    }
+    
+    if (iLibraryPages[id - 1] == LIBRARY_NO_PAGE) {
+      iLibraryPages[id - 1] = page;
+      iLibraryLengths[id - 1] = length;
+    } else {
+      QueueWrite(address, NULL, 1, 0);
+    }
+    page += GetLibraryPages(length);
+  }
+}
 
+int ProgramStore::GetLibraryPages(int length) {
+  return (LIBRARY_RECORD_HEADER + length + LIBRARY_PAGE - 1) / LIBRARY_PAGE;
+}
 
-void ProgramStore::StoreContrast(uint8_t contrast) {
-  EEPROM.write(0, contrast);
+boolean ProgramStore::IsLibraryPageFree(int page) {
+  for (int id = 0; id < MAX_LIBRARY_PROGRAMS; id++) {
+    int first = iLibraryPages[id];
+    if (first != LIBRARY_NO_PAGE && page >= first && page < first + GetLibraryPages(iLibraryLengths[id]))
+      return false;
+  }
+  return true;
 }
 
-void ProgramStore::StoreProgram(const char* szProgram) {
-  for (int i = 0; i < MAX_COMMAND_SIZE; i++)
-    EEPROM.write(i + 1, szProgram[i]);
+// room for queued data that stays as it is until written, waiting for the
+// queue to empty if there is none
+uint8_t* ProgramStore::QueueData(int length) {
+  if (sEepromHead == sEepromTail)
+    sEepromDataUsed = 0;
+  if (sEepromDataUsed + length > (int)EEPROM_DATA_SIZE) {
+    Flush();
+    sEepromDataUsed = 0;
+  }
+  uint8_t* pData = sEepromData + sEepromDataUsed;
+  sEepromDataUsed += length;
+  return pData;
 }
 
+// waits for room if the queue is full
+void ProgramStore::QueueWrite(int address, const uint8_t* pData, int length, uint8_t value) {
+  uint8_t tail = sEepromTail;
+  uint8_t next = (tail + 1) % EEPROM_QUEUE_SIZE;
+  while (next == sEepromHead)
+    Hardware::Idle();
+  
+  SEepromWrite& write = sEepromQueue[tail];
+  write.address = address;
+  write.pData = pData;
+  write.length = length;
+  write.value = value;
+  sEepromTail = next;
+  Hardware::StartEepromWrites(EepromReady);
+}
 
+// into the log, split where it wraps; NULL data clears
+void ProgramStore::QueueLog(int offset, const uint8_t* pData, int length) {
+  offset %= PROGRAM_LOG_SIZE;
+  while (length > 0) {
+    int runLength = length < PROGRAM_LOG_SIZE - offset ? length : PROGRAM_LOG_SIZE - offset;
+    QueueWrite(PROGRAM_LOG_ADDRESS + offset, pData, runLength, 0);
+    if (pData != NULL)
+      pData += runLength;
+    length -= runLength;
+    offset = 0;
+  }
+}
+
+// from the EEPROM ready interrupt: starts writing the next byte that differs
+void ProgramStore::EepromReady() {
+  int skips = 0;
+  while (sEepromHead != sEepromTail) {
+    SEepromWrite& write = sEepromQueue[sEepromHead];
+    while (sEepromOffset < write.length) {
+      int address = write.address + sEepromOffset;
+      uint8_t val = write.pData != NULL ? write.pData[sEepromOffset] : write.value;
+      sEepromOffset++;
+      if (Hardware::ReadEeprom(address) != val) {
+        Hardware::WriteEeprom(address, val);
+        return;
+      }
+      if (++skips == EEPROM_MAX_SKIPS)
+        return; //back straight away, after anything more urgent
+    }
+    sEepromOffset = 0;
+    sEepromHead = (sEepromHead + 1) % EEPROM_QUEUE_SIZE;
+  }
+  Hardware::StopEepromWrites();
+}
+
+uint8_t ProgramStore::ReadLog(int offset) {
+  return Hardware::ReadEeprom(PROGRAM_LOG_ADDRESS + offset % PROGRAM_LOG_SIZE);
+}
+
+// finds the latest valid record, once
+void ProgramStore::ScanLog() {
+  if (iLogScanned)
+    return;
+  iLogScanned = true;
+  
+  for (int record = 0; record < PROGRAM_LOG_SIZE; record += PROGRAM_LOG_PAGE) {
+    if (ReadLog(record) != PROGRAM_RECORD_MARKER)
+      continue;
+    uint16_t sequence = ReadLog(record + 1) | (ReadLog(record + 2) << 8);
+    uint16_t length = ReadLog(record + 3) | (ReadLog(record + 4) << 8);
+    if (length > MAX_COMMAND_SIZE)
+      continue;
+    if (iLatestRecord != -1 && (int16_t)(sequence - iLatestSequence) <= 0)
+      continue;
+    
+    uint16_t crc = 0xFFFF;
+    for (int i = 1; i < 5; i++)
+      crc = crc16Update(crc, ReadLog(record + i));
+    for (int i = 0; i < length; i++)
+      crc = crc16Update(crc, ReadLog(record + PROGRAM_RECORD_HEADER + i));
+    if (crc != (ReadLog(record + 5) | (ReadLog(record + 6) << 8)))
+      continue;
+    
+    iLatestRecord = record;
+    iLatestSequence = sequence;
+    iLatestLength = length;
+  }
+}
+
+// marker byte, data, then a checksum byte of the data
+boolean ProgramStore::ReadRecord(int address, uint8_t marker, void* pData, int size) {
+  if (Hardware::ReadEeprom(address) != marker)
+    return false;
+    
+  uint8_t* pBytes = (uint8_t*)pData;
+  uint8_t checksum = 0;
+  for (int i = 0; i < size; i++) {
+    pBytes[i] = Hardware::ReadEeprom(address + 1 + i);
+    checksum += pBytes[i];
+  }
+  return Hardware::ReadEeprom(address + 1 + size) == checksum;
+}
+
+void ProgramStore::WriteRecord(int address, uint8_t marker, const void* pData, int size) {
+  uint8_t* pBytes = QueueData(size);
+  memcpy(pBytes, pData, size);
+  uint8_t checksum = 0;
+  for (int i = 0; i < size; i++)
+    checksum += pBytes[i];
+  QueueWrite(address + 1, pBytes, size, 0);
+  QueueWrite(address + 1 + size, NULL, 1, checksum);
+  QueueWrite(address, NULL, 1, marker);
+}
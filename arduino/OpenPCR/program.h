@@ -19,109 +19,350 @@
 #ifndef _PROGRAM_H_
 #define _PROGRAM_H_
 
-class Step;
-
-////////////////////////////////////////////////////////////////////
-// Class ProgramComponent
-class ProgramComponent {
-public:
-  enum TType {
-    EStep = 0,
-    ECycle
-  };
-  
-  virtual void Reset() = 0;
-  virtual TType GetType() = 0;
-  
-  // iteration
-  virtual void BeginIteration() = 0;
-  virtual Step* GetNextStep() = 0;
-};
-
 ////////////////////////////////////////////////////////////////////
 // Class Step
-class Step: public ProgramComponent {
+//
+// The current step of a running program, unpacked from its record.
+//
+class Step {
 public:  
   // accessors
-  char* GetName() { return iName; }
+  char* GetName() { return ipName; }
   int GetDuration() { return iDuration; }
   float GetTemp() { return iTemp; }
-  virtual TType GetType() { return EStep; }
   boolean IsFinal() { return iDuration == 0; }
 
   // mutators
   void SetDuration(int duration) { iDuration = duration; }
   void SetTemp(float temp) { iTemp = temp; }
-  void SetName(const char* szName);
-  
-  virtual void Reset();
-  
-  // iteration
-  virtual void BeginIteration();
-  virtual Step* GetNextStep();
+  void SetName(char* pName) { ipName = pName; } //not copied
 
 private:
   int iDuration; //in seconds
   float iTemp; // C
-  boolean iStepReturned;
-  char iName[STEP_NAME_LENGTH];
+  char* ipName;
 };
 
 ////////////////////////////////////////////////////////////////////
-// Class Cycle
-class Cycle: public ProgramComponent {
+// Class ProgramTable
+//
+// A program compiled into a flat table: packed step records in run order,
+// with a loop begin and loop end record around each repeated group. Groups
+// may nest up to PROGRAM_MAX_DEPTH. Step names are kept once each in a
+// shared pool. Running it is a record index and one counter per loop, so
+// getting the next step is O(1). Compile() works out the hold time and
+// ramp degrees once, so nothing walks the program again while it runs.
+//
+// A step may change each time round its innermost loop, by a temperature
+// delta up to a limit and a duration delta (touchdown, or longer extensions
+// as the product builds up). These increments are applied as the step is
+// reached, so one record covers every cycle.
+//
+// Sized at build time: MAX_STEPS up to 64, MAX_LOOPS repeated groups,
+// MAX_INCREMENTS steps with increments and NAME_BYTES of distinct step
+// names. 5 bytes per step, 3 per loop, 8 per increment.
+//
+#define PROGRAM_MAX_DEPTH 4
+
+#define NO_CENTI_TEMP_LIMIT -32768
+
+#define RECORD_STEP       0x00
+#define RECORD_LOOP_BEGIN 0x40
+#define RECORD_LOOP_END   0x80
+#define RECORD_TYPE_MASK  0xC0
+#define RECORD_INDEX_MASK 0x3F
+
+template <int MAX_STEPS, int MAX_LOOPS, int MAX_INCREMENTS, int NAME_BYTES>
+class ProgramTable {
 public:
+  ProgramTable() { Reset(); }
+  
+  // building, then Compile() once complete
+  void Reset() {
+    iNumSteps = 0;
+    iNumLoops = 0;
+    iNumIncrements = 0;
+    iNumRecords = 0;
+    iDepth = 0;
+    iNameBytes = 1;
+    iNames[0] = '\0'; //for names that don't fit
+    iTotalHoldS = 0;
+    memset(iRampDegrees, 0, sizeof(iRampDegrees));
+    iDisplayLoop = -1;
+    BeginIteration();
+  }
+  
+  // temperatures in 0.01 C, the name needn't be null terminated
+  PcrStatus AddStep(int duration, int centiTemp, const char* pName, int nameLength) {
+    if (iNumSteps == MAX_STEPS)
+      return ETooManySteps;
+    
+    SStepRecord& step = iSteps[iNumSteps];
+    step.duration = duration;
+    step.centiTemp = centiTemp;
+    step.name = AddName(pName, nameLength);
+    iRecords[iNumRecords++] = RECORD_STEP | iNumSteps++;
+    return ESuccess;
+  }
+  
+  // per iteration of the innermost loop for the last step added; the
+  // temperature stops at centiTempLimit, NO_CENTI_TEMP_LIMIT for none
+  PcrStatus AddIncrement(int centiTempDelta, int centiTempLimit, int durationDelta) {
+    if (iNumSteps == 0)
+      return ESuccess;
+    if (iNumIncrements == MAX_INCREMENTS)
+      return ETooManySteps;
+    
+    SIncrement& increment = iIncrements[iNumIncrements++];
+    increment.step = iNumSteps - 1;
+    increment.loop = -1;
+    for (int i = iDepth - 1; i >= 0 && increment.loop == -1; i--) {
+      if (i < PROGRAM_MAX_DEPTH)
+        increment.loop = iOpenLoops[i];
+    }
+    increment.centiTempDelta = centiTempDelta;
+    increment.centiTempLimit = centiTempLimit;
+    increment.durationDelta = durationDelta;
+    return ESuccess;
+  }
+  
+  PcrStatus BeginLoop(int count) {
+    if (iDepth >= PROGRAM_MAX_DEPTH) {
+      iDepth++; //flattened into the enclosing loop
+      return ETooManySteps;
+    }
+    
+    iOpenLoops[iDepth++] = -1;
+    if (count <= 1)
+      return ESuccess; //runs once, no records needed
+    if (iNumLoops == MAX_LOOPS)
+      return ETooManySteps;
+    
+    iOpenLoops[iDepth - 1] = iNumLoops;
+    iLoops[iNumLoops].begin = iNumRecords;
+    iLoops[iNumLoops].count = count;
+    iRecords[iNumRecords++] = RECORD_LOOP_BEGIN | iNumLoops++;
+    return ESuccess;
+  }
+  
+  void EndLoop() {
+    if (iDepth == 0)
+      return;
+    if (iDepth-- > PROGRAM_MAX_DEPTH)
+      return;
+    
+    int loop = iOpenLoops[iDepth];
+    if (loop == -1)
+      return;
+    if (iLoops[loop].begin == iNumRecords - 1) {
+      //no steps, drop it
+      iNumRecords--;
+      iNumLoops--;
+    } else {
+      iRecords[iNumRecords++] = RECORD_LOOP_END | loop;
+    }
+  }
+  
+  void Compile() {
+    while (iDepth > 0)
+      EndLoop();
+    
+    //run through once for the hold time and ramp degrees up to the final
+    //step; a step's first ramp is from wherever the plate is, so not counted
+    Step* pStep;
+    float lastTemp = 0;
+    boolean first = true;
+    BeginIteration();
+    while ((pStep = GetNextStep()) && !pStep->IsFinal()) {
+      iTotalHoldS += pStep->GetDuration();
+      if (!first)
+        AddRamp(lastTemp, pStep->GetTemp());
+      lastTemp = pStep->GetTemp();
+      first = false;
+    }
+    BeginIteration();
+    
+    for (int i = 0; i < iNumLoops; i++) {
+      if (iDisplayLoop == -1 || iLoops[i].count > iLoops[iDisplayLoop].count)
+        iDisplayLoop = i;
+    }
+  }
+  
   // accessors
-  virtual TType GetType() { return ECycle; }
-  int GetCurrentCycle() { return iCurrentCycle + 1; } //add 1 because cycles start at 0
-  int GetNumCycles() { return iNumCycles; }
-  int GetNumComponents() { return iNumComponents; }
-  ProgramComponent* GetComponent(int index);
+  int GetNumSteps() { return iNumSteps; }
+  unsigned long GetTotalHoldS() { return iTotalHoldS; } //up to the final step
+  float* GetRampDegrees(int direction) { return iRampDegrees[direction]; } //from the first step until the run takes them out, see SplitRamp()
+  unsigned long GetHoldOffsetS() { return iHoldOffsetS; } //hold time before the current step
+  int GetCurrentStepIndex() { return iStepIndex; } //in the order the steps were added
   
-  // mutators
-  void SetNumCycles(int numCycles) { iNumCycles = numCycles; }
-  PcrStatus AddComponent(ProgramComponent* pComponent); //takes ownership
-  virtual void Reset();
+  int GetNumCycles() {
+    return iDisplayLoop == -1 ? 1 : iLoops[iDisplayLoop].count;
+  }
+  
+  int GetCurrentCycleNum() {
+    if (iDisplayLoop == -1)
+      return 1;
+    int cycle = iLoopIterations[iDisplayLoop] + 1;
+    return cycle > iLoops[iDisplayLoop].count ? iLoops[iDisplayLoop].count : cycle;
+  }
   
   // iteration
-  virtual void BeginIteration();
-  virtual Step* GetNextStep();
+  void BeginIteration() {
+    iPosition = 0;
+    iStepIndex = 0;
+    iHoldOffsetS = 0;
+    iCurrent.SetDuration(0);
+    memset(iLoopIterations, 0, sizeof(iLoopIterations));
+  }
   
-private:
-  void RestartCycle();
-
-private:
-  ProgramComponent* iComponents[MAX_CYCLE_ITEMS];
-  int iNumComponents;
-  int iNumCycles;
+  Step* GetNextStep() { //NULL when done
+    //loops aren't empty, so only loop records up to the nesting depth
+    //come between two steps
+    iHoldOffsetS += iCurrent.GetDuration();
+    while (iPosition < iNumRecords) {
+      int index = iRecords[iPosition] & RECORD_INDEX_MASK;
+      switch (iRecords[iPosition++] & RECORD_TYPE_MASK) {
+      case RECORD_STEP:
+        iStepIndex = index;
+        LoadStep(index);
+        return &iCurrent;
+      case RECORD_LOOP_BEGIN:
+        iLoopIterations[index] = 0;
+        break;
+      case RECORD_LOOP_END:
+        if (++iLoopIterations[index] < iLoops[index].count)
+          iPosition = iLoops[index].begin + 1;
+        break;
+      }
+    }
+    iCurrent.SetDuration(0);
+    return NULL;
+  }
   
-  int iCurrentCycle;
-  int iCurrentComponent; // -1 means no component
-};
-
-////////////////////////////////////////////////////////////////////
-// Class ProgramComponentPool
-template <class T, int N>
-class ProgramComponentPool {
-public:
-  ProgramComponentPool() { iAllocatedComponents = 0; }
-
-  T* AllocateComponent() { 
-    if (iAllocatedComponents == N)
-      return NULL;
+  // degrees of a ramp in each ETA_BAND_WIDTH band, returns the direction,
+  // 0 heating or 1 cooling
+  static int SplitRamp(double fromTemp, double toTemp, float degrees[ETA_NUM_BANDS]) {
+    int direction = toTemp < fromTemp ? 1 : 0;
+    double low = direction == 0 ? fromTemp : toTemp;
+    double high = direction == 0 ? toTemp : fromTemp;
+    
+    for (int i = 0; i < ETA_NUM_BANDS; i++) {
+      double bandLow = low;
+      if (i > 0 && bandLow < i * ETA_BAND_WIDTH)
+        bandLow = i * ETA_BAND_WIDTH;
+      double bandHigh = high;
+      if (i < ETA_NUM_BANDS - 1 && bandHigh > (i + 1) * ETA_BAND_WIDTH)
+        bandHigh = (i + 1) * ETA_BAND_WIDTH;
+      degrees[i] = bandHigh > bandLow ? bandHigh - bandLow : 0;
+    }
+    return direction;
+  }
+  
+private:
+  void LoadStep(int index) {
+    SStepRecord& step = iSteps[index];
+    long centiTemp = step.centiTemp;
+    long duration = step.duration;
+    
+    for (int i = 0; i < iNumIncrements; i++) {
+      SIncrement& increment = iIncrements[i];
+      if (increment.step != index || increment.loop == -1)
+        continue;
       
-    T* pComponent = &iComponents[iAllocatedComponents++];
-    pComponent->Reset();
-    return pComponent;
+      int iteration = iLoopIterations[increment.loop];
+      centiTemp += (long)increment.centiTempDelta * iteration;
+      if (increment.centiTempLimit != NO_CENTI_TEMP_LIMIT) {
+        if (increment.centiTempDelta < 0 && centiTemp < increment.centiTempLimit)
+          centiTemp = increment.centiTempLimit;
+        else if (increment.centiTempDelta > 0 && centiTemp > increment.centiTempLimit)
+          centiTemp = increment.centiTempLimit;
+      }
+      if (duration > 0) {
+        duration += (long)increment.durationDelta * iteration;
+        duration = constrain(duration, 1, 0xFFFF); //0 is the final step
+      }
+      break;
+    }
+    
+    iCurrent.SetDuration(duration);
+    iCurrent.SetTemp(centiTemp * 0.01);
+    iCurrent.SetName(iNames + step.name);
+  }
+  
+  // offset of the name in the pool, shared with any step of the same name
+  uint8_t AddName(const char* pName, int length) {
+    if (length >= STEP_NAME_LENGTH)
+      length = STEP_NAME_LENGTH - 1;
+    
+    for (int i = 0; i < iNameBytes; i += strlen(iNames + i) + 1) {
+      if (strncmp(iNames + i, pName, length) == 0 && iNames[i + length] == '\0')
+        return i;
+    }
+    if (iNameBytes + length + 1 > NAME_BYTES)
+      return 0;
+    
+    int offset = iNameBytes;
+    memcpy(iNames + offset, pName, length);
+    iNames[offset + length] = '\0';
+    iNameBytes += length + 1;
+    return offset;
   }
   
-  void ResetPool() { iAllocatedComponents = 0; }
+  void AddRamp(double fromTemp, double toTemp) {
+    float degrees[ETA_NUM_BANDS];
+    int direction = SplitRamp(fromTemp, toTemp, degrees);
+    for (int i = 0; i < ETA_NUM_BANDS; i++)
+      iRampDegrees[direction][i] += degrees[i];
+  }
   
 private:
-  int iAllocatedComponents;
-  T iComponents[N];
+  struct SStepRecord {
+    uint16_t duration; //s
+    int16_t centiTemp; //0.01 C
+    uint8_t name; //offset in iNames
+  } __attribute__((packed));
+  
+  struct SLoop {
+    uint8_t begin; //record index
+    uint16_t count;
+  } __attribute__((packed));
+  
+  struct SIncrement {
+    uint8_t step;
+    int8_t loop; //innermost loop of the step, -1 for none
+    int16_t centiTempDelta;
+    int16_t centiTempLimit; //NO_CENTI_TEMP_LIMIT for none
+    int16_t durationDelta; //s
+  } __attribute__((packed));
+  
+  SStepRecord iSteps[MAX_STEPS];
+  uint8_t iNumSteps;
+  SLoop iLoops[MAX_LOOPS];
+  uint8_t iNumLoops;
+  SIncrement iIncrements[MAX_INCREMENTS];
+  uint8_t iNumIncrements;
+  uint8_t iRecords[MAX_STEPS + 2 * MAX_LOOPS]; //record type | index
+  uint8_t iNumRecords;
+  int8_t iOpenLoops[PROGRAM_MAX_DEPTH]; //loop being built at each depth, -1 for none
+  uint8_t iDepth;
+  char iNames[NAME_BYTES];
+  int iNameBytes;
+  
+  // compiled
+  unsigned long iTotalHoldS;
+  float iRampDegrees[2][ETA_NUM_BANDS];
+  int8_t iDisplayLoop; //loop with the most cycles, -1 for none
+  
+  // iteration
+  uint8_t iPosition; //next record
+  uint8_t iStepIndex; //of iCurrent
+  Step iCurrent;
+  unsigned long iHoldOffsetS;
+  uint16_t iLoopIterations[MAX_LOOPS];
 };
 
+typedef ProgramTable<MAX_PROGRAM_STEPS, MAX_PROGRAM_LOOPS, MAX_PROGRAM_INCREMENTS, PROGRAM_NAME_BYTES> Program;
+
 ////////////////////////////////////////////////////////////////////
 // Struct SCommand
 struct SCommand {
@@ -131,37 +372,175 @@ struct SCommand {
     ENone = 0,
     EStart,
     EStop,
-    EConfig
+    EConfig,
+    ETune,
+    EStore, //in the library as programId
+    EDelete //from the library
   } command;
   int lidTemp;
   uint8_t contrast;
-  Cycle* pProgram;
+  uint8_t programId; //in the library, 0 for none
+  Program* pProgram;
+};
+
+////////////////////////////////////////////////////////////////////
+// Struct SPidGains
+struct SPidGains {
+  float kp;
+  float ki;
+  float kd;
+};
+
+////////////////////////////////////////////////////////////////////
+// Struct SGainSchedule
+struct SGainSchedule {
+  uint8_t numPlatePoints;
+  uint8_t plateTemps[MAX_PLATE_GAIN_POINTS]; //C, ascending
+  SPidGains plateGains[MAX_PLATE_GAIN_POINTS];
+  SPidGains lidGains;
+};
+
+////////////////////////////////////////////////////////////////////
+// Struct SEtaRates
+struct SEtaRates {
+  float secPerDegree[2][ETA_NUM_BANDS]; //heating, cooling by temperature band
 };
 
 ////////////////////////////////////////////////////////////////////
 // Class CommandParser
+//
+// Commands come either as the ASCII query string the host app has always
+// sent, e.g. "&c=start&l=110&p=(35[30|95|Melt][30|55|Anneal])", or in
+// the binary format below, told apart by the first byte. Multi-byte
+// fields are little endian, temperatures in 0.01 C.
+//
+//   header   magic, version, length (u16, the whole command), command id
+//            (u16), command (SCommand::TCommandType), lid temp (C),
+//            contrast, library program id (0 for none, not in version 1),
+//            name length, then the name
+//   program  ops up to the end of the command:
+//            STEP       duration (u16 s), temp (i16), name length, name
+//            LOOP       count (u16), up to the matching END_LOOP
+//            END_LOOP
+//            INCREMENT  temp delta (i16), temp limit (i16,
+//                       NO_CENTI_TEMP_LIMIT for none), duration delta
+//                       (i16 s), for the step before
+//
+// Binary commands are validated in one pass before anything is stopped or
+// replaced, then loaded straight from the buffer they arrived in, or from
+// the library in EEPROM.
+//
+// A start with a library program id and no program runs the stored one,
+// with its name and lid temperature unless the command has its own. Store
+// (binary only) keeps the whole command in the library under the id, and
+// delete removes it; neither touches a run.
+//
+#define BINARY_COMMAND_MAGIC   0xB5
+#define BINARY_COMMAND_VERSION 2
+#define BINARY_HEADER_SIZE     11
+#define BINARY_V1_HEADER_SIZE  10
+
+#define BINARY_OP_STEP         0x01
+#define BINARY_OP_LOOP         0x02
+#define BINARY_OP_END_LOOP     0x03
+#define BINARY_OP_INCREMENT    0x04
+
+////////////////////////////////////////////////////////////////////
+// Class BinaryReader
+//
+// A binary command in RAM, or in EEPROM read a byte at a time.
+//
+class BinaryReader {
+public:
+  BinaryReader(const uint8_t* pBuffer, int length) : ipBuffer(pBuffer), iAddress(0), iLength(length) {}
+  BinaryReader(int eepromAddress, int length) : ipBuffer(NULL), iAddress(eepromAddress), iLength(length) {}
+  
+  int GetLength() const { return iLength; }
+  uint8_t Get(int offset) const;
+  uint16_t GetUint16(int offset) const { return Get(offset) | (Get(offset + 1) << 8); }
+  
+private:
+  const uint8_t* ipBuffer; //NULL for EEPROM
+  int iAddress;
+  int iLength;
+};
+
 class CommandParser {
 public:
-  static void ParseCommand(SCommand& command, char* pCommandBuf);
+  static boolean ParseCommand(SCommand& command, const char* pCommandBuf, int length); //false if rejected, leaves the buffer unchanged
+  static int GetCommandLength(const char* pCommandBuf, int length);
+  static boolean ReadBinaryHeader(SCommand& command, const BinaryReader& reader, int& opsOffset, int& opsLength);
 
 private:
-  static void AddComponent(SCommand* pCommand, char key, char* szValue);
-  static Cycle* ParseProgram(char* pBuffer);
-  static ProgramComponent* ParseCycle(char* pBuffer);
-  static Step* ParseStep(char* pBuffer);
+  static boolean AddComponent(SCommand* pCommand, char key, const char* pValue, int length);
+  static Program* ParseProgram(const char* pBuffer, const char* pEnd);
+  static PcrStatus ParseStep(Program* pProgram, const char* pBuffer, const char* pEnd);
+  static int ParseCentiTemp(const char* szValue);
+  
+  static boolean ParseBinaryCommand(SCommand& command, const BinaryReader& reader);
+  static boolean ValidateBinaryProgram(const BinaryReader& reader, int offset, int length);
+  static Program* LoadBinaryProgram(const BinaryReader& reader, int offset, int length);
+  static int GetBinaryOpSize(const BinaryReader& reader, int offset, int remaining);
+  static void LoadLibraryProgram(SCommand& command);
 };
 
 ////////////////////////////////////////////////////////////////////
 // Class ProgramStore
+#define PROGRAM_RECORD_HEADER 7
+
 class ProgramStore {
 public:
   //reading
   static uint8_t RetrieveContrast();
   static boolean RetrieveProgram(SCommand& command, char* pBuffer);
+  static boolean RetrieveGains(SGainSchedule& gains); //false if never tuned
+  static boolean RetrieveEtaRates(SEtaRates& rates); //false if never run
 
   //writing
   static void StoreContrast(uint8_t contrast);
-  static void StoreProgram(const char* szProgram);
+  static void StoreGains(const SGainSchedule& gains);
+  static void StoreEtaRates(const SEtaRates& rates);
+  
+  // Keeps a start command for restart, or clears it for stop and tune;
+  // stores or deletes a library program, false if there is no room for it.
+  // Written from pCommandBuf in the background, so leave it as it is until
+  // Flush().
+  static boolean StoreCommand(const SCommand& command, const char* pCommandBuf, int length);
+  
+  // Returns once everything stored so far is in EEPROM.
+  static void Flush();
+  
+  // program library
+  static boolean FindLibraryProgram(uint8_t id, int& address, int& length);
+  static int GetLibraryRoom(); //largest command that can be stored
+  
+private:
+  static boolean StoreLibraryProgram(uint8_t id, const char* pCommandBuf, int length);
+  static void DeleteLibraryProgram(uint8_t id);
+  static void ScanLibrary();
+  static int GetLibraryPages(int length);
+  static boolean IsLibraryPageFree(int page);
+  
+  static uint8_t* QueueData(int length);
+  static void QueueWrite(int address, const uint8_t* pData, int length, uint8_t value);
+  static void QueueLog(int offset, const uint8_t* pData, int length);
+  static void EepromReady();
+  static uint8_t ReadLog(int offset);
+  static void ScanLog();
+  static boolean ReadRecord(int address, uint8_t marker, void* pData, int size);
+  static void WriteRecord(int address, uint8_t marker, const void* pData, int size);
+  
+private:
+  // latest record in the log, -1 for none
+  static int iLatestRecord;
+  static uint16_t iLatestSequence;
+  static uint16_t iLatestLength;
+  static boolean iLogScanned;
+  
+  // library page and length of each program, by id - 1
+  static uint8_t iLibraryPages[MAX_LIBRARY_PROGRAMS]; //LIBRARY_NO_PAGE for none
+  static uint8_t iLibraryLengths[MAX_LIBRARY_PROGRAMS];
+  static boolean iLibraryScanned;
 };
   
 
@@ -22,19 +22,37 @@
 #include "thermocycler.h"
 #include "program.h"
 #include "display.h"
+#include "hardware.h"
+#include "history.h"
+#include "profiler.h"
 
 #define BAUD_RATE 9600
-#define STATUS_INTERVAL_MS 250
+#define STATUS_INTERVAL_MS 250 //telemetry by default
+#define MIN_TELEMETRY_INTERVAL_MS 50
+#define SEND_BUFFER_SIZE 136 //one less can be queued, a whole status reply; longer replies wait
+
+// replies go out from the UART interrupt, so sending them costs the loop
+// only the copy
+static uint8_t sSendBuffer[SEND_BUFFER_SIZE];
+static volatile uint8_t sSendHead = 0; //next to send, moved by the interrupt
+static volatile uint8_t sSendTail = 0; //next free, moved by the background
 
 SerialControl::SerialControl(Display* pDisplay)
-: ipDisplay(pDisplay)
+: ipPacket(buf)
 , packetState(STATE_START)
+, lastPacketSeq(0)
+, iReplySeq(0)
+, iReplyCrc(0)
 , packetLen(0)
 , packetRealLen(0)
-, lastPacketSeq(0xff)
-, bEscapeCodeFound(false)
 , iCommandId(0)
+, bEscapeCodeFound(false)
 , iReceivedStatusRequest(false)
+, iTelemetryIntervalMs(0)
+, iNextTelemetryMs(0)
+, iTelemetrySample(0)
+, iTelemetryKeyCountdown(0)
+, ipDisplay(pDisplay)
 {  
   Serial.begin(BAUD_RATE);
 }
@@ -44,13 +62,59 @@ SerialControl::~SerialControl() {
 
 void SerialControl::Process() {
   ReadPacket();
+  
+  if (iTelemetryIntervalMs != 0 && (long)(millis() - iNextTelemetryMs) >= 0) {
+    iNextTelemetryMs += iTelemetryIntervalMs;
+    if ((long)(millis() - iNextTelemetryMs) >= 0)
+      iNextTelemetryMs = millis() + iTelemetryIntervalMs; //fell a whole interval behind
+    SendTelemetry();
+  }
+}
+
+// waiting, a piece at a time as room is made, may send more than the buffer
+boolean SerialControl::Send(const void* pData, int length, boolean wait) {
+  if (!wait && GetSendRoom() < length)
+    return false; //the host asks again
+  
+  const uint8_t* pBytes = (const uint8_t*)pData;
+  while (length > 0) {
+    int room;
+    while ((room = GetSendRoom()) == 0)
+      Hardware::Idle();
+    int count = length < room ? length : room;
+    
+    uint8_t tail = sSendTail;
+    for (int i = 0; i < count; i++) {
+      sSendBuffer[tail] = pBytes[i];
+      tail = (tail + 1) % SEND_BUFFER_SIZE;
+    }
+    sSendTail = tail;
+    Hardware::StartSerialWrites(SerialReady);
+    pBytes += count;
+    length -= count;
+  }
+  return true;
+}
+
+int SerialControl::GetSendRoom() {
+  return (sSendHead + SEND_BUFFER_SIZE - sSendTail - 1) % SEND_BUFFER_SIZE;
 }
 
 /////////////////////////////////////////////////////////////////
 // Private
+
+// from the UART data register empty interrupt
+void SerialControl::SerialReady() {
+  if (sSendHead == sSendTail) {
+    Hardware::StopSerialWrites();
+    return;
+  }
+  Hardware::WriteSerial(sSendBuffer[sSendHead]);
+  sSendHead = (sSendHead + 1) % SEND_BUFFER_SIZE;
+}
+
 void SerialControl::ReadPacket()
 {
-  char dbuf[10];
   int availableBytes = Serial.available();
  
   if (packetState < STATE_PACKETHEADER_DONE){ //new packet
@@ -68,11 +132,11 @@ void SerialControl::ReadPacket()
           packetLen = MAX_COMMAND_SIZE;
         if (packetLen >= sizeof(struct PCPPacket) && packetLen <= MAX_COMMAND_SIZE) {
           packetState = STATE_PACKETHEADER_DONE;
+          ipPacket = buf;
           buf[0] = START_CODE;
           buf[1] = packetLen & 0xff;
           buf[2] = (packetLen & 0xff00)>>8;
           bEscapeCodeFound = false;
-          checksum = 0;
           packetRealLen = 3;
           packetLen -= 3;
         }
@@ -95,21 +159,28 @@ void SerialControl::ReadPacket()
       byte incomingByte = Serial.read();
       availableBytes--;
       packetLen--;
-      checksum ^= incomingByte;
       if (incomingByte == ESCAPE_CODE)
         bEscapeCodeFound = true;
       else if (bEscapeCodeFound && incomingByte == START_CODE)
         packetRealLen--; //erase the escape char
       else
         bEscapeCodeFound = false;
-      buf[packetRealLen++] = incomingByte; 
+      
+      if (packetRealLen == sizeof(struct PCPPacket) - 1) {
+        //the type: the last command may still be being stored from buf, so
+        //only a new one waits for it
+        if ((incomingByte & 0xf0) == SEND_CMD || packetRealLen + 1 + packetLen > REQUEST_PACKET_MAX) {
+          ProgramStore::Flush();
+        } else {
+          memcpy(iRequest, buf, packetRealLen);
+          ipPacket = iRequest;
+        }
+      }
+      ipPacket[packetRealLen++] = incomingByte; 
     }
     
     if (packetLen == 0){
-      //checksum
-      //if (incomingByte == checksum){
-        ProcessPacket(buf, packetRealLen);
-      //  }
+      ProcessPacket(ipPacket, packetRealLen);
   
       //reset, to find START_CODE again
       packetState = STATE_START;
@@ -121,134 +192,480 @@ void SerialControl::ProcessPacket(byte* data, int datasize)
 {
   PCPPacket* packet = (PCPPacket*)data;
   uint8_t packetType = packet->eType & 0xf0;
-  uint8_t packetSeq = packet->eType & 0x0f;
-  uint8_t result = false;
+  iReplySeq = packet->eType & 0x0f;
+  if (iReplySeq != 0 && !CheckSequence(data, datasize))
+    return;
   char* pCommandBuf;
+  boolean taken;
   
-//  if (packetSeq != lastPacketSeq){ //not retransmission
-    switch(packetType){
-    case SEND_CMD:
-      data[datasize] = '\0';
-      SCommand command;
-      pCommandBuf = (char*)(data + sizeof(PCPPacket));
-      
-      //store start commands for restart
-      ProgramStore::StoreProgram(pCommandBuf);
-      
-      CommandParser::ParseCommand(command, pCommandBuf);
-      GetThermocycler().ProcessCommand(command);
-      iCommandId = command.commandId;
-      break;
-      
-    case STATUS_REQ:
-      iReceivedStatusRequest = true;
-      SendStatus();
-      break;
-    default:
+  switch(packetType){
+  case SEND_CMD:
+    data[datasize] = '\0';
+    SCommand command;
+    pCommandBuf = (char*)(data + sizeof(PCPPacket));
+    
+    Hardware::LockControl();
+    taken = CommandParser::ParseCommand(command, pCommandBuf, datasize - sizeof(PCPPacket));
+    GetThermocycler().ProcessCommand(command);
+    Hardware::UnlockControl();
+    
+    //store start commands for restart, from buf in the background
+    if (!taken || !ProgramStore::StoreCommand(command, pCommandBuf, datasize - sizeof(PCPPacket))) {
+      SendAck(NAK, 0); //rejected, or not stored
       break;
-   }
+    }
+    iCommandId = command.commandId;
+    if (iReplySeq != 0)
+      SendAck(ACK, iReplySeq);
+    break;
+    
+  case STATUS_REQ:
+    iReceivedStatusRequest = true;
+    SendStatus();
+    break;
+  case STATUS_BIN_REQ:
+    iReceivedStatusRequest = true;
+    SendBinaryStatus(datasize > (int)sizeof(PCPPacket) ? data[sizeof(PCPPacket)] : STATUS_SECTIONS_ALL);
+    break;
+  case LIBRARY_REQ:
+    SendLibrary();
+    break;
+  case HISTORY_REQ:
+#ifdef RUN_HISTORY
+    if (datasize > (int)sizeof(PCPPacket) + 1 && data[sizeof(PCPPacket) + 1] != 0)
+      RunHistory::SetIntervalS(data[sizeof(PCPPacket) + 1]);
+#endif
+    SendHistory(datasize > (int)sizeof(PCPPacket) ? data[sizeof(PCPPacket)] : 0);
+    break;
+  case PROFILE_REQ:
+    SendProfile(datasize > (int)sizeof(PCPPacket) && (data[sizeof(PCPPacket)] & PROFILE_RESET));
+    break;
+  case TELEMETRY_REQ:
+    iReceivedStatusRequest = true;
+    Subscribe(data, datasize);
+    break;
+  default:
+    break;
+  }
+}
+
+// takes the CRC off a sequenced packet, false if it is not to be processed
+boolean SerialControl::CheckSequence(byte* data, int& datasize) {
+  uint8_t expectedSeq = lastPacketSeq % SEQ_COUNT + 1;
+  if (datasize < (int)sizeof(PCPPacket) + 2) {
+    SendAck(NAK, expectedSeq);
+    return false;
+  }
+  
+  datasize -= 2;
+  uint16_t crc = 0xFFFF;
+  for (int i = 3; i < datasize; i++)
+    crc = crc16Update(crc, data[i]);
+  if (crc != (data[datasize] | (data[datasize + 1] << 8))) {
+    SendAck(NAK, expectedSeq);
+    return false;
+  }
+  
+  if (lastPacketSeq == 0 || iReplySeq == expectedSeq) {
+    lastPacketSeq = iReplySeq;
+    return true;
+  }
+  
+  int behind = (expectedSeq + SEQ_COUNT - iReplySeq) % SEQ_COUNT;
+  if (behind == 0 || behind > SEQ_WINDOW) {
+    SendAck(NAK, expectedSeq); //one went missing
+    return false;
+  }
+  if ((data[3] & 0xf0) == SEND_CMD) {
+    SendAck(ACK, iReplySeq); //already run
+    return false;
+  }
+  return true; //requests are answered again
+}
+
+void SerialControl::SendAck(PACKET_TYPE type, uint8_t seq) {
+  iReplySeq = seq;
+  BeginReply(type, 0, true);
+  EndReply();
+}
+
+// Starts a reply of payloadLength bytes to the packet being processed,
+// sequenced like it. Unless wait is set, returns false without sending
+// anything if there is no room for all of it. Replies longer than the buffer
+// always wait.
+boolean SerialControl::BeginReply(uint8_t type, int payloadLength, boolean wait) {
+  PCPPacket packet((PACKET_TYPE)(type | iReplySeq));
+  packet.length = sizeof(packet) + payloadLength + (iReplySeq != 0 ? 2 : 0);
+  if (!wait && GetSendRoom() < packet.length && packet.length < SEND_BUFFER_SIZE)
+    return false; //the host asks again
+  
+  Send(&packet, sizeof(packet) - 1, true);
+  iReplyCrc = 0xFFFF;
+  SendReply(&packet.eType, 1);
+  return true;
+}
 
-    lastPacketSeq = packetSeq;
-//  }
+void SerialControl::SendReply(const void* pData, int length) {
+  const uint8_t* pBytes = (const uint8_t*)pData;
+  for (int i = 0; i < length; i++)
+    iReplyCrc = crc16Update(iReplyCrc, pBytes[i]);
+  Send(pData, length, true);
+}
+
+void SerialControl::EndReply() {
+  if (iReplySeq == 0)
+    return;
+  uint8_t crc[2] = { (uint8_t)(iReplyCrc & 0xff), (uint8_t)(iReplyCrc >> 8) };
+  Send(crc, sizeof(crc), true);
 }
 
 #define STATUS_FILE_LEN 128
+#define STATUS_FIELD_LEN 24 //"&n=" and a program name
+
+// The numbers and states at their widest, the keys of the names and the null
+// terminator always fit: d, s and t, b, the ints l o m u c, e and r, then
+// "&n=" and "&p=". The names get what is left and are cut short.
+#define STATUS_INT_LEN    6 //"-32768"
+#define STATUS_ULONG_LEN 10
+#define STATUS_FLOAT_LEN  8 //sprintFloat() to 1 digit, an int, '.' and the digit
+#define STATUS_STATE_LEN  8 //"complete"
+#define STATUS_WORST_LEN (2 + STATUS_ULONG_LEN + 2 * (3 + STATUS_STATE_LEN) + 3 + STATUS_FLOAT_LEN \
+  + 5 * (3 + STATUS_INT_LEN) + 2 * (3 + STATUS_ULONG_LEN) + 2 * 3 + 1)
+typedef char StatusWorstFits[STATUS_WORST_LEN <= STATUS_FILE_LEN ? 1 : -1];
+typedef char StatusReplyFits[sizeof(PCPPacket) + STATUS_FILE_LEN + 2 < SEND_BUFFER_SIZE ? 1 : -1]; //never waits
 
+// sent a field at a time as it is made, so the whole file is never in RAM
 void SerialControl::SendStatus() {
-  Thermocycler::ProgramState state = GetThermocycler().GetProgramState();
-  const char* szStatus = GetProgramStateString_P(state); 
-  const char* szThermState = GetThermalStateString_P(GetThermocycler().GetThermalState());
-      
-  char statusBuf[STATUS_FILE_LEN];
-  char* statusPtr = statusBuf;
   Thermocycler& tc = GetThermocycler();
+  Thermocycler::SStatus status;
+  tc.GetStatus(status);
+  const char* szStatus = GetProgramStateString_P(status.state); 
+  const char* szThermState = GetThermalStateString_P(status.thermalState);
+  
+  if (!BeginReply(STATUS_RESP, STATUS_FILE_LEN, false))
+    return; //the host asks again
+  int statusLen = 0;
     
-  statusPtr = AddParam(statusPtr, 'd', (unsigned long)iCommandId, true);
-  statusPtr = AddParam_P(statusPtr, 's', szStatus);
-  statusPtr = AddParam(statusPtr, 'l', (int)tc.GetLidTemp());
-  statusPtr = AddParam(statusPtr, 'b', tc.GetPlateTemp(), 1, false);
-  statusPtr = AddParam_P(statusPtr, 't', szThermState);
-  statusPtr = AddParam(statusPtr, 'o', GetThermocycler().GetDisplay()->GetContrast());
-
-  if (state == Thermocycler::ERunning || state == Thermocycler::EComplete) {
-    statusPtr = AddParam(statusPtr, 'e', tc.GetElapsedTimeS());
-    statusPtr = AddParam(statusPtr, 'r', tc.GetTimeRemainingS());
-    statusPtr = AddParam(statusPtr, 'u', tc.GetNumCycles());
-    statusPtr = AddParam(statusPtr, 'c', tc.GetCurrentCycleNum());
-    statusPtr = AddParam(statusPtr, 'n', tc.GetProgName());
-    if (tc.GetCurrentStep() != NULL)
-      statusPtr = AddParam(statusPtr, 'p', tc.GetCurrentStep()->GetName());
+  statusLen = AddParam(statusLen, 'd', (unsigned long)iCommandId);
+  statusLen = AddParam_P(statusLen, 's', szStatus);
+  statusLen = AddParam(statusLen, 'l', (int)status.lidTemp);
+  statusLen = AddParam(statusLen, 'b', status.plateTemp, 1, false);
+  statusLen = AddParam_P(statusLen, 't', szThermState);
+  statusLen = AddParam(statusLen, 'o', tc.GetDisplay()->GetContrast());
+  statusLen = AddParam(statusLen, 'm', Hardware::GetLowestFreeRam());
+
+  if (status.state == Thermocycler::ERunning || status.state == Thermocycler::EComplete) {
+    statusLen = AddParam(statusLen, 'e', status.elapsedS);
+    statusLen = AddParam(statusLen, 'r', status.remainingS);
+    statusLen = AddParam(statusLen, 'u', status.numCycles);
+    statusLen = AddParam(statusLen, 'c', status.cycleNum);
+    statusLen = AddParam(statusLen, 'n', tc.GetProgName());
+    if (status.pStep != NULL)
+      statusLen = AddParam(statusLen, 'p', status.pStep->GetName());
   }
-  statusPtr++; //to include null terminator
   
-  //send packet
-  PCPPacket packet(STATUS_RESP);
-  packet.length = sizeof(packet) + STATUS_FILE_LEN;
-  Serial.write((byte*)&packet, sizeof(packet));
-  int statusBufLen = statusPtr - statusBuf;
-  Serial.write((byte*)statusBuf, statusBufLen);
-  for (int i = statusBufLen; i < STATUS_FILE_LEN; i++)
-    Serial.write(0x20);
-}
-
-char* SerialControl::AddParam(char* pBuffer, char key, int val, boolean init) {
-  if (!init)
-    *pBuffer++ = '&';
-  *pBuffer++ = key;
-  *pBuffer++ = '=';
-  itoa(val, pBuffer, 10);
-  while (*pBuffer != '\0')
-    pBuffer++;
-    
-  return pBuffer;
+  //null terminator, then spaces to the fixed length
+  char pad[STATUS_FIELD_LEN];
+  memset(pad, 0x20, sizeof(pad));
+  pad[0] = '\0';
+  while (statusLen < STATUS_FILE_LEN) {
+    int padLen = STATUS_FILE_LEN - statusLen < (int)sizeof(pad) ? STATUS_FILE_LEN - statusLen : sizeof(pad);
+    SendReply(pad, padLen);
+    statusLen += padLen;
+    pad[0] = 0x20;
+  }
+  EndReply();
 }
 
-char* SerialControl::AddParam(char* pBuffer, char key, unsigned long val, boolean init) {
-  if (!init)
-    *pBuffer++ = '&';
-  *pBuffer++ = key;
-  *pBuffer++ = '=';
-  ltoa(val, pBuffer, 10);
-  while (*pBuffer != '\0')
-    pBuffer++;
-    
-  return pBuffer;
+static uint8_t* PutUint16(uint8_t* pOut, uint16_t val) {
+  *pOut++ = val & 0xff;
+  *pOut++ = val >> 8;
+  return pOut;
 }
 
-char* SerialControl::AddParam(char* pBuffer, char key, float val, int decimalDigits, boolean pad, boolean init) {
-  if (!init)
-    *pBuffer++ = '&';
-  *pBuffer++ = key;
-  *pBuffer++ = '=';
-  sprintFloat(pBuffer, val, decimalDigits, pad);
-  while (*pBuffer != '\0')
-    pBuffer++;
-    
-  return pBuffer;
+static uint8_t* PutUint32(uint8_t* pOut, uint32_t val) {
+  pOut = PutUint16(pOut, val & 0xffff);
+  return PutUint16(pOut, val >> 16);
 }
 
-char* SerialControl::AddParam(char* pBuffer, char key, const char* szVal, boolean init) {
-  if (!init)
-    *pBuffer++ = '&';
-  *pBuffer++ = key;
-  *pBuffer++ = '=';
-  strcpy(pBuffer, szVal);
-  while (*pBuffer != '\0')
-    pBuffer++;
-    
-  return pBuffer;
+static int16_t CentiTemp(float temp) {
+  return temp * 100 + (temp < 0 ? -0.5 : 0.5);
+}
+
+static uint8_t* PutName(uint8_t* pOut, const char* szName, int maxLength) {
+  int length = strlen(szName);
+  if (length > maxLength)
+    length = maxLength;
+  *pOut++ = length;
+  memcpy(pOut, szName, length);
+  return pOut + length;
+}
+
+#define PROG_NAME_LENGTH 20
+#define STATUS_FRAME_MAX (11 + 12 + 2 + PROG_NAME_LENGTH + STEP_NAME_LENGTH + 4 + 2)
+
+// see STATUS_FRAME_VERSION
+void SerialControl::SendBinaryStatus(uint8_t sections) {
+  Thermocycler& tc = GetThermocycler();
+  Thermocycler::SStatus status;
+  tc.GetStatus(status);
+  if (status.state != Thermocycler::ERunning && status.state != Thermocycler::EComplete)
+    sections &= ~(STATUS_SECTION_RUN | STATUS_SECTION_NAMES);
+  sections &= STATUS_SECTIONS_ALL;
+  
+  uint8_t frame[STATUS_FRAME_MAX];
+  uint8_t* pOut = frame;
+  *pOut++ = STATUS_FRAME_VERSION;
+  *pOut++ = sections;
+  pOut = PutUint16(pOut, iCommandId);
+  *pOut++ = status.state;
+  *pOut++ = status.thermalState;
+  pOut = PutUint16(pOut, CentiTemp(status.lidTemp));
+  pOut = PutUint16(pOut, CentiTemp(status.plateTemp));
+  *pOut++ = tc.GetDisplay()->GetContrast();
+  
+  if (sections & STATUS_SECTION_RUN) {
+    pOut = PutUint32(pOut, status.elapsedS);
+    pOut = PutUint32(pOut, status.remainingS);
+    pOut = PutUint16(pOut, status.numCycles);
+    pOut = PutUint16(pOut, status.cycleNum);
+  }
+  if (sections & STATUS_SECTION_NAMES) {
+    pOut = PutName(pOut, tc.GetProgName(), PROG_NAME_LENGTH);
+    pOut = PutName(pOut, status.pStep != NULL ? status.pStep->GetName() : "", STEP_NAME_LENGTH);
+  }
+  if (sections & STATUS_SECTION_MEMORY) {
+    pOut = PutUint16(pOut, Hardware::GetFreeRam());
+    pOut = PutUint16(pOut, Hardware::GetLowestFreeRam());
+  }
+  if (sections & STATUS_SECTION_SENSOR)
+    pOut = PutUint16(pOut, status.lidNoise * 1000 + 0.5);
+  
+  if (BeginReply(STATUS_BIN_RESP, pOut - frame)) {
+    SendReply(frame, pOut - frame);
+    EndReply();
+  }
+}
+
+// see TELEMETRY_KEY
+void SerialControl::Subscribe(byte* data, int datasize) {
+  uint16_t intervalMs = STATUS_INTERVAL_MS;
+  if (datasize >= (int)sizeof(PCPPacket) + 2)
+    intervalMs = data[sizeof(PCPPacket)] | (data[sizeof(PCPPacket) + 1] << 8);
+  if (intervalMs != 0 && intervalMs < MIN_TELEMETRY_INTERVAL_MS)
+    intervalMs = MIN_TELEMETRY_INTERVAL_MS;
+  
+  iTelemetryIntervalMs = intervalMs;
+  iNextTelemetryMs = millis();
+  iTelemetryKeyCountdown = 0;
+  if (iReplySeq != 0)
+    SendAck(ACK, iReplySeq);
+}
+
+// full width in bytes of each telemetry field
+static const uint8_t TELEMETRY_FIELD_WIDTHS[TELEMETRY_FIELDS] PROGMEM = { 2, 2, 2, 1, 1, 2 };
+#define TELEMETRY_FRAME_MAX (2 + 3 * TELEMETRY_FIELDS)
+
+void SerialControl::SendTelemetry() {
+  Thermocycler::SStatus status;
+  GetThermocycler().GetStatus(status);
+  boolean running = status.state == Thermocycler::ERunning || status.state == Thermocycler::EComplete;
+  
+  int16_t sample[TELEMETRY_FIELDS];
+  sample[0] = CentiTemp(status.plateTemp);
+  sample[1] = CentiTemp(status.lidTemp);
+  sample[2] = status.peltierPwm;
+  sample[3] = status.lidPwm;
+  sample[4] = running ? status.stepIndex : 0;
+  sample[5] = running ? status.cycleNum : 0;
+  
+  boolean key = iTelemetryKeyCountdown == 0;
+  uint8_t frame[TELEMETRY_FRAME_MAX];
+  uint8_t* pOut = frame + 2;
+  uint8_t flags = key ? TELEMETRY_KEY : 0;
+  for (int i = 0; i < TELEMETRY_FIELDS; i++) {
+    int16_t delta = sample[i] - iTelemetry[i];
+    if (!key) {
+      if (delta == 0)
+        continue;
+      if (delta > TELEMETRY_ESCAPE && delta <= 127) {
+        flags |= 1 << i;
+        *pOut++ = (int8_t)delta;
+        continue;
+      }
+      *pOut++ = (uint8_t)TELEMETRY_ESCAPE;
+    }
+    flags |= 1 << i;
+    *pOut++ = sample[i] & 0xff;
+    if (pgm_read_byte(TELEMETRY_FIELD_WIDTHS + i) == 2)
+      *pOut++ = (uint16_t)sample[i] >> 8;
+  }
+  frame[0] = iTelemetrySample++;
+  frame[1] = flags;
+  
+  iReplySeq = 0; //not a reply to anything
+  if (!BeginReply(TELEMETRY, pOut - frame)) {
+    iTelemetryKeyCountdown = 0; //the host can't apply changes past it
+    return;
+  }
+  SendReply(frame, pOut - frame);
+  EndReply();
+  memcpy(iTelemetry, sample, sizeof(iTelemetry));
+  iTelemetryKeyCountdown = key ? TELEMETRY_KEY_INTERVAL - 1 : iTelemetryKeyCountdown - 1;
+}
+
+// see HISTORY_CHUNK
+void SerialControl::SendHistory(uint8_t offset) {
+#ifdef RUN_HISTORY
+  int numSamples = RunHistory::GetNumSamples();
+  int numEntries = numSamples + RunHistory::GetNumMarks();
+  int count = numEntries - offset;
+  count = constrain(count, 0, HISTORY_CHUNK);
+  
+  uint8_t header[7];
+  PutUint16(header, RunHistory::GetSampleIntervalS());
+  header[2] = RunHistory::IsRecording();
+  header[3] = RunHistory::GetEndState();
+  header[4] = numSamples;
+  header[5] = RunHistory::GetNumMarks();
+  header[6] = offset;
+  
+  if (BeginReply(HISTORY_RESP, sizeof(header) + count * HISTORY_ENTRY_SIZE)) {
+    SendReply(header, sizeof(header));
+    for (int i = offset; i < offset + count; i++)
+      SendReply(i < numSamples ? RunHistory::GetSample(i) : RunHistory::GetMark(i - numSamples), HISTORY_ENTRY_SIZE);
+    EndReply();
+  }
+#else
+  SendAck(NAK, 0); //none kept, and not an error in sequence
+#endif
+}
+
+// see PROFILE_RESET, waits for room as it is more than the buffer holds
+void SerialControl::SendProfile(boolean reset) {
+#ifdef LOOP_PROFILER
+  uint8_t header[3] = { PROFILE_PHASES, PROFILE_BUCKETS, PROFILE_TICK_US };
+  BeginReply(PROFILE_RESP, sizeof(header) + PROFILE_PHASES * (8 + 2 * PROFILE_BUCKETS), true);
+  SendReply(header, sizeof(header));
+  for (int phase = 0; phase < PROFILE_PHASES; phase++) {
+    SProfileStats stats;
+    LoopProfiler::GetStats(phase, stats);
+    uint8_t times[8];
+    PutUint16(times, stats.count);
+    PutUint16(times + 2, stats.min);
+    PutUint16(times + 4, stats.count ? stats.sum / stats.count : 0);
+    PutUint16(times + 6, stats.max);
+    SendReply(times, sizeof(times));
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+      uint8_t count[2];
+      PutUint16(count, stats.buckets[i]);
+      SendReply(count, sizeof(count));
+    }
+  }
+  EndReply();
+  
+  if (reset) {
+    Hardware::LockControl();
+    LoopProfiler::Reset();
+    Hardware::UnlockControl();
+  }
+#else
+  uint8_t header[3] = { 0, 0, 0 };
+  if (BeginReply(PROFILE_RESP, sizeof(header))) {
+    SendReply(header, sizeof(header));
+    EndReply();
+  }
+#endif
 }
 
-char* SerialControl::AddParam_P(char* pBuffer, char key, const char* szVal, boolean init) {
-  if (!init)
-    *pBuffer++ = '&';
-  *pBuffer++ = key;
-  *pBuffer++ = '=';
-  strcpy_P(pBuffer, szVal);
-  while (*pBuffer != '\0')
-    pBuffer++;
+// the largest program that can be stored (u16), then for each stored one:
+// id, length (u16), name length and name. Sized in a first pass and read
+// again from EEPROM in the second, rather than held on the stack, and
+// waits for room as it goes as it can be more than the buffer holds
+void SerialControl::SendLibrary() {
+  int libraryLen = 2;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      uint16_t libraryRoom = ProgramStore::GetLibraryRoom();
+      uint8_t room[2] = { (uint8_t)(libraryRoom & 0xff), (uint8_t)(libraryRoom >> 8) };
+      BeginReply(LIBRARY_RESP, libraryLen, true);
+      SendReply(room, sizeof(room));
+    }
     
-  return pBuffer;
+    for (uint8_t id = 1; id <= MAX_LIBRARY_PROGRAMS; id++) {
+      SCommand entry;
+      int address, length, opsOffset, opsLength;
+      if (!ProgramStore::FindLibraryProgram(id, address, length)
+          || !CommandParser::ReadBinaryHeader(entry, BinaryReader(address, length), opsOffset, opsLength))
+        continue;
+      
+      uint8_t nameLength = strlen(entry.name);
+      if (pass == 0) {
+        libraryLen += 4 + nameLength;
+      } else {
+        uint8_t header[4] = { id, (uint8_t)(length & 0xff), (uint8_t)(length >> 8), nameLength };
+        SendReply(header, sizeof(header));
+        SendReply(entry.name, nameLength);
+      }
+    }
+  }
+  EndReply();
+}
+
+int SerialControl::AddParam(int statusLen, char key, int val) {
+  char field[STATUS_FIELD_LEN];
+  itoa(val, BeginParam(field, statusLen, key), 10);
+  return SendParam(field, statusLen);
+}
+
+int SerialControl::AddParam(int statusLen, char key, unsigned long val) {
+  char field[STATUS_FIELD_LEN];
+  ltoa(val, BeginParam(field, statusLen, key), 10);
+  return SendParam(field, statusLen);
+}
+
+int SerialControl::AddParam(int statusLen, char key, float val, int decimalDigits, boolean pad) {
+  char field[STATUS_FIELD_LEN];
+  sprintFloat(BeginParam(field, statusLen, key), val, decimalDigits, pad);
+  return SendParam(field, statusLen);
+}
+
+int SerialControl::AddParam(int statusLen, char key, const char* szVal) {
+  char field[STATUS_FIELD_LEN];
+  char* pValue = BeginParam(field, statusLen, key);
+  int maxLen = field + sizeof(field) - 1 - pValue;
+  strncpy(pValue, szVal, maxLen);
+  pValue[maxLen] = '\0';
+  return SendParam(field, statusLen);
+}
+
+int SerialControl::AddParam_P(int statusLen, char key, const char* szVal) {
+  char field[STATUS_FIELD_LEN];
+  char* pValue = BeginParam(field, statusLen, key);
+  int maxLen = field + sizeof(field) - 1 - pValue;
+  strncpy_P(pValue, szVal, maxLen);
+  pValue[maxLen] = '\0';
+  return SendParam(field, statusLen);
+}
+
+// "key=", after a '&' unless it is the first
+char* SerialControl::BeginParam(char* pField, int statusLen, char key) {
+  if (statusLen > 0)
+    *pField++ = '&';
+  *pField++ = key;
+  *pField++ = '=';
+  return pField;
+}
+
+// Returns the status length with it. Cut short to leave room for the null
+// terminator, or left out if even its key doesn't fit.
+int SerialControl::SendParam(const char* szField, int statusLen) {
+  int fieldLen = strlen(szField);
+  int room = STATUS_FILE_LEN - 1 - statusLen;
+  if (fieldLen > room)
+    fieldLen = strchr(szField, '=') + 1 - szField <= room ? room : 0;
+  SendReply(szField, fieldLen);
+  return statusLen + fieldLen;
 }
 
 const char STOPPED_STR[] PROGMEM = "stopped";
@@ -257,6 +674,7 @@ const char RUNNING_STR[] PROGMEM = "running";
 const char COMPLETE_STR[] PROGMEM = "complete";
 const char STARTUP_STR[] PROGMEM = "startup";
 const char ERROR_STR[] PROGMEM = "error";
+const char TUNING_STR[] PROGMEM = "tuning";
 const char* SerialControl::GetProgramStateString_P(Thermocycler::ProgramState state) {
   switch (state) {
   case Thermocycler::EOff:
@@ -270,6 +688,8 @@ const char* SerialControl::GetProgramStateString_P(Thermocycler::ProgramState st
     return COMPLETE_STR;
   case Thermocycler::EStartup:
     return STARTUP_STR;
+  case Thermocycler::ETuning:
+    return TUNING_STR;
   case Thermocycler::EError:
   default:
     return ERROR_STR;
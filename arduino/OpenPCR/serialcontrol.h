@@ -24,18 +24,125 @@
 #define START_CODE    0xFF
 #define ESCAPE_CODE   0xFE
 
+// Packets other than SEND_CMD up to this long on the wire are read into
+// their own buffer, so a command can still be stored from buf while they
+// are taken.
+#define REQUEST_PACKET_MAX 12
+
 class Display;
-class ProgramComponent;
-class Cycle;
 class Step;
 struct SCommand;
 
 typedef enum {
+    PROFILE_RESP   = 0x00, //not 0xF0, seq 14 and 15 would be ESCAPE_CODE and START_CODE
     SEND_CMD       = 0x10,
+    PROFILE_REQ    = 0x20,
+    HISTORY_REQ    = 0x30,
     STATUS_REQ     = 0x40,
-    STATUS_RESP    = 0x80
+    LIBRARY_REQ    = 0x50,
+    STATUS_BIN_REQ = 0x60,
+    TELEMETRY_REQ  = 0x70,
+    STATUS_RESP    = 0x80,
+    LIBRARY_RESP   = 0x90,
+    STATUS_BIN_RESP = 0xA0,
+    ACK            = 0xB0,
+    NAK            = 0xC0,
+    TELEMETRY      = 0xD0,
+    HISTORY_RESP   = 0xE0
 } PACKET_TYPE;
 
+// The lower 4 bits of the type are the sequence number. 0 is a plain
+// packet as the USB bridge sends. 1 to 15 is a sequenced packet, which
+// ends in a CRC-16 (crc16Update) of its type and unescaped payload, counted
+// in its length. The length itself is left out as it counts the escapes,
+// but a wrong one still throws the CRC out. The host may have up to SEQ_WINDOW in
+// flight, numbered on from the last, and they are taken in order:
+//
+//   - a command is answered with an ACK and a request with its reply, each
+//     sequenced the same and ending in a CRC of their own
+//   - a repeat of one of the last SEQ_WINDOW taken is answered again, but
+//     a command is not run again
+//   - anything else, or a bad CRC, gets a NAK numbered with the sequence
+//     expected next, and the host sends again from there
+//   - a request the firmware has no answer for gets a NAK numbered 0, which
+//     is never expected next, see HISTORY_CHUNK; so does a command that
+//     is rejected or a library store with no room, sequenced or not, and
+//     it doesn't become the status's command id
+//
+// The first sequenced packet after a reset is taken whatever its number.
+//
+#define SEQ_COUNT  15
+#define SEQ_WINDOW 7
+
+// Binary status, the compact alternative to the padded ASCII one. The
+// request may carry a byte of the sections wanted, all of them by default;
+// RUN and NAMES are sent only while there is a run to report. Little
+// endian, read by its length (not escaped):
+//
+//   version, sections sent, command id (u16), program state
+//   (Thermocycler::ProgramState), thermal state (Thermocycler::ThermalState),
+//   lid temp (i16 0.01 C), plate temp (i16 0.01 C), contrast
+//   RUN    elapsed (u32 s), remaining (u32 s), cycles (u16), current cycle
+//          (u16)
+//   NAMES  program name length, name, step name length, name
+//   MEMORY free RAM (u16 bytes), the least there has been since reset
+//          (u16 bytes), both 0 where not known
+//   SENSOR lid noise (u16 0.001 C, as the oversampled lid is that quiet),
+//          the rms of the lid samples about the filtered temp
+//
+#define STATUS_FRAME_VERSION  1
+#define STATUS_SECTION_RUN    0x01
+#define STATUS_SECTION_NAMES  0x02
+#define STATUS_SECTION_MEMORY 0x04
+#define STATUS_SECTION_SENSOR 0x08
+#define STATUS_SECTIONS_ALL   (STATUS_SECTION_RUN | STATUS_SECTION_NAMES | STATUS_SECTION_MEMORY | STATUS_SECTION_SENSOR)
+
+// Telemetry, pushed unasked every interval (u16 ms) of the last
+// TELEMETRY_REQ, or STATUS_INTERVAL_MS if it had none, until one asks for
+// an interval of 0. A sequenced request is ACKed. Each TELEMETRY frame is
+// unsequenced and read by its length:
+//
+//   sample number (u8, counts dropped ones too), flags, fields
+//
+// A key sample (TELEMETRY_KEY set) has every field in full, in order:
+//   plate temp (i16 0.01 C), lid temp (i16 0.01 C), Peltier PWM (i16),
+//   lid PWM (u8), step index (u8), cycle (u16)
+// the step and cycle being 0 while there is no run. Otherwise a sample has
+// only the fields whose flag bit (1 << field) is set, as an i8 change since
+// the last sample, or TELEMETRY_ESCAPE followed by the new value in full.
+// There is a key sample first, every TELEMETRY_KEY_INTERVAL and after
+// one is dropped for want of room, as the changes are only good from there.
+//
+#define TELEMETRY_FIELDS        6
+#define TELEMETRY_KEY           0x80
+#define TELEMETRY_ESCAPE        -128
+#define TELEMETRY_KEY_INTERVAL  50
+
+// Run history (see RunHistory), built with RUN_HISTORY, read HISTORY_CHUNK
+// entries at a time. The request has the entry to start from, 0 the first
+// sample, and may have a sample interval (s) for the next run. The response
+// is:
+//
+//   interval between the samples kept (u16 s), whether the run is still
+//   being recorded, program state it ended in, samples kept, marks kept,
+//   entry the chunk starts from, then the entries: the samples and after
+//   them the marks
+//
+// Without RUN_HISTORY the request is answered with a NAK numbered 0, even
+// when it was sequenced. It was taken, so the host doesn't send it again.
+//
+#define HISTORY_CHUNK 16
+
+// Loop profile (see LoopProfiler), built with LOOP_PROFILER. The request
+// may have a byte of PROFILE_RESET to start again once it is read. The
+// response is:
+//
+//   phases (ProfilePhase, 0 without LOOP_PROFILER), buckets, us per tick,
+//   then for each phase: count (u16), min, average, max (u16 ticks) and the
+//   count in each bucket (u16)
+//
+#define PROFILE_RESET 0x01
+
 //packet header
 struct PCPPacket {
   PCPPacket(PACKET_TYPE type)
@@ -47,7 +154,7 @@ struct PCPPacket {
   uint8_t startCode;
   uint16_t length;
   uint8_t eType; //lower 4 bits are used for seq
-};
+} __attribute__((packed)); //wire format, no padding on wider hosts
 
 class SerialControl {
 public:
@@ -58,22 +165,43 @@ public:
   byte* GetBuffer() { return buf; } //used for stored program parsing at start-up only if no serial command received
   boolean CommandReceived() { return iReceivedStatusRequest; }
   
+  // Queues all of the bytes to go out from the UART interrupt, or none if
+  // there is no room for them and wait is false.
+  static boolean Send(const void* pData, int length, boolean wait = false);
+  static int GetSendRoom();
+  
 private:
+  static void SerialReady();
   void ReadPacket();
   void ProcessPacket(byte* data, int datasize);
+  boolean CheckSequence(byte* data, int& datasize);
+  void SendAck(PACKET_TYPE type, uint8_t seq);
+  boolean BeginReply(uint8_t type, int payloadLength, boolean wait = false);
+  void SendReply(const void* pData, int length);
+  void EndReply();
   void SendStatus();
+  void SendBinaryStatus(uint8_t sections);
+  void SendLibrary();
+  void Subscribe(byte* data, int datasize);
+  void SendTelemetry();
+  void SendHistory(uint8_t offset);
+  void SendProfile(boolean reset);
 
-  char* AddParam(char* pBuffer, char key, int val, boolean init = false);  
-  char* AddParam(char* pBuffer, char key, unsigned long val, boolean init = false);
-  char* AddParam(char* pBuffer, char key, float val, int decimalDigits, boolean pad, boolean init = false);
-  char* AddParam(char* pBuffer, char key, const char* szVal, boolean init = false);
-  char* AddParam_P(char* pBuffer, char key, const char* szVal, boolean init = false);
+  int AddParam(int statusLen, char key, int val);  
+  int AddParam(int statusLen, char key, unsigned long val);
+  int AddParam(int statusLen, char key, float val, int decimalDigits, boolean pad);
+  int AddParam(int statusLen, char key, const char* szVal);
+  int AddParam_P(int statusLen, char key, const char* szVal);
+  static char* BeginParam(char* pField, int statusLen, char key);
+  int SendParam(const char* szField, int statusLen);
   
   const char* GetProgramStateString_P(Thermocycler::ProgramState state);
   const char* GetThermalStateString_P(Thermocycler::ThermalState state);
   
 private:
   byte buf[MAX_COMMAND_SIZE + 1]; //read or write buffer
+  byte iRequest[REQUEST_PACKET_MAX];
+  byte* ipPacket; //buf or iRequest, once the type is read
   
   typedef enum{
     STATE_START,
@@ -83,11 +211,19 @@ private:
   }PACKET_STATE;
   
   PACKET_STATE packetState;
-  uint8_t lastPacketSeq, checksum;
+  uint8_t lastPacketSeq; //0 until the first sequenced packet
+  uint8_t iReplySeq;
+  uint16_t iReplyCrc;
   uint16_t packetLen, packetRealLen, iCommandId;
   boolean bEscapeCodeFound;
   boolean iReceivedStatusRequest;
   
+  uint16_t iTelemetryIntervalMs; //0 for none
+  unsigned long iNextTelemetryMs;
+  uint8_t iTelemetrySample;
+  uint8_t iTelemetryKeyCountdown; //key sample at 0
+  int16_t iTelemetry[TELEMETRY_FIELDS]; //last sent
+  
   Display* ipDisplay;
 };
 
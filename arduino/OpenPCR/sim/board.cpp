@@ -0,0 +1,439 @@
+/*
+ *  board.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "board.h"
+
+#include <string.h>
+
+SimBoard gBoard;
+
+// Thermistor datasheet curves, 1 C per entry. These describe the physical
+// parts and are deliberately independent of the firmware's lookup tables.
+// plate: 0.1 Ohms from -40 C, lid: Ohms from 0 C
+static const uint32_t PLATE_THERMISTOR[] = {
+  3364790, 3149040, 2948480, 2761940, 2588380, 2426810, 2276320, 2136100, 2005390, 1883490,
+  1769740, 1663560, 1564410, 1471770, 1385180, 1304210, 1228470, 1157590, 1091220, 1029060,
+  970810, 916210, 865010, 816980, 771900, 729570, 689820, 652460, 617360, 584340,
+  553290, 524070, 496560, 470660, 446260, 423270, 401590, 381150, 361870, 343680,
+  326500, 310290, 294980, 280520, 266850, 253920, 241700, 230130, 219180, 208820,
+  199010, 189710, 180900, 172550, 164630, 157120, 149990, 143230, 136810, 130720,
+  124930, 119420, 114190, 109220, 104500, 100000, 95720, 91650, 87770, 84080,
+  80570, 77220, 74020, 70980, 68080, 65310, 62670, 60150, 57750, 55450,
+  53260, 51170, 49170, 47250, 45430, 43680, 42010, 40410, 38880, 37420,
+  36020, 34680, 33400, 32170, 30990, 29860, 28780, 27740, 26750, 25790,
+  24880, 24000, 23160, 22350, 21570, 20830, 20110, 19420, 18760, 18130,
+  17520, 16930, 16370, 15820, 15300, 14800, 14320, 13850, 13400, 12970,
+  12550, 12150, 11770, 11400, 11040, 10700, 10370, 10050, 9738, 9441,
+  9155, 8878, 8612, 8354, 8106, 7866, 7635, 7412, 7196, 6987, 6786,
+  6591, 6403, 6222, 6046, 5876 };
+
+static const uint32_t LID_THERMISTOR[] = {
+  32919, 31270, 29715, 28246, 26858, 25547, 24307, 23135, 22026, 20977,
+  19987, 19044, 18154, 17310, 16510, 15752, 15034, 14352, 13705, 13090,
+  12507, 11953, 11427, 10927, 10452, 10000, 9570, 9161, 8771, 8401,
+  8048, 7712, 7391, 7086, 6795, 6518, 6254, 6001, 5761, 5531, 5311,
+  5102, 4902, 4710, 4528, 4353, 4186, 4026, 3874, 3728, 3588,
+  3454, 3326, 3203, 3085, 2973, 2865, 2761, 2662, 2567, 2476,
+  2388, 2304, 2223, 2146, 2072, 2000, 1932, 1866, 1803, 1742,
+  1684, 1627, 1573, 1521, 1471, 1423, 1377, 1332, 1289, 1248,
+  1208, 1170, 1133, 1097, 1063, 1030, 998, 968, 938, 909,
+  882, 855, 829, 805, 781, 758, 735, 714, 693, 673,
+  653, 635, 616, 599, 582, 565, 550, 534, 519, 505,
+  491, 478, 465, 452, 440, 428, 416, 405, 395, 384,
+  374, 364, 355, 345, 337 };
+
+// approximate ATmega328 @ 16MHz I/O costs, in us
+#define DIGITAL_IO_US       4
+#define ANALOG_WRITE_US     8
+#define ANALOG_READ_US    112
+#define ADC_SAMPLE_US      104 //free running at clk/128
+#define ADC_MAX_SAMPLES   4096
+#define SPI_BYTE_US         3
+#define UART_BYTE_US     1042 //9600 baud, 10 bits per byte
+#define EEPROM_WRITE_US  3400
+
+// plate ADC conversion time (22 bit delta-sigma, ~13.75 samples/s)
+#define PLATE_CONVERSION_US 72700
+
+// plant parameters, in C/s and s
+#define PLANT_STEP_S         0.01
+#define PELTIER_HEAT_RATE    6.0
+#define PELTIER_COOL_RATE    5.0
+#define PELTIER_TAU          1.5
+#define BLOCK_TAU            2.0
+#define BLOCK_AMBIENT_TAU  250.0
+#define LID_HEAT_RATE        0.6
+#define LID_AMBIENT_TAU    250.0
+
+static double Interpolate(const uint32_t table[], int tableSize, int startTemp, double temp) {
+  double pos = temp - startTemp;
+  if (pos <= 0)
+    return table[0];
+  if (pos >= tableSize - 1)
+    return table[tableSize - 1];
+
+  int i = (int)pos;
+  double frac = pos - i;
+  return table[i] + (table[i + 1] - (double)table[i]) * frac;
+}
+
+SimBoard::SimBoard():
+  iNowUs(0),
+  iPendingDt(0),
+  ipTimerHandler(NULL),
+  iTimerPeriodUs(0),
+  iTimerNextUs(0),
+  iTimerMasked(false),
+  iInTimer(false),
+  iAdcPin(-1),
+  iAdcLastTakeUs(0),
+  iConverting(false),
+  iConversionReadyUs(0),
+  iSpiIndex(0),
+  iRxWireFreeUs(0),
+  iTxFreeUs(0),
+  ipUartHandler(NULL),
+  iInUart(false),
+  iEepromFreeUs(0),
+  ipEepromHandler(NULL),
+  iEepromMasked(false),
+  iInEeprom(false),
+  iExternalPower(true),
+  iSensorNoise(true),
+  iAmbient(25.0),
+  iPeltierTemp(25.0),
+  iBlockTemp(25.0),
+  iLidTemp(25.0),
+  iRandState(1) {
+
+  memset(iPinMode, 0, sizeof(iPinMode));
+  memset(iPinOut, 0, sizeof(iPinOut));
+  memset(iPwm, 0, sizeof(iPwm));
+  memset(iSpiShift, 0, sizeof(iSpiShift));
+  memset(iEeprom, 0xFF, sizeof(iEeprom));
+}
+
+// clock
+void SimBoard::Advance(uint64_t us) {
+  uint64_t endUs = iNowUs + us;
+  for (;;) {
+    bool inHandler = iInEeprom || iInUart;
+    bool timer = ipTimerHandler && !iTimerMasked && !iInTimer && !inHandler && iTimerNextUs <= endUs;
+    bool eeprom = ipEepromHandler && !iEepromMasked && !inHandler && iEepromFreeUs <= endUs;
+    bool uart = ipUartHandler && !inHandler && iTxFreeUs <= endUs;
+    if (!timer && !eeprom && !uart)
+      break;
+    
+    //earliest first, the timer last on a tie
+    uint64_t atUs = timer ? iTimerNextUs : ~0ULL;
+    if (eeprom && iEepromFreeUs <= atUs)
+      atUs = iEepromFreeUs;
+    if (uart && iTxFreeUs <= atUs)
+      atUs = iTxFreeUs;
+    AdvancePlant(atUs > iNowUs ? atUs - iNowUs : 0);
+    uint64_t startUs = iNowUs;
+    if (eeprom && iEepromFreeUs == atUs)
+      FireEepromReady();
+    else if (uart && iTxFreeUs == atUs)
+      FireUartReady();
+    else
+      FireTimer();
+    endUs += iNowUs - startUs; //the interrupted operation resumes afterwards
+  }
+  AdvancePlant(endUs - iNowUs);
+}
+
+void SimBoard::Idle() {
+  //timer 0 would wake it for millis() in 1.024ms at the most
+  uint64_t wakeUs = iNowUs + 1024;
+  if (ipTimerHandler && !iTimerMasked && iTimerNextUs < wakeUs)
+    wakeUs = iTimerNextUs;
+  if (ipEepromHandler && !iEepromMasked && iEepromFreeUs < wakeUs)
+    wakeUs = iEepromFreeUs;
+  if (ipUartHandler && iTxFreeUs < wakeUs)
+    wakeUs = iTxFreeUs;
+  Advance(wakeUs > iNowUs ? wakeUs - iNowUs : 1);
+}
+
+void SimBoard::AdvancePlant(uint64_t us) {
+  iNowUs += us;
+  iPendingDt += us / 1000000.0;
+  while (iPendingDt >= PLANT_STEP_S) {
+    StepPlant(PLANT_STEP_S);
+    iPendingDt -= PLANT_STEP_S;
+  }
+}
+
+// timer
+void SimBoard::StartTimer(uint64_t periodUs, void (*pHandler)()) {
+  iTimerPeriodUs = periodUs;
+  iTimerNextUs = iNowUs + periodUs;
+  ipTimerHandler = pHandler;
+}
+
+void SimBoard::SetTimerMasked(bool masked) {
+  iTimerMasked = masked;
+  if (!masked && ipTimerHandler && !iInTimer && iTimerNextUs <= iNowUs)
+    FireTimer(); //pending while masked
+}
+
+void SimBoard::FireTimer() {
+  iInTimer = true;
+  ipTimerHandler();
+  iInTimer = false;
+
+  //overflows are only counted while unmasked, so a late tick delays the next
+  do {
+    iTimerNextUs += iTimerPeriodUs;
+  } while (iTimerNextUs <= iNowUs);
+}
+
+// pins
+void SimBoard::PinMode(uint8_t pin, uint8_t mode) {
+  Advance(DIGITAL_IO_US);
+  if (pin < NUM_PINS)
+    iPinMode[pin] = mode;
+}
+
+void SimBoard::DigitalWrite(uint8_t pin, uint8_t val) {
+  Advance(DIGITAL_IO_US);
+  if (pin >= NUM_PINS)
+    return;
+
+  if (pin == SLAVESELECT_PIN && val != iPinOut[pin]) {
+    if (val == 0 && !iConverting) {
+      //chip select starts a conversion
+      iConverting = true;
+      iConversionReadyUs = iNowUs + PLATE_CONVERSION_US;
+      iSpiIndex = 0;
+    } else if (val != 0 && iSpiIndex > 0) {
+      //deselect after readout ends it
+      iConverting = false;
+    }
+  }
+  iPinOut[pin] = val;
+  iPwm[pin] = val ? 255 : 0;
+}
+
+int SimBoard::DigitalRead(uint8_t pin) {
+  Advance(DIGITAL_IO_US);
+  if (pin == POWER_PIN)
+    return iExternalPower;
+
+  if (pin == DATAIN_PIN) //MISO stays high until the conversion completes
+    return iConverting && iNowUs < iConversionReadyUs;
+
+  return pin < NUM_PINS ? iPinOut[pin] : 0;
+}
+
+int SimBoard::AnalogRead(uint8_t pin) {
+  Advance(ANALOG_READ_US);
+  return AdcCode(pin);
+}
+
+void SimBoard::StartAdcSampling(uint8_t pin) {
+  iAdcPin = pin;
+  iAdcLastTakeUs = iNowUs;
+}
+
+void SimBoard::TakeAdcSamples(uint32_t& sum, uint16_t& count) {
+  //the conversions run in the background, so sample them all now against
+  //the current plant rather than charging any time
+  uint64_t samples = iAdcPin >= 0 ? (iNowUs - iAdcLastTakeUs) / ADC_SAMPLE_US : 0;
+  count = samples < ADC_MAX_SAMPLES ? samples : ADC_MAX_SAMPLES;
+  iAdcLastTakeUs += samples * ADC_SAMPLE_US;
+
+  sum = 0;
+  for (int i = 0; i < count; i++)
+    sum += AdcCode(iAdcPin);
+}
+
+int SimBoard::AdcCode(uint8_t pin) {
+  if (pin == 0) {
+    //supply through a 10/3 divider
+    return iExternalPower ? (int)(12.0 * 3 / 10 / 5.0 * 1024) : 0;
+
+  } else if (pin == 1) {
+    //lid thermistor under a 2.2k pull-up
+    double resistance = Interpolate(LID_THERMISTOR, sizeof(LID_THERMISTOR) / sizeof(LID_THERMISTOR[0]), 0, iLidTemp);
+    int code = (int)(1024 * resistance / (resistance + 2200) + 0.5 + Noise(1.0));
+    return code < 0 ? 0 : (code > 1023 ? 1023 : code);
+  }
+
+  return 0;
+}
+
+void SimBoard::AnalogWrite(uint8_t pin, int val) {
+  Advance(ANALOG_WRITE_US);
+  if (pin < NUM_PINS)
+    iPwm[pin] = val;
+}
+
+uint8_t SimBoard::SpiTransfer(uint8_t data) {
+  Advance(SPI_BYTE_US);
+  if (iSpiIndex == 0)
+    LatchPlateSample();
+
+  return iSpiIndex < 4 ? iSpiShift[iSpiIndex++] : 0;
+}
+
+void SimBoard::LatchPlateSample() {
+  //plate thermistor under a 2.2k pull-up, 22 bits of 5V full scale
+  double resistance = Interpolate(PLATE_THERMISTOR, sizeof(PLATE_THERMISTOR) / sizeof(PLATE_THERMISTOR[0]), -40, iBlockTemp + Noise(0.02));
+  double voltage = 5.0 * resistance / (resistance + 22000);
+  uint32_t conv = (uint32_t)(voltage / 5.0 * 0x1FFFFF);
+
+  iSpiShift[0] = (conv >> 17) & 0x1F;
+  iSpiShift[1] = (conv >> 9) & 0xFF;
+  iSpiShift[2] = (conv >> 1) & 0xFF;
+  iSpiShift[3] = (conv & 0x01) << 7;
+}
+
+// uart
+void SimBoard::HostSend(const uint8_t* data, int len) {
+  if (iRxWireFreeUs < iNowUs)
+    iRxWireFreeUs = iNowUs;
+
+  for (int i = 0; i < len; i++) {
+    iRxWireFreeUs += UART_BYTE_US;
+    iRxWire.push_back(std::make_pair(iRxWireFreeUs, data[i]));
+  }
+}
+
+void SimBoard::PumpSerial() {
+  while (!iRxWire.empty() && iRxWire.front().first <= iNowUs) {
+    if (iRx.size() < RX_BUFFER_SIZE - 1)
+      iRx.push_back(iRxWire.front().second); //else overrun, byte is lost
+    iRxWire.pop_front();
+  }
+}
+
+int SimBoard::SerialAvailable() {
+  PumpSerial();
+  return iRx.size();
+}
+
+int SimBoard::SerialRead() {
+  PumpSerial();
+  if (iRx.empty())
+    return -1;
+
+  uint8_t c = iRx.front();
+  iRx.pop_front();
+  return c;
+}
+
+void SimBoard::SerialWrite(uint8_t c) {
+  //blocks until the previous byte has shifted out
+  AdvanceTo(iTxFreeUs);
+  iTxFreeUs = iNowUs + UART_BYTE_US;
+  iTx.push_back(c);
+}
+
+void SimBoard::StartUartInterrupt(void (*pHandler)()) {
+  ipUartHandler = pHandler;
+}
+
+void SimBoard::StopUartInterrupt() {
+  ipUartHandler = NULL;
+}
+
+void SimBoard::FireUartReady() {
+  //fires again straight away unless the handler sends a byte or stops
+  iInUart = true;
+  while (ipUartHandler && iTxFreeUs <= iNowUs)
+    ipUartHandler();
+  iInUart = false;
+}
+
+void SimBoard::UartWrite(uint8_t c) {
+  //the handler only runs once the previous byte has gone
+  iTxFreeUs = iNowUs + UART_BYTE_US;
+  iTx.push_back(c);
+}
+
+// eeprom
+uint8_t SimBoard::EepromRead(int address) {
+  AdvanceTo(iEepromFreeUs);
+  return address >= 0 && address < EEPROM_SIZE ? iEeprom[address] : 0xFF;
+}
+
+void SimBoard::StartEepromInterrupt(void (*pHandler)()) {
+  ipEepromHandler = pHandler;
+}
+
+void SimBoard::StopEepromInterrupt() {
+  ipEepromHandler = NULL;
+}
+
+bool SimBoard::SetEepromMasked(bool masked) {
+  bool oldMasked = iEepromMasked;
+  iEepromMasked = masked;
+  if (!masked && ipEepromHandler && !iInEeprom && iEepromFreeUs <= iNowUs)
+    FireEepromReady();
+  return oldMasked;
+}
+
+void SimBoard::FireEepromReady() {
+  //fires again straight away unless the handler starts a write or stops
+  iInEeprom = true;
+  while (ipEepromHandler && !iEepromMasked && iEepromFreeUs <= iNowUs)
+    ipEepromHandler();
+  iInEeprom = false;
+}
+
+void SimBoard::EepromWrite(int address, uint8_t val) {
+  //waits for the previous write, then returns while this one programs
+  AdvanceTo(iEepromFreeUs);
+  iEepromFreeUs = iNowUs + EEPROM_WRITE_US;
+  if (address >= 0 && address < EEPROM_SIZE)
+    iEeprom[address] = val;
+}
+
+// plant
+int SimBoard::GetPeltierDrive() {
+  if (iPinOut[PELTIER_HEAT_PIN] && !iPinOut[PELTIER_COOL_PIN])
+    return iPwm[PELTIER_PWM_PIN];
+  else if (iPinOut[PELTIER_COOL_PIN] && !iPinOut[PELTIER_HEAT_PIN])
+    return -iPwm[PELTIER_PWM_PIN];
+  else
+    return 0;
+}
+
+void SimBoard::StepPlant(double dt) {
+  //two node plate model: peltier face pumping heat into the block sensor
+  double peltier = iExternalPower ? GetPeltierDrive() / 1023.0 : 0;
+  double pumped = peltier > 0 ? peltier * PELTIER_HEAT_RATE : peltier * PELTIER_COOL_RATE;
+  double peltierDelta = pumped - (iPeltierTemp - iBlockTemp) / PELTIER_TAU;
+  double blockDelta = (iPeltierTemp - iBlockTemp) / BLOCK_TAU - (iBlockTemp - iAmbient) / BLOCK_AMBIENT_TAU;
+  iPeltierTemp += peltierDelta * dt;
+  iBlockTemp += blockDelta * dt;
+
+  //single node lid heater
+  double lid = iExternalPower ? iPwm[LID_PWM_PIN] / 255.0 : 0;
+  iLidTemp += (lid * LID_HEAT_RATE - (iLidTemp - iAmbient) / LID_AMBIENT_TAU) * dt;
+}
+
+double SimBoard::Noise(double amplitude) {
+  if (!iSensorNoise)
+    return 0;
+
+  //deterministic LCG so runs are repeatable
+  iRandState = iRandState * 1103515245 + 12345;
+  return ((iRandState >> 16) & 0x7FFF) / 32767.0 * 2 * amplitude - amplitude;
+}
@@ -0,0 +1,173 @@
+/*
+ *  board.h - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BOARD_H_
+#define _BOARD_H_
+
+#include <stdint.h>
+#include <deque>
+
+////////////////////////////////////////////////////////////////////
+// Class SimBoard
+//
+// Simulated OpenPCR board: virtual clock, pins, plate SPI ADC, lid ADC,
+// UART, EEPROM and a lumped thermal model of the block and lid.
+//
+// The clock only moves when the firmware does something that takes time on
+// the real part (I/O, delays, waiting on a peripheral), so runs are as fast
+// as the host allows. Waits for the UART and EEPROM are collapsed by jumping
+// the clock to the event being waited on. CPU time spent computing is not
+// modelled. A periodic timer interrupt fires at its due time inside whatever
+// operation is advancing the clock, which then resumes where it left off.
+//
+class SimBoard {
+public:
+  static const int NUM_PINS = 20;
+  static const int EEPROM_SIZE = 1024;
+  static const int RX_BUFFER_SIZE = 128;
+
+  SimBoard();
+
+  // clock
+  uint64_t Micros() { return iNowUs; }
+  void Advance(uint64_t us);
+  void AdvanceTo(uint64_t us) { if (us > iNowUs) Advance(us - iNowUs); }
+  void Idle(); //to the next interrupt
+
+  // timer interrupt; the handler preempts whatever is advancing the clock
+  void StartTimer(uint64_t periodUs, void (*pHandler)());
+  void SetTimerMasked(bool masked);
+
+  // pins
+  void PinMode(uint8_t pin, uint8_t mode);
+  void DigitalWrite(uint8_t pin, uint8_t val);
+  int DigitalRead(uint8_t pin);
+  int AnalogRead(uint8_t pin);
+  void StartAdcSampling(uint8_t pin);
+  void TakeAdcSamples(uint32_t& sum, uint16_t& count); //conversions since the last take
+  void AnalogWrite(uint8_t pin, int val);
+  uint8_t SpiTransfer(uint8_t data);
+
+  // uart
+  void HostSend(const uint8_t* data, int len); //queue bytes at the wire rate
+  int SerialAvailable();
+  int SerialRead();
+  void SerialWrite(uint8_t c); //blocking
+  std::deque<uint8_t>& HostReceived() { return iTx; }
+  
+  // data register empty interrupt, fired whenever the transmitter is free
+  // while started; preempts the timer handler like the EEPROM one, and
+  // neither preempts the other
+  void StartUartInterrupt(void (*pHandler)());
+  void StopUartInterrupt();
+  void UartWrite(uint8_t c); //from the handler
+
+  // eeprom
+  uint8_t EepromRead(int address);
+  void EepromWrite(int address, uint8_t val);
+  
+  // ready interrupt, fired whenever no write is programming while started
+  // and unmasked; preempts whatever is advancing the clock, even the timer
+  // handler, but not the other way round
+  void StartEepromInterrupt(void (*pHandler)());
+  void StopEepromInterrupt();
+  bool SetEepromMasked(bool masked); //returns the old mask
+  uint8_t* EepromData() { return iEeprom; }
+
+  // plant
+  void SetExternalPower(bool on) { iExternalPower = on; }
+  void SetAmbient(double temp) { iAmbient = temp; }
+  void SetSensorNoise(bool on) { iSensorNoise = on; }
+  double GetPlateTemp() { return iBlockTemp; }
+  double GetLidTemp() { return iLidTemp; }
+  int GetPeltierDrive(); //signed, -1023 (cool) to 1023 (heat)
+  int GetLidDrive() { return iPwm[LID_PWM_PIN]; }
+
+private:
+  void AdvancePlant(uint64_t us);
+  void FireTimer();
+  void FireEepromReady();
+  void FireUartReady();
+  void StepPlant(double dt);
+  void LatchPlateSample();
+  int AdcCode(uint8_t pin);
+  void PumpSerial();
+  double Noise(double amplitude);
+
+private:
+  static const int PELTIER_COOL_PIN = 2;
+  static const int LID_PWM_PIN = 3;
+  static const int PELTIER_HEAT_PIN = 4;
+  static const int PELTIER_PWM_PIN = 9;
+  static const int SLAVESELECT_PIN = 10;
+  static const int DATAIN_PIN = 12;
+  static const int POWER_PIN = 14; //A0
+
+  uint64_t iNowUs;
+  double iPendingDt;
+
+  // timer
+  void (*ipTimerHandler)();
+  uint64_t iTimerPeriodUs;
+  uint64_t iTimerNextUs;
+  bool iTimerMasked;
+  bool iInTimer;
+
+  uint8_t iPinMode[NUM_PINS];
+  uint8_t iPinOut[NUM_PINS];
+  int iPwm[NUM_PINS];
+
+  // free-running ADC
+  int iAdcPin; //-1 when not sampling
+  uint64_t iAdcLastTakeUs;
+
+  // plate ADC
+  bool iConverting;
+  uint64_t iConversionReadyUs;
+  uint8_t iSpiShift[4];
+  int iSpiIndex;
+
+  // uart
+  std::deque<std::pair<uint64_t, uint8_t> > iRxWire;
+  std::deque<uint8_t> iRx;
+  std::deque<uint8_t> iTx;
+  uint64_t iRxWireFreeUs;
+  uint64_t iTxFreeUs;
+  void (*ipUartHandler)();
+  bool iInUart;
+
+  // eeprom
+  uint8_t iEeprom[EEPROM_SIZE];
+  uint64_t iEepromFreeUs;
+  void (*ipEepromHandler)();
+  bool iEepromMasked;
+  bool iInEeprom;
+
+  // plant
+  bool iExternalPower;
+  bool iSensorNoise;
+  double iAmbient;
+  double iPeltierTemp;
+  double iBlockTemp;
+  double iLidTemp;
+  uint32_t iRandState;
+};
+
+extern SimBoard gBoard;
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ *  HardwareSerial.h - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include "Print.h"
+
+// Blocking UART as in the 0022 core: write() waits for the previous byte to
+// shift out, reads come from a 128 byte receive ring.
+class HardwareSerial: public Print {
+public:
+  void begin(long baud);
+  int available();
+  int read();
+  void flush();
+  virtual void write(uint8_t c);
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
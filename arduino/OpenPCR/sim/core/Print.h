@@ -0,0 +1,39 @@
+/*
+ *  Print.h - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef Print_h
+#define Print_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Print {
+public:
+  virtual ~Print() {}
+
+  virtual void write(uint8_t) = 0;
+  virtual void write(const char* str);
+  virtual void write(const uint8_t* buffer, size_t size);
+
+  void print(const char str[]);
+  void print(char c);
+  void print(int n);
+  void print(unsigned long n);
+};
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ *  core.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "WProgram.h"
+#include "../board.h"
+
+HardwareSerial Serial;
+
+// time
+unsigned long millis() {
+  return (unsigned long)(gBoard.Micros() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)gBoard.Micros();
+}
+
+void delay(unsigned long ms) {
+  gBoard.Advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  gBoard.Advance(us);
+}
+
+// pins
+void pinMode(uint8_t pin, uint8_t mode) {
+  gBoard.PinMode(pin, mode);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  gBoard.DigitalWrite(pin, val);
+}
+
+int digitalRead(uint8_t pin) {
+  return gBoard.DigitalRead(pin);
+}
+
+int analogRead(uint8_t pin) {
+  return gBoard.AnalogRead(pin);
+}
+
+void analogWrite(uint8_t pin, int val) {
+  gBoard.AnalogWrite(pin, val);
+}
+
+// avr-libc extensions
+char* ltoa(long val, char* s, int radix) {
+  if (val < 0) {
+    *s = '-';
+    ultoa(-(unsigned long)val, s + 1, radix);
+  } else {
+    ultoa(val, s, radix);
+  }
+  return s;
+}
+
+char* itoa(int val, char* s, int radix) {
+  return ltoa(val, s, radix);
+}
+
+char* ultoa(unsigned long val, char* s, int radix) {
+  char buf[8 * sizeof(val) + 1];
+  int i = 0;
+  do {
+    int digit = val % radix;
+    buf[i++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    val /= radix;
+  } while (val);
+
+  char* p = s;
+  while (i)
+    *p++ = buf[--i];
+  *p = '\0';
+  return s;
+}
+
+////////////////////////////////////////////////////////////////////
+// Class Print
+void Print::write(const char* str) {
+  while (*str)
+    write((uint8_t)*str++);
+}
+
+void Print::write(const uint8_t* buffer, size_t size) {
+  while (size--)
+    write(*buffer++);
+}
+
+void Print::print(const char str[]) {
+  write(str);
+}
+
+void Print::print(char c) {
+  write((uint8_t)c);
+}
+
+void Print::print(int n) {
+  char buf[12];
+  write(itoa(n, buf, 10));
+}
+
+void Print::print(unsigned long n) {
+  char buf[24];
+  write(ultoa(n, buf, 10));
+}
+
+////////////////////////////////////////////////////////////////////
+// Class HardwareSerial
+void HardwareSerial::begin(long baud) {
+}
+
+int HardwareSerial::available() {
+  return gBoard.SerialAvailable();
+}
+
+int HardwareSerial::read() {
+  return gBoard.SerialRead();
+}
+
+void HardwareSerial::flush() {
+  while (gBoard.SerialRead() >= 0);
+}
+
+void HardwareSerial::write(uint8_t c) {
+  gBoard.SerialWrite(c);
+}
@@ -0,0 +1,104 @@
+/*
+ *  hardware_sim.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcr_includes.h"
+#include "hardware.h"
+
+#include "board.h"
+
+////////////////////////////////////////////////////////////////////
+// Class Hardware
+void Hardware::InitSpi() {
+  delay(10);
+}
+
+uint8_t Hardware::SpiTransfer(uint8_t data) {
+  return gBoard.SpiTransfer(data);
+}
+
+void Hardware::InitPwm() {
+}
+
+boolean Hardware::CheckRestarted() {
+  return false; //always a power-on reset
+}
+
+void Hardware::Idle() {
+  gBoard.Idle();
+}
+
+int Hardware::GetFreeRam() {
+  return 0; //not known off the board
+}
+
+int Hardware::GetLowestFreeRam() {
+  return 0;
+}
+
+void Hardware::StartControlTimer(unsigned int periodMs, void (*pTick)()) {
+  //same rounding to whole 1.023ms timer 1 overflows as the board
+  unsigned long overflows = ((unsigned long)(periodMs + 1) * 1000 + 1022) / 1023;
+  gBoard.StartTimer(overflows * 1023, pTick);
+}
+
+void Hardware::LockControl() {
+  gBoard.SetTimerMasked(true);
+}
+
+void Hardware::UnlockControl() {
+  gBoard.SetTimerMasked(false);
+}
+
+void Hardware::StartAdcSampling(uint8_t pin) {
+  gBoard.StartAdcSampling(pin);
+}
+
+void Hardware::TakeAdcSamples(uint32_t& sum, uint16_t& count) {
+  gBoard.TakeAdcSamples(sum, count);
+}
+
+void Hardware::StartEepromWrites(void (*pReady)()) {
+  gBoard.StartEepromInterrupt(pReady);
+}
+
+void Hardware::StopEepromWrites() {
+  gBoard.StopEepromInterrupt();
+}
+
+void Hardware::WriteEeprom(int address, uint8_t val) {
+  gBoard.EepromWrite(address, val);
+}
+
+void Hardware::StartSerialWrites(void (*pReady)()) {
+  gBoard.StartUartInterrupt(pReady);
+}
+
+void Hardware::StopSerialWrites() {
+  gBoard.StopUartInterrupt();
+}
+
+void Hardware::WriteSerial(uint8_t val) {
+  gBoard.UartWrite(val);
+}
+
+uint8_t Hardware::ReadEeprom(int address) {
+  bool masked = gBoard.SetEepromMasked(true);
+  uint8_t val = gBoard.EepromRead(address);
+  gBoard.SetEepromMasked(masked);
+  return val;
+}
@@ -0,0 +1,30 @@
+/*
+ *  EEPROM.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "EEPROM.h"
+#include "../../board.h"
+
+EEPROMClass EEPROM;
+
+uint8_t EEPROMClass::read(int address) {
+  return gBoard.EepromRead(address);
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  gBoard.EepromWrite(address, value);
+}
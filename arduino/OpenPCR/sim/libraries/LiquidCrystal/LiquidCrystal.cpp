@@ -0,0 +1,79 @@
+/*
+ *  LiquidCrystal.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "LiquidCrystal.h"
+#include "../../board.h"
+
+#include <string.h>
+
+// 0022 library timings, in us
+#define BYTE_TRANSFER_US   250 //two nibbles with 100us enable pulses
+#define CLEAR_DELAY_US    2000
+#define BEGIN_DELAY_US   60000
+
+LiquidCrystal* LiquidCrystal::spInstance = NULL;
+
+LiquidCrystal::LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3):
+  iCols(MAX_COLS),
+  iRows(MAX_ROWS),
+  iCol(0),
+  iRow(0) {
+  spInstance = this;
+  for (int i = 0; i < MAX_ROWS; i++) {
+    memset(iScreen[i], ' ', MAX_COLS);
+    iScreen[i][MAX_COLS] = '\0';
+  }
+}
+
+void LiquidCrystal::begin(uint8_t cols, uint8_t rows) {
+  iCols = cols < MAX_COLS ? cols : MAX_COLS;
+  iRows = rows < MAX_ROWS ? rows : MAX_ROWS;
+  gBoard.Advance(BEGIN_DELAY_US);
+  clear();
+}
+
+void LiquidCrystal::clear() {
+  Command();
+  gBoard.Advance(CLEAR_DELAY_US);
+  for (int i = 0; i < MAX_ROWS; i++)
+    memset(iScreen[i], ' ', MAX_COLS);
+  iCol = iRow = 0;
+}
+
+void LiquidCrystal::home() {
+  Command();
+  gBoard.Advance(CLEAR_DELAY_US);
+  iCol = iRow = 0;
+}
+
+void LiquidCrystal::setCursor(uint8_t col, uint8_t row) {
+  Command();
+  iCol = col;
+  iRow = row < iRows ? row : iRows - 1;
+}
+
+void LiquidCrystal::write(uint8_t value) {
+  gBoard.Advance(BYTE_TRANSFER_US);
+  if (iCol < iCols)
+    iScreen[iRow][iCol] = value;
+  iCol++; //no wrap into the next line, as on the HD44780 20x4 layout this prints off-screen
+}
+
+void LiquidCrystal::Command() {
+  gBoard.Advance(BYTE_TRANSFER_US);
+}
@@ -0,0 +1,57 @@
+/*
+ *  LiquidCrystal.h - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LiquidCrystal_h
+#define LiquidCrystal_h
+
+#include <stdint.h>
+#include "Print.h"
+
+// HD44780 in 4 bit mode. Keeps the character RAM so the simulator can show
+// the screen, and charges the bus and command delays of the 0022 library.
+class LiquidCrystal: public Print {
+public:
+  static const int MAX_COLS = 20;
+  static const int MAX_ROWS = 4;
+
+  LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3);
+
+  void begin(uint8_t cols, uint8_t rows);
+  void clear();
+  void home();
+  void setCursor(uint8_t col, uint8_t row);
+  virtual void write(uint8_t value);
+  using Print::write;
+
+  // simulator access
+  const char* GetRow(int row) { return iScreen[row]; }
+  static LiquidCrystal* GetInstance() { return spInstance; }
+
+private:
+  void Command();
+
+private:
+  char iScreen[MAX_ROWS][MAX_COLS + 1];
+  uint8_t iCols;
+  uint8_t iRows;
+  uint8_t iCol;
+  uint8_t iRow;
+  static LiquidCrystal* spInstance;
+};
+
+#endif
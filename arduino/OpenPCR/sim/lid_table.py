@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+#
+# Prints LID_ADC_TABLE for thermocycler.cpp: the lid temperature in 0.01 C
+# for each 10-bit ADC code, through the 2.2k divider the lid thermistor
+# reads from, as the firmware computed it from resistances before.
+#
+#   python lid_table.py
+#
+# make lidtest checks the table in thermocycler.cpp against the lookup here.
+#
+
+# lid thermistor resistance in Ohms at 0, 1, 2... C
+LID_RESISTANCE_TABLE = [
+  32919, 31270, 29715, 28246, 26858, 25547, 24307, 23135, 22026, 20977,
+  19987, 19044, 18154, 17310, 16510, 15752, 15034, 14352, 13705, 13090,
+  12507, 11953, 11427, 10927, 10452, 10000, 9570, 9161, 8771, 8401,
+  8048, 7712, 7391, 7086, 6795, 6518, 6254, 6001, 5761, 5531, 5311,
+  5102, 4902, 4710, 4528, 4353, 4186, 4026, 3874, 3728, 3588,
+  3454, 3326, 3203, 3085, 2973, 2865, 2761, 2662, 2567, 2476,
+  2388, 2304, 2223, 2146, 2072, 2000, 1932, 1866, 1803, 1742,
+  1684, 1627, 1573, 1521, 1471, 1423, 1377, 1332, 1289, 1248,
+  1208, 1170, 1133, 1097, 1063, 1030, 998, 968, 938, 909,
+  882, 855, 829, 805, 781, 758, 735, 714, 693, 673,
+  653, 635, 616, 599, 582, 565, 550, 534, 519, 505,
+  491, 478, 465, 452, 440, 428, 416, 405, 395, 384,
+  374, 364, 355, 345, 337 ]
+
+def adc_to_resistance(code):
+  voltage_mv = code * 5000 // 1024
+  return voltage_mv * 2200 // (5000 - voltage_mv)
+
+def resistance_to_temp(resistance):
+  # linear between the degrees either side, as TableLookup() did
+  for i, value in enumerate(LID_RESISTANCE_TABLE):
+    if resistance >= value:
+      break
+  if i == 0:
+    return 0
+  high = LID_RESISTANCE_TABLE[i - 1]
+  low = LID_RESISTANCE_TABLE[i]
+  return i - float(resistance - low) / (high - low)
+
+# from the first code in the table's range, 125 C, down to 0 C
+code = 0
+while adc_to_resistance(code) < LID_RESISTANCE_TABLE[-1]:
+  code += 1
+start = code
+temps = []
+while True:
+  resistance = adc_to_resistance(code)
+  temps.append(int(round(resistance_to_temp(resistance) * 100)))
+  if resistance >= LID_RESISTANCE_TABLE[0]:
+    break
+  code += 1
+
+print("#define LID_ADC_TABLE_START %d" % start)
+print("PROGMEM const unsigned int LID_ADC_TABLE[] = {")
+for i in range(0, len(temps), 10):
+  line = ", ".join(str(t) for t in temps[i:i + 10])
+  print("  " + line + (" };" if i + 10 >= len(temps) else ","))
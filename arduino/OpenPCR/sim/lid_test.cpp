@@ -0,0 +1,162 @@
+/*
+ *  lid_test.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the firmware's LID_ADC_TABLE against the lookup it replaced, the
+// ADC code to a resistance through the 2.2k divider and a linear search of
+// the thermistor's resistance table, and times the two. Exits 1 if the
+// table is off.
+//
+// usage: lid_test
+//
+// For every 10-bit code the old lookup gave a temperature for, the table
+// has to give the same to within its 0.01 C rounding. Past the hot end the
+// old search read beyond its table; the new one holds 125 C there, and 0 C
+// past the cold end as before. In between codes the table is interpolated
+// in the 1/8 codes the firmware averages to, which has to stay monotonic.
+//
+// The table is taken from ../thermocycler.cpp by the Makefile, so this is
+// what the firmware has, not what lid_table.py makes now.
+
+#include "WProgram.h"
+#include <avr/pgmspace.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "lid_adc_table.h"
+
+#define LID_ADC_TABLE_SIZE (int)(sizeof(LID_ADC_TABLE) / sizeof(LID_ADC_TABLE[0]))
+#define MAX_DIFFERENCE_C 0.0051 //half the table's 0.01 C, and float rounding
+#define BENCH_REPS 2000
+
+// lid thermistor resistance in Ohms at 0, 1, 2... C, as lid_table.py has it
+static const unsigned int LID_RESISTANCE_TABLE[] = {
+  32919, 31270, 29715, 28246, 26858, 25547, 24307, 23135, 22026, 20977,
+  19987, 19044, 18154, 17310, 16510, 15752, 15034, 14352, 13705, 13090,
+  12507, 11953, 11427, 10927, 10452, 10000, 9570, 9161, 8771, 8401,
+  8048, 7712, 7391, 7086, 6795, 6518, 6254, 6001, 5761, 5531, 5311,
+  5102, 4902, 4710, 4528, 4353, 4186, 4026, 3874, 3728, 3588,
+  3454, 3326, 3203, 3085, 2973, 2865, 2761, 2662, 2567, 2476,
+  2388, 2304, 2223, 2146, 2072, 2000, 1932, 1866, 1803, 1742,
+  1684, 1627, 1573, 1521, 1471, 1423, 1377, 1332, 1289, 1248,
+  1208, 1170, 1133, 1097, 1063, 1030, 998, 968, 938, 909,
+  882, 855, 829, 805, 781, 758, 735, 714, 693, 673,
+  653, 635, 616, 599, 582, 565, 550, 534, 519, 505,
+  491, 478, 465, 452, 440, 428, 416, 405, 395, 384,
+  374, 364, 355, 345, 337 };
+#define LID_RESISTANCE_TABLE_SIZE (int)(sizeof(LID_RESISTANCE_TABLE) / sizeof(LID_RESISTANCE_TABLE[0]))
+
+static unsigned long CodeToResistance(int code) {
+  unsigned long voltage_mv = (unsigned long)code * 5000 / 1024;
+  return voltage_mv * 2200 / (5000 - voltage_mv);
+}
+
+// as ReadLidTemp() and TableLookup() were, false where it read past the table
+static bool OldLookup(int code, float& temp) {
+  unsigned long resistance = CodeToResistance(code);
+  int i;
+  for (i = 0; i < LID_RESISTANCE_TABLE_SIZE; i++) {
+    if (resistance >= LID_RESISTANCE_TABLE[i])
+      break;
+  }
+
+  if (i == LID_RESISTANCE_TABLE_SIZE)
+    return false;
+  if (i > 0) {
+    unsigned long high_val = LID_RESISTANCE_TABLE[i - 1];
+    unsigned long low_val = LID_RESISTANCE_TABLE[i];
+    temp = i - (float)(resistance - low_val) / (float)(high_val - low_val);
+  } else {
+    temp = 0;
+  }
+  return true;
+}
+
+// as ReadLidTemp() is, from the mean in 1/8 codes
+static double NewLookup(uint32_t code8) {
+  int index = (int)(code8 >> 3) - LID_ADC_TABLE_START;
+  if (index < 0)
+    return pgm_read_word_near(LID_ADC_TABLE) * 0.01;
+  if (index >= LID_ADC_TABLE_SIZE - 1)
+    return pgm_read_word_near(LID_ADC_TABLE + LID_ADC_TABLE_SIZE - 1) * 0.01;
+  int lower = pgm_read_word_near(LID_ADC_TABLE + index);
+  int upper = pgm_read_word_near(LID_ADC_TABLE + index + 1);
+  return (lower + (upper - lower) * (int)(code8 & 7) / 8.0) * 0.01;
+}
+
+static double Now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int main() {
+  int failures = 0;
+  int compared = 0;
+  double worst = 0;
+  for (int code = 0; code < 1024; code++) {
+    double temp = NewLookup(code * 8);
+    float oldTemp;
+    double expected;
+    if (OldLookup(code, oldTemp)) {
+      expected = oldTemp;
+      compared++;
+    } else {
+      expected = pgm_read_word_near(LID_ADC_TABLE) * 0.01; //held at the hot end
+    }
+
+    double difference = fabs(temp - expected);
+    if (difference > worst)
+      worst = difference;
+    if (difference > MAX_DIFFERENCE_C) {
+      printf("FAIL code %d: %.4f C, was %.4f C\n", code, temp, expected);
+      failures++;
+    }
+  }
+
+  for (uint32_t code8 = 1; code8 < 1024 * 8; code8++) {
+    if (NewLookup(code8) > NewLookup(code8 - 1)) {
+      printf("FAIL code %.3f: %.4f C, up from %.4f C\n", code8 / 8.0, NewLookup(code8), NewLookup(code8 - 1));
+      failures++;
+    }
+  }
+  printf("%d codes from the old lookup, worst difference %.4f C\n", compared, worst);
+
+  //both over the whole range, the new one at the 1/8 codes it is read at
+  volatile double sink = 0;
+  double start = Now();
+  for (int rep = 0; rep < BENCH_REPS; rep++) {
+    for (int code = 0; code < 1024; code++) {
+      float temp = 125;
+      OldLookup(code, temp);
+      sink += temp;
+    }
+  }
+  double oldNs = (Now() - start) / (BENCH_REPS * 1024.0) * 1e9;
+  start = Now();
+  for (int rep = 0; rep < BENCH_REPS; rep++) {
+    for (int code = 0; code < 1024; code++)
+      sink += NewLookup(code * 8 + (rep & 7));
+  }
+  double newNs = (Now() - start) / (BENCH_REPS * 1024.0) * 1e9;
+  printf("lookup on this host: old %.1f ns, new %.1f ns\n", oldNs, newNs);
+
+  printf("%s\n", failures ? "FAIL" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,717 @@
+/*
+ *  main.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the firmware against the simulated board with a fast-forward clock.
+//
+// usage: openpcr_sim [-t seconds] [-i seconds] [-e eeprom.bin] [-a ambient]
+//                    [-n] [-l] [-b] [-L] [-s] [-S] [-x n] [-T ms] [-H s] [-P] [-q] [command...]
+//
+//   -t  give up after this much simulated time (default 14400)
+//   -i  status poll interval in simulated seconds, 0 for none (default 1)
+//   -e  EEPROM image, loaded at start and saved at exit
+//   -a  ambient temperature in C (default 25)
+//   -n  noise-free sensors
+//   -l  print the LCD with each status line
+//   -b  send the commands in the binary format instead of ASCII
+//   -L  list the program library once the commands are sent
+//   -s  poll for the binary status frame, printed as the ASCII one would be,
+//       with the lid noise as z
+//   -S  sequenced, CRC-checked packets, with the commands sent back to back
+//   -x  with -S, corrupt every nth packet sent to the firmware
+//   -T  subscribe to telemetry every this many ms, printed as '#' lines
+//   -H  record the run history every this many s, read and printed as '#'
+//       lines once the run is over ("# no run history" without RUN_HISTORY)
+//   -P  print the loop profile once the run is over
+//   -q  print only the run summary
+//
+// The command is what the host app writes to the device, e.g.
+//   "s=ACGTC&c=start&d=1&l=110&n=Test&p=(35[30|95|Melt][30|55|Anneal])"
+// and is sent the way the USB bridge does once startup completes, or with -b
+// translated to the binary format (see CommandParser) and sent as is. Further
+// commands follow COMMAND_SPACING_US apart; "c=store" ones always go binary, the
+// only way to store a library program, e.g.
+//   -L "c=store&i=3&n=Short&p=(2[5|95|Melt])" "c=start&i=3"
+// The library listing is printed as a '#' line, and ends the run unless a
+// command started one. With -S the host keeps up to SEQ_WINDOW packets in flight and
+// prints the ACKs and NAKs it gets as '#' lines. Each status
+// poll prints the simulated plate and lid temperatures, the Peltier and lid
+// drive, and the status string the firmware returned. The run ends when the
+// firmware reports the program complete, or is back to stopped after running
+// something (e.g. "c=tune").
+
+#include "pcr_includes.h"
+#include "serialcontrol.h"
+#include "program.h"
+#include "history.h"
+#include "profiler.h"
+
+#include <LiquidCrystal.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "board.h"
+
+#define FILE_SIGNATURE      "s=ACGTC"
+#define FILE_MAX_LENGTH     252
+#define COMMAND_TIME_US     6000000ULL //after the 5s startup delay
+#define COMMAND_SPACING_US  2000000ULL
+#define MAX_COMMANDS        8
+#define LOOP_OVERHEAD_US    50 //loop() bookkeeping not charged by any I/O
+#define RESEND_US           1500000ULL //without an ACK, NAK or reply
+
+const char DEFAULT_COMMAND[] = "s=ACGTC&c=start&d=1&l=110&n=Simulated PCR"
+  "&p=(1[120|95|Initial Step])(35[30|95|Denaturing][30|55|Annealing][60|72|Extending])"
+  "(1[300|72|Final Extension][0|4|Final Hold])";
+
+// sequenced packets (-S) wait here for their ACK or reply, oldest first,
+// numbered on from sFirstSeq
+struct SPending {
+  uint8_t type;
+  std::vector<uint8_t> payload;
+};
+static bool sSequenced = false;
+static std::deque<SPending> sPending;
+static unsigned int sNumInFlight = 0; //of sPending, sent and not answered
+static uint8_t sFirstSeq = 1;
+static bool sSynced = false;
+static uint64_t sResendUs = 0;
+static int sCorruptEvery = 0;
+static unsigned long sPacketsSent = 0;
+static unsigned long sPacketsResent = 0;
+
+static uint8_t SeqAfter(uint8_t seq, int count) {
+  return (seq - 1 + count) % SEQ_COUNT + 1;
+}
+
+// a START_CODE in the payload goes out behind an ESCAPE_CODE, which the
+// firmware drops. A sequenced type gets its CRC on the end.
+static void SendPacket(uint8_t type, const uint8_t* pPayload, int payloadLen) {
+  uint8_t payload[MAX_COMMAND_SIZE + 2];
+  memcpy(payload, pPayload, payloadLen);
+  if (type & 0x0f) {
+    uint16_t crc = crc16Update(0xFFFF, type);
+    for (int i = 0; i < payloadLen; i++)
+      crc = crc16Update(crc, pPayload[i]);
+    payload[payloadLen++] = crc & 0xff;
+    payload[payloadLen++] = crc >> 8;
+  }
+  
+  uint8_t packet[sizeof(PCPPacket) + 2 * (MAX_COMMAND_SIZE + 2)];
+  uint16_t length = sizeof(PCPPacket);
+  for (int i = 0; i < payloadLen; i++) {
+    if (payload[i] == START_CODE)
+      packet[length++] = ESCAPE_CODE;
+    packet[length++] = payload[i];
+  }
+  
+  packet[0] = START_CODE;
+  packet[1] = length & 0xff;
+  packet[2] = (length & 0xff00) >> 8;
+  packet[3] = type;
+  if ((type & 0x0f) && sCorruptEvery && ++sPacketsSent % sCorruptEvery == 0)
+    packet[length - 1] ^= 0x01; //a bit flipped on the wire
+  gBoard.HostSend(packet, length);
+}
+
+// sends what the window allows
+static void PumpPending() {
+  while (sNumInFlight < sPending.size() && sNumInFlight < SEQ_WINDOW) {
+    const SPending& pending = sPending[sNumInFlight];
+    SendPacket(pending.type | SeqAfter(sFirstSeq, sNumInFlight), pending.payload.data(), pending.payload.size());
+    sNumInFlight++;
+    sResendUs = gBoard.Micros() + RESEND_US;
+  }
+}
+
+static void Transmit(uint8_t type, const uint8_t* pPayload, int payloadLen) {
+  if (!sSequenced) {
+    SendPacket(type, pPayload, payloadLen);
+    return;
+  }
+  
+  SPending pending;
+  pending.type = type;
+  pending.payload.assign(pPayload, pPayload + payloadLen);
+  sPending.push_back(pending);
+  PumpPending();
+}
+
+// everything up to and including seq was taken
+static void Acknowledge(uint8_t seq) {
+  for (unsigned int i = 0; i < sNumInFlight; i++) {
+    if (SeqAfter(sFirstSeq, i) != seq)
+      continue;
+    sPending.erase(sPending.begin(), sPending.begin() + i + 1);
+    sNumInFlight -= i + 1;
+    sFirstSeq = SeqAfter(seq, 1);
+    sSynced = true;
+    sResendUs = gBoard.Micros() + RESEND_US;
+    PumpPending();
+    return;
+  }
+}
+
+// everything before expectedSeq was taken, the rest goes again
+static void Resend(uint8_t expectedSeq) {
+  if (!sSynced) {
+    sFirstSeq = expectedSeq; //the firmware is carrying on from before
+    sSynced = true;
+  } else if (expectedSeq != sFirstSeq) {
+    Acknowledge(SeqAfter(expectedSeq, SEQ_COUNT - 1));
+  }
+  sPacketsResent += sNumInFlight;
+  sNumInFlight = 0;
+  PumpPending();
+}
+
+static void SendCommand(const char* szCommand) {
+  //the bridge strips the file signature and always sends a full file
+  uint8_t file[FILE_MAX_LENGTH];
+  memset(file, 0, sizeof(file));
+  if (strncmp(szCommand, FILE_SIGNATURE, strlen(FILE_SIGNATURE)) == 0)
+    szCommand += strlen(FILE_SIGNATURE);
+  strncpy((char*)file, szCommand, sizeof(file) - 1);
+  file[sizeof(file) - 1] = '\0';
+  
+  //sent directly rather than by the bridge, as long as it is
+  int length = sSequenced && strlen(szCommand) < sizeof(file) ? strlen(szCommand) + 1 : sizeof(file);
+  Transmit(SEND_CMD, file, length);
+}
+
+static void PutUint16(uint8_t*& pOut, int val) {
+  *pOut++ = val & 0xff;
+  *pOut++ = (val >> 8) & 0xff;
+}
+
+static int CentiTemp(const char* szVal) {
+  double temp = atof(szVal);
+  return (int)(temp * 100 + (temp < 0 ? -0.5 : 0.5));
+}
+
+// the ASCII command in the binary format, returns its length
+static int EncodeBinaryCommand(const char* szCommand, uint8_t* pCommand) {
+  char command[MAX_COMMAND_SIZE * 2];
+  strncpy(command, szCommand, sizeof(command) - 1);
+  command[sizeof(command) - 1] = '\0';
+  
+  const char* szName = "";
+  const char* szProgram = "";
+  uint8_t* pOut = pCommand + BINARY_HEADER_SIZE;
+  memset(pCommand, 0, BINARY_HEADER_SIZE);
+  pCommand[0] = BINARY_COMMAND_MAGIC;
+  pCommand[1] = BINARY_COMMAND_VERSION;
+  for (char* pParam = strtok(command, "&"); pParam; pParam = strtok(NULL, "&")) {
+    char* pValue = strchr(pParam, '=');
+    if (pValue == NULL)
+      continue;
+    pValue++;
+    switch (pParam[0]) {
+    case 'd': pCommand[4] = atoi(pValue) & 0xff; pCommand[5] = (atoi(pValue) >> 8) & 0xff; break;
+    case 'c':
+      pCommand[6] = strcmp(pValue, "start") == 0 ? SCommand::EStart : strcmp(pValue, "stop") == 0 ? SCommand::EStop :
+        strcmp(pValue, "cfg") == 0 ? SCommand::EConfig : strcmp(pValue, "tune") == 0 ? SCommand::ETune :
+        strcmp(pValue, "store") == 0 ? SCommand::EStore : strcmp(pValue, "delete") == 0 ? SCommand::EDelete : SCommand::ENone;
+      break;
+    case 'i': pCommand[9] = atoi(pValue); break;
+    case 'l': pCommand[7] = atoi(pValue); break;
+    case 'o': pCommand[8] = atoi(pValue); break;
+    case 'n': szName = pValue; break;
+    case 'p': szProgram = pValue; break;
+    }
+  }
+  
+  pCommand[10] = strlen(szName);
+  memcpy(pOut, szName, pCommand[10]);
+  pOut += pCommand[10];
+  
+  for (const char* p = szProgram; *p; ) {
+    if (*p == '(') {
+      char* pEnd;
+      *pOut++ = BINARY_OP_LOOP;
+      PutUint16(pOut, strtol(p + 1, &pEnd, 10));
+      p = pEnd;
+    } else if (*p == ')') {
+      *pOut++ = BINARY_OP_END_LOOP;
+      p++;
+    } else if (*p == '[') {
+      //duration|temp|name[|temp delta|temp limit|duration delta]
+      char fields[6][STEP_NAME_LENGTH * 2] = { "", "", "", "", "", "" };
+      int field = 0, len = 0;
+      for (p++; *p && *p != ']'; p++) {
+        if (*p == '|') {
+          field++;
+          len = 0;
+        } else if (field < 6 && len < (int)sizeof(fields[0]) - 1) {
+          fields[field][len++] = *p;
+          fields[field][len] = '\0';
+        }
+      }
+      if (*p == ']')
+        p++;
+      *pOut++ = BINARY_OP_STEP;
+      PutUint16(pOut, atoi(fields[0]));
+      PutUint16(pOut, CentiTemp(fields[1]));
+      *pOut++ = strlen(fields[2]);
+      memcpy(pOut, fields[2], strlen(fields[2]));
+      pOut += strlen(fields[2]);
+      if (field >= 3) {
+        *pOut++ = BINARY_OP_INCREMENT;
+        PutUint16(pOut, CentiTemp(fields[3]));
+        PutUint16(pOut, fields[4][0] ? CentiTemp(fields[4]) : NO_CENTI_TEMP_LIMIT);
+        PutUint16(pOut, atoi(fields[5]));
+      }
+    } else {
+      p++;
+    }
+  }
+  
+  int length = pOut - pCommand;
+  pCommand[2] = length & 0xff;
+  pCommand[3] = (length >> 8) & 0xff;
+  return length;
+}
+
+static void SendCommand(const char* szCommand, bool binary, bool quiet) {
+  if (!binary && !strstr(szCommand, "c=store")) {
+    SendCommand(szCommand);
+    return;
+  }
+  
+  uint8_t command[MAX_COMMAND_SIZE * 2];
+  int length = EncodeBinaryCommand(szCommand, command);
+  if (!quiet)
+    printf("# binary command %d bytes, ASCII %d\n", length, (int)strlen(szCommand));
+  Transmit(SEND_CMD, command, length);
+}
+
+// room (u16), then id, length (u16), name length and name for each
+static void PrintLibrary(const uint8_t* pPayload, int length) {
+  printf("# library room %d:", length >= 2 ? pPayload[0] | (pPayload[1] << 8) : 0);
+  for (int i = 2; i + 4 <= length && i + 4 + pPayload[i + 3] <= length; i += 4 + pPayload[i + 3])
+    printf(" %d=%.*s (%d bytes)", pPayload[i], pPayload[i + 3], (const char*)pPayload + i + 4,
+      pPayload[i + 1] | (pPayload[i + 2] << 8));
+  printf("\n");
+}
+
+static const char* STATE_NAMES[] = { "stopped", "startup", "stopped", "lidwait", "running", "complete", "error", "tuning" };
+static const char* THERMAL_NAMES[] = { "holding", "heating", "cooling", "idle" };
+
+// the binary status frame as the same key=value string SendStatus() sends
+static void DecodeBinaryStatus(const uint8_t* pFrame, int length, char* szStatus) {
+  szStatus[0] = '\0';
+  if (length < 11 || pFrame[0] != STATUS_FRAME_VERSION || pFrame[4] >= sizeof(STATE_NAMES) / sizeof(STATE_NAMES[0])
+      || pFrame[5] >= sizeof(THERMAL_NAMES) / sizeof(THERMAL_NAMES[0]))
+    return;
+  
+  uint8_t sections = pFrame[1];
+  char* pOut = szStatus + sprintf(szStatus, "d=%d&s=%s&l=%d&b=%.1f&t=%s&o=%d", pFrame[2] | (pFrame[3] << 8),
+    STATE_NAMES[pFrame[4]], (int16_t)(pFrame[6] | (pFrame[7] << 8)) / 100,
+    (int16_t)(pFrame[8] | (pFrame[9] << 8)) / 100.0, THERMAL_NAMES[pFrame[5]], pFrame[10]);
+  int end = length; //the fixed sections from the end
+  if ((sections & STATUS_SECTION_SENSOR) && end >= 13) {
+    pOut += sprintf(pOut, "&z=%.3f", (pFrame[end - 2] | (pFrame[end - 1] << 8)) / 1000.0);
+    end -= 2;
+  }
+  if ((sections & STATUS_SECTION_MEMORY) && end >= 15)
+    pOut += sprintf(pOut, "&m=%d", pFrame[end - 2] | (pFrame[end - 1] << 8));
+  const uint8_t* pIn = pFrame + 11;
+  if ((sections & STATUS_SECTION_RUN) && pIn + 12 <= pFrame + length) {
+    pOut += sprintf(pOut, "&e=%u&r=%u&u=%d&c=%d", pIn[0] | (pIn[1] << 8) | (pIn[2] << 16) | ((uint32_t)pIn[3] << 24),
+      pIn[4] | (pIn[5] << 8) | (pIn[6] << 16) | ((uint32_t)pIn[7] << 24), pIn[8] | (pIn[9] << 8), pIn[10] | (pIn[11] << 8));
+    pIn += 12;
+  }
+  if ((sections & STATUS_SECTION_NAMES) && pIn < pFrame + length && pIn + 1 + pIn[0] < pFrame + length) {
+    const uint8_t* pStep = pIn + 1 + pIn[0];
+    pOut += sprintf(pOut, "&n=%.*s", pIn[0], (const char*)pIn + 1);
+    if (pStep[0] > 0 && pStep + 1 + pStep[0] <= pFrame + length)
+      sprintf(pOut, "&p=%.*s", pStep[0], (const char*)pStep + 1);
+  }
+}
+
+// the host copy of the telemetry fields, see TELEMETRY_KEY
+static const int TELEMETRY_WIDTHS[TELEMETRY_FIELDS] = { 2, 2, 2, 1, 1, 2 };
+static int sTelemetry[TELEMETRY_FIELDS];
+static bool sTelemetryKeyed = false; //false until a key sample, and after a lost one
+static int sTelemetryNext = -1; //sample number
+static unsigned long sTelemetrySamples = 0;
+static unsigned long sTelemetryKeys = 0;
+static unsigned long sTelemetryLost = 0;
+static unsigned long sTelemetryBytes = 0;
+
+// applies a telemetry frame to sTelemetry, false if it can't be
+static bool DecodeTelemetry(const uint8_t* pFrame, int length) {
+  if (length < 2)
+    return false;
+  if (sTelemetryNext >= 0 && pFrame[0] != sTelemetryNext) {
+    sTelemetryLost += (uint8_t)(pFrame[0] - sTelemetryNext);
+    sTelemetryKeyed = false;
+  }
+  sTelemetryNext = (pFrame[0] + 1) & 0xff;
+  
+  uint8_t flags = pFrame[1];
+  bool key = flags & TELEMETRY_KEY;
+  if (!key && !sTelemetryKeyed)
+    return false;
+  int fields[TELEMETRY_FIELDS];
+  memcpy(fields, sTelemetry, sizeof(fields));
+  const uint8_t* pIn = pFrame + 2;
+  const uint8_t* pEnd = pFrame + length;
+  for (int i = 0; i < TELEMETRY_FIELDS; i++) {
+    if (!(flags & (1 << i)))
+      continue;
+    if (pIn >= pEnd)
+      return false;
+    if (!key && (int8_t)*pIn != TELEMETRY_ESCAPE) {
+      fields[i] += (int8_t)*pIn++;
+      continue;
+    }
+    if (!key)
+      pIn++;
+    if (pIn + TELEMETRY_WIDTHS[i] > pEnd)
+      return false;
+    fields[i] = TELEMETRY_WIDTHS[i] == 2 ? pIn[0] | (pIn[1] << 8) : pIn[0];
+    if (i < 3)
+      fields[i] = (int16_t)fields[i];
+    pIn += TELEMETRY_WIDTHS[i];
+  }
+  
+  if (key)
+    sTelemetryKeys++;
+  memcpy(sTelemetry, fields, sizeof(fields));
+  sTelemetryKeyed = true;
+  sTelemetrySamples++;
+  return true;
+}
+
+// one chunk of the run history, returns the entry to read from next, or -1
+// once all have been
+static int PrintHistory(const uint8_t* pPayload, int length) {
+  if (length < 7)
+    return -1;
+  int intervalS = pPayload[0] | (pPayload[1] << 8);
+  int numSamples = pPayload[4];
+  int numEntries = numSamples + pPayload[5];
+  int offset = pPayload[6];
+  if (offset == 0) {
+    printf("# history %d samples every %ds, %d marks, %s\n", numSamples, intervalS, pPayload[5],
+      pPayload[2] ? "recording" : pPayload[3] < sizeof(STATE_NAMES) / sizeof(STATE_NAMES[0]) ?
+      STATE_NAMES[pPayload[3]] : "?");
+  }
+  
+  for (int i = 7; i + HISTORY_ENTRY_SIZE <= length; i += HISTORY_ENTRY_SIZE, offset++) {
+    const uint8_t* pEntry = pPayload + i;
+    int word = pEntry[0] | (pEntry[1] << 8);
+    if (offset < numSamples) {
+      printf("# history %ds plate %.2f lid %.1f peltier %d\n", offset * intervalS, word / 100.0, pEntry[2] / 2.0,
+        (int8_t)pEntry[3] * 8);
+    } else {
+      printf("# history %ds step %d cycle %d\n", word, pEntry[2], pEntry[3]);
+    }
+  }
+  return offset < numEntries ? offset : -1;
+}
+
+static const char* PROFILE_PHASE_NAMES[] = { "CheckPower", "ReadPlateTemp", "ReadLidTemp", "ControlPeltier",
+  "ControlLid", "UpdateEta", "Display::Update", "SerialControl::Process", "tick jitter", "loop period" };
+
+static void PrintProfile(const uint8_t* pPayload, int length) {
+  if (length < 3 || pPayload[0] == 0) {
+    printf("# no loop profile, built without LOOP_PROFILER\n");
+    return;
+  }
+  int numBuckets = pPayload[1];
+  int tickUs = pPayload[2];
+  printf("# profile (us)\t\tcount\tmin\tavg\tmax\t<64us\t<256us\t<1ms\t<4ms\t<16ms\t<64ms\tmore\n");
+  const uint8_t* pIn = pPayload + 3;
+  for (int phase = 0; phase < pPayload[0] && pIn + 8 + 2 * numBuckets <= pPayload + length; phase++) {
+    printf("# %-22s", phase < PROFILE_PHASES ? PROFILE_PHASE_NAMES[phase] : "?");
+    for (int i = 0; i < 4; i++)
+      printf("\t%d", (pIn[2 * i] | (pIn[2 * i + 1] << 8)) * (i == 0 ? 1 : tickUs));
+    for (int i = 0; i < numBuckets; i++)
+      printf("\t%d", pIn[8 + 2 * i] | (pIn[9 + 2 * i] << 8));
+    printf("\n");
+    pIn += 8 + 2 * numBuckets;
+  }
+}
+
+// pulls the next complete frame the firmware sent, if any, and returns its
+// payload length, or -1 for none. The type is 0 for a sequenced one with a
+// bad CRC, which has it taken off otherwise.
+static int ReceiveFrame(uint8_t& type, char* pPayload, int maxLen) {
+  std::deque<uint8_t>& rx = gBoard.HostReceived();
+  while (!rx.empty() && rx.front() != START_CODE)
+    rx.pop_front();
+  if (rx.size() < sizeof(PCPPacket))
+    return -1;
+
+  unsigned int length = rx[1] | (rx[2] << 8);
+  if (length < sizeof(PCPPacket)) {
+    rx.pop_front();
+    return -1;
+  }
+  if (rx.size() < length)
+    return -1;
+
+  type = rx[3];
+  int payloadLen = length - sizeof(PCPPacket);
+  for (int i = 0; i < payloadLen && i < maxLen - 1; i++)
+    pPayload[i] = rx[sizeof(PCPPacket) + i];
+  pPayload[payloadLen < maxLen - 1 ? payloadLen : maxLen - 1] = '\0';
+  rx.erase(rx.begin(), rx.begin() + length);
+  if (payloadLen > maxLen - 1)
+    payloadLen = maxLen - 1;
+  
+  if (type & 0x0f) {
+    uint16_t crc = crc16Update(0xFFFF, type);
+    payloadLen -= 2;
+    for (int i = 0; i < payloadLen; i++)
+      crc = crc16Update(crc, pPayload[i]);
+    if (payloadLen < 0 || crc != ((uint8_t)pPayload[payloadLen] | ((uint8_t)pPayload[payloadLen + 1] << 8)))
+      type = 0;
+    pPayload[payloadLen > 0 ? payloadLen : 0] = '\0';
+  }
+  return payloadLen > 0 ? payloadLen : 0;
+}
+
+static double WallTime() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void LoadEeprom(const char* szFile) {
+  FILE* f = fopen(szFile, "rb");
+  if (f) {
+    fread(gBoard.EepromData(), 1, SimBoard::EEPROM_SIZE, f);
+    fclose(f);
+  }
+}
+
+static void SaveEeprom(const char* szFile) {
+  FILE* f = fopen(szFile, "wb");
+  if (f) {
+    fwrite(gBoard.EepromData(), 1, SimBoard::EEPROM_SIZE, f);
+    fclose(f);
+  }
+}
+
+static void Usage() {
+  fprintf(stderr, "usage: openpcr_sim [-t seconds] [-i seconds] [-e eeprom.bin] [-a ambient] [-n] [-l] [-b] [-L] [-s] [-S] [-x n] [-T ms] [-H s] [-P] [-q] [command...]\n");
+}
+
+int main(int argc, char* argv[]) {
+  double limitS = 14400;
+  double intervalS = 1;
+  const char* szEepromFile = NULL;
+  bool showLcd = false;
+  bool quiet = false;
+  bool binary = false;
+  bool listLibrary = false;
+  bool binaryStatus = false;
+  int telemetryMs = -1;
+  int historyS = 0;
+  bool historyRead = false;
+  bool historyReading = false;
+  bool profile = false;
+  bool profileRead = false;
+  bool profileReading = false;
+  const char* commands[MAX_COMMANDS] = { DEFAULT_COMMAND };
+  int numCommands = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:i:e:a:nlbLsSx:T:H:Pqh")) != -1) {
+    switch (opt) {
+    case 't': limitS = atof(optarg); break;
+    case 'i': intervalS = atof(optarg); break;
+    case 'e': szEepromFile = optarg; break;
+    case 'a': gBoard.SetAmbient(atof(optarg)); break;
+    case 'n': gBoard.SetSensorNoise(false); break;
+    case 'l': showLcd = true; break;
+    case 'b': binary = true; break;
+    case 'L': listLibrary = true; break;
+    case 's': binaryStatus = true; break;
+    case 'S': sSequenced = true; break;
+    case 'x': sCorruptEvery = atoi(optarg); break;
+    case 'T': telemetryMs = atoi(optarg); break;
+    case 'H': historyS = atoi(optarg); break;
+    case 'P': profile = true; break;
+    case 'q': quiet = true; break;
+    default: Usage(); return 2;
+    }
+  }
+  if (optind < argc) {
+    for (numCommands = 0; optind < argc && numCommands < MAX_COMMANDS; optind++)
+      commands[numCommands++] = argv[optind];
+  }
+  if (szEepromFile)
+    LoadEeprom(szEepromFile);
+
+  uint64_t limitUs = (uint64_t)(limitS * 1000000);
+  uint64_t intervalUs = (uint64_t)(intervalS * 1000000);
+  uint64_t nextPollUs = COMMAND_TIME_US;
+  int commandsSent = numCommands == 1 && commands[0][0] == '\0' ? 1 : 0;
+  bool librarySent = !listLibrary;
+  bool startSent = false;
+  for (int i = 0; i < numCommands; i++)
+    startSent |= strstr(commands[i], "c=start") != NULL;
+  bool complete = false;
+  bool busy = false;
+  unsigned long loops = 0;
+  double wallStart = WallTime();
+
+  if (!quiet)
+    printf("#time_s\tplate_c\tlid_c\tpeltier\tlid\tstatus\n");
+
+  setup();
+  while ((!complete || historyReading || profileReading) && gBoard.Micros() < limitUs) {
+    loop();
+    gBoard.Advance(LOOP_OVERHEAD_US);
+    loops++;
+
+    uint64_t spacingUs = sSequenced ? 0 : COMMAND_SPACING_US;
+    if (historyS > 0 && commandsSent == 0 && gBoard.Micros() >= COMMAND_TIME_US) {
+      uint8_t request[2] = { 0, (uint8_t)historyS }; //the interval, before the run starts
+      Transmit(HISTORY_REQ, request, sizeof(request));
+    }
+    while (commandsSent < numCommands && gBoard.Micros() >= COMMAND_TIME_US + commandsSent * spacingUs)
+      SendCommand(commands[commandsSent++], binary, quiet);
+    if (telemetryMs >= 0 && gBoard.Micros() >= COMMAND_TIME_US) {
+      uint8_t interval[2] = { (uint8_t)(telemetryMs & 0xff), (uint8_t)(telemetryMs >> 8) };
+      Transmit(TELEMETRY_REQ, interval, sizeof(interval));
+      telemetryMs = -1;
+    }
+    if (!librarySent && gBoard.Micros() >= COMMAND_TIME_US + numCommands * spacingUs) {
+      Transmit(LIBRARY_REQ, NULL, 0);
+      librarySent = true;
+    }
+    if (intervalUs && gBoard.Micros() >= nextPollUs) {
+      if (sPending.empty()) //not piling up behind anything unanswered
+        Transmit(binaryStatus ? STATUS_BIN_REQ : STATUS_REQ, NULL, 0);
+      nextPollUs += intervalUs;
+    }
+    if (sNumInFlight > 0 && gBoard.Micros() >= sResendUs)
+      Resend(sFirstSeq);
+
+    uint8_t type;
+    char payload[MAX_COMMAND_SIZE + 1];
+    int payloadLen;
+    while ((payloadLen = ReceiveFrame(type, payload, sizeof(payload))) >= 0) {
+      if (sSequenced && (type & 0x0f)) {
+        if ((type & 0xf0) == NAK)
+          Resend(type & 0x0f);
+        else
+          Acknowledge(type & 0x0f);
+        if (!quiet && ((type & 0xf0) == ACK || (type & 0xf0) == NAK))
+          printf("# %s %d at %.3fs\n", (type & 0xf0) == ACK ? "ack" : "nak", type & 0x0f, gBoard.Micros() / 1000000.0);
+      }
+      if (type == NAK) { //taken without an answer: the history without RUN_HISTORY, or a store with no room
+        if (sSequenced && sNumInFlight > 0)
+          Acknowledge(sFirstSeq);
+        if (!quiet && historyReading)
+          printf("# no run history\n");
+        else if (!quiet)
+          printf("# nak 0 at %.3fs\n", gBoard.Micros() / 1000000.0);
+        historyReading = false;
+        continue;
+      }
+      if ((type & 0xf0) == TELEMETRY) {
+        sTelemetryBytes += sizeof(PCPPacket) + payloadLen;
+        if (DecodeTelemetry((const uint8_t*)payload, payloadLen) && !quiet)
+          printf("# telemetry %d at %.3fs: plate %.2f lid %.2f peltier %d lid %d step %d cycle %d\n",
+            (uint8_t)payload[0], gBoard.Micros() / 1000000.0, sTelemetry[0] / 100.0, sTelemetry[1] / 100.0,
+            sTelemetry[2], sTelemetry[3], sTelemetry[4], sTelemetry[5]);
+        continue;
+      }
+      if ((type & 0xf0) == HISTORY_RESP) {
+        int next = historyReading ? PrintHistory((const uint8_t*)payload, payloadLen) : -1;
+        if (next >= 0) {
+          uint8_t request[1] = { (uint8_t)next };
+          Transmit(HISTORY_REQ, request, sizeof(request));
+        }
+        historyReading = next >= 0;
+        continue;
+      }
+      if ((type & 0xf0) == PROFILE_RESP) {
+        if (profileReading)
+          PrintProfile((const uint8_t*)payload, payloadLen);
+        profileReading = false;
+        continue;
+      }
+      if ((type & 0xf0) == LIBRARY_RESP) {
+        PrintLibrary((const uint8_t*)payload, payloadLen);
+        if (!startSent)
+          complete = true;
+        continue;
+      }
+      if ((type & 0xf0) == STATUS_BIN_RESP) {
+        char status[MAX_COMMAND_SIZE];
+        DecodeBinaryStatus((const uint8_t*)payload, payloadLen, status);
+        strcpy(payload, status);
+      } else if ((type & 0xf0) != STATUS_RESP) {
+        continue;
+      }
+
+      //trim the space padding
+      for (int i = strlen(payload) - 1; i >= 0 && payload[i] == ' '; i--)
+        payload[i] = '\0';
+      if (strstr(payload, "s=complete") || (busy && strstr(payload, "s=stopped")))
+        complete = true;
+      if (strstr(payload, "s=running") || strstr(payload, "s=lidwait") || strstr(payload, "s=tuning"))
+        busy = true;
+
+      if (!quiet) {
+        printf("%.1f\t%.2f\t%.2f\t%d\t%d\t%s\n", gBoard.Micros() / 1000000.0, gBoard.GetPlateTemp(),
+          gBoard.GetLidTemp(), gBoard.GetPeltierDrive(), gBoard.GetLidDrive(), payload);
+        LiquidCrystal* pLcd = LiquidCrystal::GetInstance();
+        if (showLcd && pLcd) {
+          for (int row = 0; row < LiquidCrystal::MAX_ROWS; row++)
+            printf("#  |%s|\n", pLcd->GetRow(row));
+        }
+      }
+    }
+
+    if (complete && historyS > 0 && !historyRead) {
+      uint8_t request[1] = { 0 };
+      Transmit(HISTORY_REQ, request, sizeof(request));
+      historyRead = true;
+      historyReading = true;
+    }
+    if (complete && profile && !profileRead) {
+      Transmit(PROFILE_REQ, NULL, 0);
+      profileRead = true;
+      profileReading = true;
+    }
+  }
+
+  if (sSequenced && !quiet)
+    printf("# %lu packets resent\n", sPacketsResent);
+  if (sTelemetrySamples && !quiet)
+    printf("# %lu telemetry samples (%lu key, %lu lost) in %lu bytes\n", sTelemetrySamples,
+      sTelemetryKeys, sTelemetryLost, sTelemetryBytes);
+  fflush(stdout);
+  double wallS = WallTime() - wallStart;
+  double simS = gBoard.Micros() / 1000000.0;
+  fprintf(stderr, "%s after %.0fs simulated (%lu loops, %.1fms per loop) in %.2fs wall, %.0fx real time\n",
+    complete ? "complete" : "timed out", simS, loops, loops ? simS * 1000 / loops : 0.0, wallS,
+    wallS > 0 ? simS / wallS : 0.0);
+
+  if (szEepromFile)
+    SaveEeprom(szEepromFile);
+  return complete ? 0 : 1;
+}
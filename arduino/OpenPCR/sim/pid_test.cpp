@@ -0,0 +1,172 @@
+/*
+ *  pid_test.cpp - OpenPCR host simulator.
+ *  Copyright (C) 2010-2011 Josh Perfetto. All Rights Reserved.
+ *
+ *  OpenPCR control software is free software: you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenPCR control software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  the OpenPCR control software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs FixedPID and PID_v1 side by side on the same input and setpoint
+// trace and checks that their outputs, as the PWM the firmware drives,
+// never differ by more than one step. Exits 1 if they do.
+//
+// usage: pid_test [-v]
+//
+//   -v  print each case's worst and mean difference
+//
+// The trace is a plate cycling between 95, 55 and 72 C, lagging its
+// setpoint with noise on top, and is used as it is, not driven by either
+// output, so any difference can't feed back. Inputs are given at the fixed
+// point's 1/256 C, as the firmware converts them, so what is compared is the
+// controllers and not the resolution of their input. Each case uses the
+// firmware's limits and sample time, and does what the firmware does while
+// running: gains rescheduled with the setpoint, the plate's output limits
+// moved by the feedforward, and the integral reset on ramps.
+
+#include "WProgram.h"
+#include "PID_v1.h"
+#include "fixed_pid.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLE_MS     100 //CONTROL_PERIOD_MS
+#define TRACE_SAMPLES 36000 //an hour
+#define STEP_SAMPLES  300 //per setpoint
+#define LAG_SAMPLES   40.0 //time constant of the input
+#define NOISE_C       0.3
+
+typedef FixedPID<int32_t, int32_t, 8> ControlPID;
+
+static unsigned long sMillis = 0;
+
+unsigned long millis() {
+  return sMillis;
+}
+
+unsigned long micros() {
+  return sMillis * 1000;
+}
+
+struct SCase {
+  const char* name;
+  int outMin;
+  int outMax;
+  boolean feedforward; //limits moved, as the plate's are
+  double gains[3][3]; //kp, ki, kd for each setpoint
+};
+
+static const SCase CASES[] = {
+  { "plate, feedforward gains", -1023, 1023, true,
+    { { 600, 200, 0 }, { 600, 200, 0 }, { 600, 200, 0 } } },
+  { "plate, table gains", -1023, 1023, false,
+    { { 1000, 250, 250 }, { 600, 200, 400 }, { 1000, 250, 250 } } },
+  { "plate, tuned gains", -1023, 1023, true,
+    { { 237.4, 61.85, 0 }, { 318.9, 88.12, 0 }, { 275.3, 70.49, 0 } } },
+  { "lid", 0, 255, false,
+    { { 100, 50, 50 }, { 100, 50, 50 }, { 100, 50, 50 } } },
+  { "lid, tuned gains", 0, 255, false,
+    { { 41.7, 3.93, 110.6 }, { 41.7, 3.93, 110.6 }, { 41.7, 3.93, 110.6 } } }
+};
+
+static const double SETPOINTS[] = { 95, 55, 72 };
+
+// -1 to 1, the same every run
+static double Noise() {
+  return rand() / (double)RAND_MAX * 2 - 1;
+}
+
+static double Quantize(double temp) {
+  return ControlPID::ToFixed(temp) / 256.0;
+}
+
+// the largest difference in PWM steps
+static int RunCase(const SCase& testCase, boolean verbose) {
+  double input = 25, setpoint = 0, output = 0;
+  int32_t fixedInput = 0, fixedSetpoint = 0, fixedOutput = 0;
+  sMillis = 0;
+  srand(1);
+
+  PID pid(&input, &output, &setpoint, 0, 0, 0, DIRECT);
+  ControlPID fixedPid(&fixedInput, &fixedOutput, &fixedSetpoint, 0, 0, 0, DIRECT);
+  pid.SetSampleTime(SAMPLE_MS);
+  fixedPid.SetSampleTime(SAMPLE_MS);
+  pid.SetOutputLimits(testCase.outMin, testCase.outMax);
+  fixedPid.SetOutputLimits(ControlPID::ToFixed(testCase.outMin), ControlPID::ToFixed(testCase.outMax));
+
+  double lagged = input;
+  int worst = 0;
+  double sum = 0;
+  for (int i = 0; i < TRACE_SAMPLES; i++) {
+    sMillis += SAMPLE_MS;
+    int step = (i / STEP_SAMPLES) % 3;
+    boolean newStep = i % STEP_SAMPLES == 0;
+    if (newStep)
+      setpoint = SETPOINTS[step];
+    lagged += (setpoint - lagged) / LAG_SAMPLES;
+    input = Quantize(lagged + NOISE_C * Noise());
+    fixedInput = ControlPID::ToFixed(input);
+    fixedSetpoint = ControlPID::ToFixed(setpoint);
+    boolean ramping = fabs(setpoint - lagged) > 1;
+
+    if (newStep) {
+      const double* gains = testCase.gains[step];
+      pid.SetTunings(gains[0], gains[1], gains[2]);
+      fixedPid.SetTunings(gains[0], gains[1], gains[2]);
+      pid.SetMode(AUTOMATIC);
+      fixedPid.SetMode(AUTOMATIC);
+    }
+    if (testCase.feedforward) {
+      double feedforward = ramping ? (setpoint > lagged ? 0.6 : -0.6) * testCase.outMax : 0.1 * testCase.outMax;
+      feedforward = ControlPID::ToFixed(feedforward) / 256.0;
+      pid.SetOutputLimits(testCase.outMin - feedforward, testCase.outMax - feedforward);
+      fixedPid.SetOutputLimits(ControlPID::ToFixed(testCase.outMin - feedforward),
+                               ControlPID::ToFixed(testCase.outMax - feedforward));
+      if (ramping) {
+        pid.ResetI();
+        fixedPid.ResetI();
+      }
+    }
+
+    pid.Compute();
+    fixedPid.Compute();
+
+    int difference = abs((int)output - ControlPID::ToInt(fixedOutput));
+    if (difference > worst)
+      worst = difference;
+    sum += fabs(output - fixedOutput / 256.0);
+  }
+
+  if (verbose)
+    printf("%-26s worst %d, mean %.3f of %d to %d\n", testCase.name, worst, sum / TRACE_SAMPLES,
+      testCase.outMin, testCase.outMax);
+  return worst;
+}
+
+int main(int argc, char* argv[]) {
+  boolean verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+  int failed = 0;
+  for (unsigned int i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+    int worst = RunCase(CASES[i], verbose);
+    if (worst > 1) {
+      printf("FAIL %s: outputs differ by %d steps\n", CASES[i].name, worst);
+      failed++;
+    }
+  }
+  printf("%s: %d of %d cases within one PWM step\n", failed ? "FAIL" : "ok",
+    (int)(sizeof(CASES) / sizeof(CASES[0])) - failed, (int)(sizeof(CASES) / sizeof(CASES[0])));
+  return failed ? 1 : 0;
+}
@@ -20,9 +20,11 @@
 #include "thermocycler.h"
 
 #include "display.h"
+#include "hardware.h"
 #include "program.h"
 #include "serialcontrol.h"
-#include "../Wire/Wire.h"
+#include "history.h"
+#include "profiler.h"
 #include <avr/pgmspace.h>
 
 //constants
@@ -44,28 +46,95 @@ PROGMEM const unsigned long PLATE_RESISTANCE_TABLE[] = {
   9155, 8878, 8612, 8354, 8106, 7866, 7635, 7412, 7196, 6987, 6786,
   6591, 6403, 6222, 6046, 5876 };
 
-// in Ohms
-PROGMEM const unsigned int LID_RESISTANCE_TABLE[] = {  
-  32919, 31270, 29715, 28246, 26858, 25547, 24307, 23135, 22026, 20977,
-  19987, 19044, 18154, 17310, 16510, 15752, 15034, 14352, 13705, 13090,
-  12507, 11953, 11427, 10927, 10452, 10000, 9570, 9161, 8771, 8401,
-  8048, 7712, 7391, 7086, 6795, 6518, 6254, 6001, 5761, 5531, 5311,
-  5102, 4902, 4710, 4528, 4353, 4186, 4026, 3874, 3728, 3588,
-  3454, 3326, 3203, 3085, 2973, 2865, 2761, 2662, 2567, 2476,
-  2388, 2304, 2223, 2146, 2072, 2000, 1932, 1866, 1803, 1742,
-  1684, 1627, 1573, 1521, 1471, 1423, 1377, 1332, 1289, 1248,
-  1208, 1170, 1133, 1097, 1063, 1030, 998, 968, 938, 909,
-  882, 855, 829, 805, 781, 758, 735, 714, 693, 673,
-  653, 635, 616, 599, 582, 565, 550, 534, 519, 505,
-  491, 478, 465, 452, 440, 428, 416, 405, 395, 384,
-  374, 364, 355, 345, 337 };
-  
-// I2C address for MCP3422 - base address for MCP3424
-#define MCP3422_ADDRESS 0X68
-#define MCP342X_RES_FIELD  0X0C // resolution/rate field
-#define MCP342X_18_BIT     0X0C // 18-bit 3.75 SPS
-#define MCP342X_BUSY       0X80 // read: output not ready
-
+// Lid temperature in 0.01 C for each 10-bit ADC code from LID_ADC_TABLE_START,
+// made by sim/lid_table.py from the thermistor's resistance table through the
+// 2.2k divider. Codes outside the table are clamped to its ends.
+#define LID_ADC_TABLE_START 137
+PROGMEM const unsigned int LID_ADC_TABLE[] = {
+  12475, 12438, 12400, 12370, 12340, 12320, 12289, 12256, 12222, 12190,
+  12160, 12130, 12100, 12070, 12040, 12010, 11982, 11964, 11936, 11909,
+  11870, 11840, 11810, 11782, 11755, 11727, 11709, 11675, 11650, 11625,
+  11600, 11575, 11550, 11525, 11500, 11475, 11450, 11425, 11392, 11369,
+  11346, 11323, 11292, 11277, 11254, 11223, 11200, 11177, 11154, 11123,
+  11100, 11079, 11057, 11036, 11007, 10986, 10964, 10936, 10914, 10893,
+  10873, 10853, 10827, 10807, 10788, 10762, 10744, 10719, 10700, 10680,
+  10660, 10633, 10613, 10588, 10571, 10547, 10529, 10512, 10488, 10471,
+  10447, 10429, 10406, 10388, 10365, 10347, 10329, 10306, 10284, 10268,
+  10247, 10232, 10211, 10189, 10172, 10156, 10133, 10111, 10095, 10075,
+  10055, 10035, 10020, 10005, 9985, 9965, 9945, 9930, 9910, 9890,
+  9871, 9857, 9838, 9819, 9805, 9786, 9767, 9748, 9729, 9710,
+  9696, 9678, 9661, 9643, 9626, 9609, 9591, 9574, 9561, 9543,
+  9526, 9509, 9492, 9475, 9458, 9442, 9425, 9408, 9392, 9375,
+  9358, 9342, 9325, 9308, 9292, 9277, 9262, 9246, 9231, 9212,
+  9196, 9181, 9167, 9148, 9137, 9122, 9104, 9089, 9074, 9056,
+  9041, 9026, 9011, 8997, 8979, 8966, 8948, 8934, 8917, 8903,
+  8890, 8877, 8860, 8847, 8830, 8817, 8800, 8787, 8770, 8757,
+  8743, 8727, 8713, 8697, 8681, 8669, 8653, 8638, 8625, 8612,
+  8597, 8582, 8567, 8555, 8539, 8524, 8512, 8497, 8485, 8471,
+  8456, 8441, 8426, 8412, 8397, 8386, 8372, 8358, 8344, 8331,
+  8317, 8303, 8289, 8278, 8265, 8251, 8238, 8224, 8208, 8195,
+  8182, 8168, 8158, 8145, 8129, 8116, 8103, 8090, 8075, 8062,
+  8053, 8038, 8025, 8012, 7998, 7985, 7971, 7959, 7944, 7934,
+  7920, 7907, 7893, 7881, 7867, 7856, 7842, 7828, 7819, 7805,
+  7793, 7780, 7767, 7756, 7742, 7729, 7718, 7707, 7693, 7680,
+  7667, 7654, 7641, 7628, 7615, 7607, 7594, 7581, 7569, 7556,
+  7544, 7531, 7517, 7508, 7494, 7482, 7470, 7458, 7446, 7434,
+  7420, 7408, 7398, 7387, 7373, 7362, 7350, 7337, 7325, 7312,
+  7302, 7291, 7278, 7267, 7254, 7243, 7230, 7217, 7206, 7195,
+  7184, 7172, 7160, 7149, 7137, 7125, 7112, 7104, 7091, 7079,
+  7067, 7055, 7043, 7031, 7019, 7007, 6997, 6985, 6974, 6962,
+  6951, 6939, 6928, 6915, 6905, 6894, 6883, 6871, 6859, 6848,
+  6835, 6824, 6811, 6802, 6791, 6779, 6768, 6756, 6745, 6733,
+  6721, 6712, 6700, 6688, 6678, 6666, 6654, 6643, 6631, 6619,
+  6610, 6599, 6588, 6576, 6565, 6553, 6542, 6531, 6522, 6510,
+  6499, 6488, 6476, 6465, 6454, 6442, 6431, 6422, 6409, 6399,
+  6387, 6375, 6365, 6353, 6342, 6330, 6321, 6310, 6299, 6288,
+  6277, 6265, 6254, 6243, 6233, 6222, 6211, 6200, 6189, 6177,
+  6167, 6156, 6144, 6136, 6124, 6113, 6101, 6091, 6080, 6068,
+  6058, 6049, 6038, 6026, 6016, 6005, 5993, 5982, 5971, 5960,
+  5951, 5940, 5929, 5918, 5907, 5895, 5884, 5873, 5864, 5854,
+  5842, 5831, 5820, 5808, 5797, 5787, 5776, 5767, 5756, 5744,
+  5733, 5722, 5711, 5700, 5689, 5681, 5669, 5659, 5648, 5637,
+  5626, 5614, 5603, 5593, 5583, 5573, 5562, 5551, 5540, 5529,
+  5518, 5506, 5497, 5487, 5476, 5464, 5454, 5442, 5431, 5420,
+  5409, 5400, 5389, 5378, 5367, 5356, 5345, 5334, 5323, 5314,
+  5303, 5292, 5281, 5270, 5259, 5248, 5237, 5226, 5217, 5206,
+  5195, 5184, 5173, 5162, 5151, 5140, 5130, 5120, 5109, 5097,
+  5086, 5075, 5064, 5053, 5042, 5033, 5022, 5010, 4999, 4989,
+  4977, 4966, 4955, 4944, 4935, 4924, 4913, 4901, 4890, 4879,
+  4868, 4857, 4848, 4837, 4825, 4814, 4803, 4791, 4780, 4769,
+  4758, 4749, 4738, 4726, 4714, 4703, 4692, 4681, 4670, 4661,
+  4649, 4638, 4627, 4615, 4604, 4592, 4581, 4570, 4561, 4550,
+  4538, 4527, 4515, 4504, 4492, 4481, 4472, 4461, 4449, 4438,
+  4426, 4414, 4403, 4391, 4380, 4371, 4359, 4348, 4336, 4324,
+  4313, 4301, 4289, 4280, 4269, 4257, 4245, 4234, 4222, 4210,
+  4198, 4187, 4178, 4166, 4154, 4142, 4130, 4118, 4106, 4095,
+  4085, 4074, 4062, 4050, 4038, 4026, 4014, 4001, 3990, 3980,
+  3969, 3956, 3945, 3932, 3920, 3908, 3896, 3887, 3874, 3862,
+  3850, 3838, 3826, 3813, 3801, 3789, 3779, 3767, 3755, 3742,
+  3730, 3717, 3705, 3692, 3683, 3670, 3658, 3645, 3633, 3620,
+  3608, 3595, 3583, 3572, 3560, 3547, 3534, 3522, 3509, 3496,
+  3483, 3470, 3460, 3448, 3435, 3422, 3408, 3395, 3382, 3370,
+  3359, 3346, 3333, 3320, 3307, 3293, 3281, 3268, 3254, 3244,
+  3230, 3217, 3203, 3190, 3177, 3164, 3150, 3139, 3126, 3112,
+  3098, 3085, 3071, 3058, 3044, 3030, 3019, 3005, 2991, 2977,
+  2963, 2950, 2935, 2921, 2910, 2896, 2882, 2868, 2854, 2839,
+  2825, 2810, 2795, 2784, 2770, 2756, 2741, 2726, 2712, 2697,
+  2682, 2670, 2656, 2641, 2626, 2611, 2596, 2581, 2566, 2551,
+  2538, 2523, 2507, 2492, 2477, 2462, 2446, 2431, 2418, 2402,
+  2387, 2371, 2355, 2339, 2323, 2307, 2291, 2278, 2262, 2246,
+  2229, 2213, 2196, 2180, 2163, 2150, 2133, 2117, 2099, 2083,
+  2066, 2049, 2032, 2014, 2000, 1983, 1966, 1949, 1931, 1913,
+  1895, 1878, 1864, 1846, 1827, 1809, 1791, 1773, 1754, 1736,
+  1717, 1702, 1683, 1665, 1646, 1626, 1607, 1588, 1569, 1549,
+  1533, 1513, 1493, 1474, 1454, 1434, 1413, 1392, 1376, 1356,
+  1335, 1314, 1293, 1272, 1251, 1229, 1207, 1190, 1168, 1146,
+  1124, 1101, 1079, 1057, 1034, 1015, 992, 969, 945, 922,
+  897, 874, 850, 825, 805, 780, 756, 730, 704, 679,
+  653, 627, 606, 579, 553, 525, 498, 471, 443, 414,
+  386, 363, 334, 304, 275, 245, 215, 184, 153, 128,
+  96, 65, 32, 0 };
+  
 #define DATAOUT 11//MOSI
 #define DATAIN  12//MISO 
 #define SPICLOCK  13//sck
@@ -74,34 +143,45 @@ PROGMEM const unsigned int LID_RESISTANCE_TABLE[] = {
 #define CYCLE_START_TOLERANCE 0.2
 #define LID_START_TOLERANCE 1.0
 
-#define PLATE_PID_INC_P 1000
-#define PLATE_PID_INC_I 250
-#define PLATE_PID_INC_D 250
-
-#define PLATE_PID_INC_LOW_THRESHOLD 40
-#define PLATE_PID_INC_LOW_P 600
-#define PLATE_PID_INC_LOW_I 200
-#define PLATE_PID_INC_LOW_D 400
-
-#define PLATE_PID_DEC_HIGH_THRESHOLD 70
-#define PLATE_PID_DEC_HIGH_P 800
-#define PLATE_PID_DEC_HIGH_I 700
-#define PLATE_PID_DEC_HIGH_D 300
-
-#define PLATE_PID_DEC_P 500
-#define PLATE_PID_DEC_I 400
-#define PLATE_PID_DEC_D 200
+// Plate gains by target temperature for heating and cooling ramps, used when
+// nothing is tuned. Interpolated linearly between rows and held flat past the
+// ends, so nearby targets get nearby gains. Rows are
+//   temp C, heating P, I, D, cooling P, I, D
+PROGMEM const unsigned int PLATE_GAIN_TABLE[][7] = {
+  { 30,  600, 200, 400,  2000, 100, 200 },
+  { 45, 1000, 250, 250,   500, 400, 200 },
+  { 65, 1000, 250, 250,   500, 400, 200 },
+  { 75, 1000, 250, 250,   800, 700, 300 } };
+#define PLATE_GAIN_TABLE_ROWS (int)(sizeof(PLATE_GAIN_TABLE) / sizeof(PLATE_GAIN_TABLE[0]))
+#define PLATE_SCHEDULE_STEP 0.5 //setpoint change in C that reschedules gains
 
 #define PLATE_PID_DEC_LOW_THRESHOLD 35
-#define PLATE_PID_DEC_LOW_P 2000
-#define PLATE_PID_DEC_LOW_I 100
-#define PLATE_PID_DEC_LOW_D 200
 
 #define LID_PID_P 100
 #define LID_PID_I 50
 #define LID_PID_D 50
 
 #define PLATE_BANGBANG_THRESHOLD 2.0
+
+// plate model for feedforward: the Peltier face pumps heat into the block
+// through PLATE_MODEL_PELTIER_TAU, the block follows it through
+// PLATE_MODEL_BLOCK_TAU and leaks to ambient through PLATE_MODEL_AMBIENT_TAU.
+// Rates are the Peltier face slope at full drive, in C/s, times in s.
+#define PLATE_MODEL_HEAT_RATE 6.0
+#define PLATE_MODEL_COOL_RATE 5.0
+#define PLATE_MODEL_PELTIER_TAU 1.5
+#define PLATE_MODEL_BLOCK_TAU 2.0
+#define PLATE_MODEL_AMBIENT_TAU 250.0
+#define PLATE_MODEL_AMBIENT 25.0
+
+// fraction of full drive the model ramps with; less leaves PID headroom on
+// the ramp at the cost of speed
+#define PLATE_RAMP_DRIVE 1.0
+
+// PID on the residual; no D, it would brake against the planned slope
+#define PLATE_PID_FF_P 600
+#define PLATE_PID_FF_I 200
+#define PLATE_PID_FF_D 0
 #define LID_BANGBANG_THRESHOLD 2.0
 
 #define MIN_PELTIER_PWM -1023
@@ -112,28 +192,101 @@ PROGMEM const unsigned int LID_RESISTANCE_TABLE[] = {
 
 #define STARTUP_DELAY 5000
 
+// auto-tuning, the plate at each temperature and then the lid, which heats
+// meanwhile: relay amplitude around the holding drive, and hysteresis in C
+PROGMEM const uint8_t PLATE_TUNE_TEMPS[] = { 40, 55, 72, 95 };
+#define NUM_PLATE_TUNE_TEMPS (sizeof(PLATE_TUNE_TEMPS) / sizeof(PLATE_TUNE_TEMPS[0]))
+#define PLATE_TUNE_RELAY 300
+#define PLATE_TUNE_HYSTERESIS 0.1
+#define LID_TUNE_TEMP 110
+#define LID_TUNE_RELAY 60
+#define LID_TUNE_HYSTERESIS 0.5
+const char TUNING_PROG_NAME[] PROGMEM = "Auto-tune";
+
+#define CONTROL_PERIOD_MS 100 //sensing and PID rate, also the PID sample time
+
+#define ETA_DEFAULT_SEC_PER_DEGREE 1.0
+#define ETA_LEARN_GAIN 0.5 //fraction of a ramp's prediction error taken into its rates
+#define ETA_MIN_LEARN_DEGREES 2.0 //shorter ramps are mostly settling
+
+#define LID_ADC_PIN 1
+#define LID_MIN_SAMPLES 64 //4^3 for 3 extra bits
+#define LID_FILTER_ALPHA 0.3 //IIR weight of each new lid sample, ~0.3s time constant
+#define LID_NOISE_ALPHA 0.05 //IIR weight for the lid noise variance, ~2s
+#define HISTORY_NO_STEP 0xFF
+
+// constructed with the thermocycler, which needs the core up first
+static uint8_t sDisplayStorage[sizeof(Display)] __attribute__((aligned));
+static uint8_t sSerialControlStorage[sizeof(SerialControl)] __attribute__((aligned));
+typedef char TunerFitsProgram[sizeof(RelayTuner) <= sizeof(Program) ? 1 : -1];
+
+// into and out of the PID's units, where values enter and leave control
+static inline ControlValue ToControl(double val) {
+#ifdef FIXED_POINT_PID
+  return ControlPID::ToFixed(val);
+#else
+  return val;
+#endif
+}
+
+static inline int ControlToPwm(ControlValue val) {
+#ifdef FIXED_POINT_PID
+  return ControlPID::ToInt(val);
+#else
+  return val;
+#endif
+}
+
 //public
 Thermocycler::Thermocycler(boolean restarted):
-  iRestarted(restarted),
   ipDisplay(NULL),
-  ipProgram(NULL),
-  ipDisplayCycle(NULL),
   ipSerialControl(NULL),
   iProgramState(EOff),
-  ipCurrentStep(NULL),
-  iThermalDirection(OFF),
-  iPeltierPwm(0),
-  iLidPwm(0),
   iPlateTemp(0.0),
+  iPlateAdcConverting(false),
   iLidTemp(0.0),
+  iLidNoiseVariance(0.0),
+  iLidFilterPrimed(false),
+  iTargetLidTemp(0),
+  ipProgram(NULL),
+  ipCurrentStep(NULL),
   iCycleStartTime(0),
   iRamping(true),
-  iPlatePid(&iPlateTemp, &iPeltierPwm, &iTargetPlateTemp, PLATE_PID_INC_P, PLATE_PID_INC_I, PLATE_PID_INC_D, DIRECT),
-  iLidPid(&iLidTemp, &iLidPwm, &iTargetLidTemp, LID_PID_P, LID_PID_I, LID_PID_D, DIRECT),
-  iTargetLidTemp(0) {
+  iRestarted(restarted),
+  iCheckStoredProgram(false),
+  iPlatePid(&iPlateControlTemp, &iPlatePidPwm, &iPlateControlRef, 0, 0, 0, DIRECT), //scheduled by UpdatePlateGains()
+  iLidPid(&iLidControlTemp, &iLidPidPwm, &iLidControlTarget, LID_PID_P, LID_PID_I, LID_PID_D, DIRECT),
+  iThermalDirection(OFF),
+  iPlateRefTemp(0.0),
+  iPlateModelFaceTemp(0.0),
+  iPlateModelDrive(0.0),
+  iPlateRampPhase(ERampHold),
+  iPlateControlTemp(0),
+  iPlateControlRef(0),
+  iPlatePidPwm(0),
+  iScheduledPlateTemp(0.0),
+  iPeltierPwm(0),
+  iLidControlTemp(0),
+  iLidControlTarget(0),
+  iLidPidPwm(0),
+  iLidPwm(0),
+  iEtaFutureS(0),
+  iEtaStepRampS(0),
+  iStoreEtaRates(false),
+  iEtaUnlearned(0),
+#ifdef RUN_HISTORY
+  iHistoryNextMs(0),
+  iHistoryStep(HISTORY_NO_STEP),
+  iHistoryCycle(0),
+#endif
+  ipTuner(NULL),
+  iTunePoint(0),
+  iGainsTuned(false),
+  iStoreTunedGains(false),
+  iReloadGains(false) {
     
-  ipDisplay = new Display();
-  ipSerialControl = new SerialControl(ipDisplay);
+  ipDisplay = new (sDisplayStorage) Display();
+  ipSerialControl = new (sSerialControlStorage) SerialControl(ipDisplay);
   
   //init pins
   pinMode(15, INPUT);
@@ -148,48 +301,56 @@ Thermocycler::Thermocycler(boolean restarted):
   pinMode(SPICLOCK,OUTPUT);
   pinMode(SLAVESELECT,OUTPUT);
   digitalWrite(SLAVESELECT,HIGH); //disable device 
-  
-    // SPCR = 01010000
-  //interrupt disabled,spi enabled,msb 1st,master,clk low when idle,
-  //sample on leading edge of clk,system clock/4 rate (fastest)
-  int clr;
-  SPCR = (1<<SPE)|(1<<MSTR)|(1<<4);
-  clr=SPSR;
-  clr=SPDR;
-  delay(10); 
-
-  iPlatePid.SetOutputLimits(MIN_PELTIER_PWM, MAX_PELTIER_PWM);
-  iLidPid.SetOutputLimits(MIN_LID_PWM, MAX_LID_PWM);
+  Hardware::InitSpi();
+  Hardware::StartAdcSampling(LID_ADC_PIN);
+
+  iPlatePid.SetOutputLimits(ToControl(MIN_PELTIER_PWM), ToControl(MAX_PELTIER_PWM));
+  iPlatePid.SetSampleTime(CONTROL_PERIOD_MS);
+  iLidPid.SetOutputLimits(ToControl(MIN_LID_PWM), ToControl(MAX_LID_PWM));
+  iLidPid.SetSampleTime(CONTROL_PERIOD_MS);
   iLidPid.SetMode(AUTOMATIC);
   
-  // Peltier PWM
-  TCCR1A |= (1<<WGM11) | (1<<WGM10);
-  TCCR1B = _BV(CS21);
-  
-  // Lid PWM
-  TCCR2A = _BV(COM2A1) | _BV(COM2B1) | _BV(WGM21) | _BV(WGM20);
-  TCCR2B = _BV(CS22);
+  // Peltier and lid PWM
+  Hardware::InitPwm();
 
   iszProgName[0] = '\0';
-}
-
-Thermocycler::~Thermocycler() {
-  delete ipSerialControl;
-  delete ipDisplay;
+  
+  iGainsTuned = ProgramStore::RetrieveGains(iGains);
+  
+  //seed the ETA with what earlier runs learned
+  if (!ProgramStore::RetrieveEtaRates(iEtaRates)) {
+    iEtaUnlearned = 3;
+    for (int i = 0; i < ETA_NUM_BANDS; i++) {
+      iEtaRates.secPerDegree[0][i] = ETA_DEFAULT_SEC_PER_DEGREE;
+      iEtaRates.secPerDegree[1][i] = ETA_DEFAULT_SEC_PER_DEGREE;
+    }
+  }
+  
+  // sensing and control run from the timer from here on
+  Hardware::StartControlTimer(CONTROL_PERIOD_MS, ControlTimerHandler);
 }
 
 // accessors
-int Thermocycler::GetNumCycles() {
-  return ipDisplayCycle->GetNumCycles();
-}
-
-int Thermocycler::GetCurrentCycleNum() {
-  int numCycles = GetNumCycles();
-  return ipDisplayCycle->GetCurrentCycle() > numCycles ? numCycles : ipDisplayCycle->GetCurrentCycle();
+void Thermocycler::GetStatus(SStatus& status) {
+  Hardware::LockControl();
+  status.state = iProgramState;
+  status.thermalState = GetThermalState();
+  status.plateTemp = iPlateTemp;
+  status.lidTemp = iLidTemp;
+  status.lidNoise = GetLidTempNoise();
+  status.peltierPwm = iPeltierPwm;
+  status.lidPwm = iLidPwm;
+  status.elapsedS = GetElapsedTimeS();
+  status.remainingS = iEstimatedTimeRemainingS;
+  status.numCycles = ipProgram != NULL ? ipProgram->GetNumCycles() : 0;
+  status.cycleNum = ipProgram != NULL ? ipProgram->GetCurrentCycleNum() : 0;
+  status.stepIndex = ipProgram != NULL ? ipProgram->GetCurrentStepIndex() : 0;
+  status.pStep = ipCurrentStep;
+  Hardware::UnlockControl();
 }
 
 Thermocycler::ThermalState Thermocycler::GetThermalState() {
-  if (iThermalDirection == EOff)
+  if (iThermalDirection == OFF)
     return EIdle;
   
   if (iRamping) {
@@ -203,31 +364,31 @@ Thermocycler::ThermalState Thermocycler::GetThermalState() {
 }
  
 // control
-void Thermocycler::SetProgram(Cycle* pProgram, Cycle* pDisplayCycle, const char* szProgName, int lidTemp) {
+void Thermocycler::SetProgram(Program* pProgram, const char* szProgName, int lidTemp) {
   Stop();
 
   ipProgram = pProgram;
-  ipDisplayCycle = pDisplayCycle;
 
   strcpy(iszProgName, szProgName);
   SetLidTarget(lidTemp);
 }
 
 void Thermocycler::Stop() {
+  if (iProgramState == ERunning)
+    iStoreEtaRates = true; //keep what this run learned
+  if (iProgramState == ETuning)
+    new (&iProgram) Program(); //empty again, the tuner is done with it
   if (iProgramState != EOff)
     iProgramState = EStopped;
   
   ipProgram = NULL;
   ipCurrentStep = NULL;
   
-  iStepPool.ResetPool();
-  iCyclePool.ResetPool();
-  
   ipDisplay->Clear();
 }
 
 PcrStatus Thermocycler::Start() {
-  if (ipProgram == NULL)
+  if (ipProgram == NULL || ipProgram->GetNumSteps() == 0)
     return ENoProgram;
   if (iProgramState == EOff)
     return ENoPower;
@@ -235,50 +396,87 @@ PcrStatus Thermocycler::Start() {
   //advance to lid wait state
   iProgramState = ELidWait;
   
+#ifdef RUN_HISTORY
+  RunHistory::Begin();
+  iHistoryNextMs = millis();
+  iHistoryStep = HISTORY_NO_STEP;
+  iHistoryCycle = 0;
+#endif
+#ifdef LOOP_PROFILER
+  LoopProfiler::Reset();
+#endif
+  
   return ESuccess;
 }
     
 // internal
 void Thermocycler::Loop() {
-  CheckPower();
-  ReadPlateTemp();
-  ReadLidTemp(); 
+  //background work, preempted by ControlTick()
+  PROFILE_MARK(EProfileLoopPeriod, 0);
+  if (iCheckStoredProgram) {
+    iCheckStoredProgram = false;
+    if (!iRestarted && !ipSerialControl->CommandReceived()) {
+      //check for stored program
+      SCommand command;
+      Hardware::LockControl();
+      if (ProgramStore::RetrieveProgram(command, (char*)ipSerialControl->GetBuffer()))
+        ProcessCommand(command);
+      Hardware::UnlockControl();
+    }
+  }
+  
+  if (iStoreTunedGains) {
+    iStoreTunedGains = false;
+    ProgramStore::StoreGains(iGains);
+  }
+  
+  if (iReloadGains) {
+    Hardware::LockControl();
+    iReloadGains = false;
+    iGainsTuned = ProgramStore::RetrieveGains(iGains);
+    Hardware::UnlockControl();
+  }
+  
+  if (iStoreEtaRates) {
+    //copied as they are, the tick only changes them again once the next run
+    //has finished a ramp
+    iStoreEtaRates = false;
+    ProgramStore::StoreEtaRates(iEtaRates);
+  }
+  
+  PROFILE_PHASE(EProfileUpdateEta, UpdateEta());
+#ifdef RUN_HISTORY
+  RecordHistory();
+#endif
+  
+  PROFILE_PHASE(EProfileDisplay, ipDisplay->Update());
+  PROFILE_PHASE(EProfileSerial, ipSerialControl->Process());
+}
+
+void Thermocycler::ControlTick() {
+  PROFILE_MARK(EProfileTickJitter, CONTROL_PERIOD_MS * 1000UL);
+  PROFILE_PHASE(EProfileCheckPower, CheckPower());
+  PROFILE_PHASE(EProfileReadPlateTemp, ReadPlateTemp());
+  PROFILE_PHASE(EProfileReadLidTemp, ReadLidTemp());
   
   switch (iProgramState) {
   case EStartup:
     if (millis() - iProgramStartTimeMs > STARTUP_DELAY) {
       iProgramState = EStopped;
-      
-      if (!iRestarted && !ipSerialControl->CommandReceived()) {
-        //check for stored program
-        SCommand command;
-        if (ProgramStore::RetrieveProgram(command, (char*)ipSerialControl->GetBuffer()))
-          ProcessCommand(command);
-      }
+      iCheckStoredProgram = true;
     }
     break;
 
   case ELidWait:    
     if (iLidTemp >= iTargetLidTemp - LID_START_TOLERANCE) {
-      //advance to running state
-      //calculate program time params
-      ipProgram->BeginIteration();
-    
-      Step* pStep;
-      double lastTemp = iPlateTemp;  
-      iProgramHoldDurationS = 0;
-      iProgramRampDegrees = 0;
-      iElapsedRampDurationMs = 0;
-      iElapsedRampDegrees = 0;
-      iEstimatedTimeRemainingS = 0;
-      iHasCooled = false;
-      
-      while ((pStep = ipProgram->GetNextStep()) && !pStep->IsFinal()) {
-        iProgramHoldDurationS += pStep->GetDuration();
-        if (lastTemp != pStep->GetTemp())
-          iProgramRampDegrees += absf(lastTemp - pStep->GetTemp()) - CYCLE_START_TOLERANCE;
-        lastTemp = pStep->GetTemp();
+      //advance to running state, with the ramps still to come for the eta
+      iEtaFutureS = 0;
+      for (int direction = 0; direction < 2; direction++) {
+        const float* pRampDegrees = ipProgram->GetRampDegrees(direction);
+        for (int i = 0; i < ETA_NUM_BANDS; i++)
+          iEtaFutureS += pRampDegrees[i] * iEtaRates.secPerDegree[direction][i];
       }
+      iEstimatedTimeRemainingS = 0;
       
       iProgramState = ERunning;
       iThermalDirection = OFF;
@@ -287,6 +485,7 @@ void Thermocycler::Loop() {
       ipProgram->BeginIteration();
     
       ipCurrentStep = ipProgram->GetNextStep();
+      iEtaStepRampS = PredictEtaRampS(iPlateTemp, ipCurrentStep->GetTemp()); //not in the program's ramps
       SetPlateTarget(ipCurrentStep->GetTemp());
       iRamping = true;
       
@@ -298,11 +497,7 @@ void Thermocycler::Loop() {
     //update program
     if (iProgramState == ERunning) {
       if (iRamping && abs(ipCurrentStep->GetTemp() - iPlateTemp) <= CYCLE_START_TOLERANCE) {
-        //eta updates
-        iElapsedRampDegrees += absf(iPlateTemp - iRampStartTemp);
-        iElapsedRampDurationMs += millis() - iRampStartTime;
-        if (iRampStartTemp > iPlateTemp)
-          iHasCooled = true;
+        LearnEtaRamp(iRampStartTemp, ipCurrentStep->GetTemp(), (millis() - iRampStartTime) / 1000.0);
         iRamping = false;
         iCycleStartTime = millis();
         
@@ -314,8 +509,12 @@ void Thermocycler::Loop() {
           SetPlateTarget(ipCurrentStep->GetTemp());
 
         //check for program completion
-        if (ipCurrentStep == NULL || ipCurrentStep->GetDuration() == 0)
-          iProgramState = EComplete;        
+        if (ipCurrentStep == NULL || ipCurrentStep->GetDuration() == 0) {
+          iProgramState = EComplete;
+          iStoreEtaRates = true;
+        } else {
+          BeginEtaStep(prevTemp);
+        }
       }
     }
     break;
@@ -323,19 +522,82 @@ void Thermocycler::Loop() {
   case EComplete:
     if (iRamping && ipCurrentStep != NULL && abs(ipCurrentStep->GetTemp() - iPlateTemp) <= CYCLE_START_TOLERANCE)
       iRamping = false;
+    break;    
+  case ETuning:
+    UpdateTuning();
+    break;
+  default:
     break;
   }
  
-  ControlPeltier();
-  ControlLid();
-  UpdateEta();
+  PROFILE_PHASE(EProfileControlPeltier, ControlPeltier());
+  PROFILE_PHASE(EProfileControlLid, ControlLid());
+}
+
+void Thermocycler::ControlTimerHandler() {
+  if (gpThermocycler != NULL)
+    gpThermocycler->ControlTick();
+}
+
+// auto-tuning
+void Thermocycler::StartTuning() {
+  if (iProgramState == EOff)
+    return;
   
-  ipDisplay->Update();
-  ipSerialControl->Process();
+  //the program is only replaced after Stop(), and ipProgram is NULL until
+  //then, so nothing needs its storage while tuning
+  ipTuner = new (&iProgram) RelayTuner();
+  strcpy_P(iszProgName, TUNING_PROG_NAME);
+  iProgramState = ETuning;
+  iTunePoint = 0;
+  iGainsTuned = false; //table gains until the schedule is complete
+  iReloadGains = false;
+  iGains.numPlatePoints = 0;
+  StartPlateTunePoint();
+  SetLidTarget(LID_TUNE_TEMP);
+}
+
+void Thermocycler::StartPlateTunePoint() {
+  float temp = pgm_read_byte(PLATE_TUNE_TEMPS + iTunePoint);
+  SetPlateTarget(temp);
+  ipTuner->Start(temp, CYCLE_START_TOLERANCE, PLATE_TUNE_RELAY, PLATE_TUNE_HYSTERESIS, MIN_PELTIER_PWM, MAX_PELTIER_PWM);
+}
+
+void Thermocycler::UpdateTuning() {
+  if (ipTuner->Failed()) {
+    //keep whatever gains were stored before
+    Stop();
+    iReloadGains = true;
+    return;
+  }
+  
+  if (iRamping && absf(iTargetPlateTemp - iPlateTemp) <= CYCLE_START_TOLERANCE)
+    iRamping = false;
+  
+  if (!ipTuner->Done())
+    return;
+  
+  if (iTunePoint < NUM_PLATE_TUNE_TEMPS) {
+    iGains.plateTemps[iTunePoint] = pgm_read_byte(PLATE_TUNE_TEMPS + iTunePoint);
+#ifdef PLATE_FEEDFORWARD
+    ipTuner->GetPiGains(iGains.plateGains[iTunePoint]); //PID only trims, no D
+#else
+    ipTuner->GetPidGains(iGains.plateGains[iTunePoint]);
+#endif
+    iGains.numPlatePoints = ++iTunePoint;
+    if (iTunePoint < NUM_PLATE_TUNE_TEMPS)
+      StartPlateTunePoint();
+    else //the plate holds the last
+      ipTuner->Start(LID_TUNE_TEMP, LID_START_TOLERANCE, LID_TUNE_RELAY, LID_TUNE_HYSTERESIS, MIN_LID_PWM, MAX_LID_PWM);
+  } else {
+    ipTuner->GetPidGains(iGains.lidGains);
+    Stop();
+    iGainsTuned = true;
+    iStoreTunedGains = true; //EEPROM writes are too slow for the control tick
+  }
 }
 
 void Thermocycler::CheckPower() {
-  float voltage = analogRead(0) * 5.0 / 1024 * 10 / 3; // 10/3 is for voltage divider
   boolean externalPower = digitalRead(A0); //voltage > 7.0;
   if (externalPower && iProgramState == EOff) {
     iProgramState = EStartup;
@@ -350,56 +612,71 @@ void Thermocycler::CheckPower() {
 //private
 
 void Thermocycler::ReadLidTemp() {
-  unsigned long voltage_mv = (unsigned long)analogRead(1) * 5000 / 1024;
-  unsigned long resistance = voltage_mv * 2200 / (5000 - voltage_mv);
+  //the free-running ADC takes ~960 samples per control period; their mean
+  //in 1/8 codes is at least 13 bits, given the thermistor noise as dither
+  uint32_t sum;
+  uint16_t count;
+  Hardware::TakeAdcSamples(sum, count);
+  if (count < LID_MIN_SAMPLES)
+    return; //keep the last value
   
-  iLidTemp = TableLookup(LID_RESISTANCE_TABLE, sizeof(LID_RESISTANCE_TABLE) / sizeof(LID_RESISTANCE_TABLE[0]), 0, resistance);
-}
-
-char spi_transfer(volatile char data)
-{
-  SPDR = data;                    // Start the transmission
-  while (!(SPSR & (1<<SPIF)))     // Wait the end of the transmission
-  {
-  };
-  return SPDR;                    // return the received byte
+  //interpolate between ADC codes in LID_ADC_TABLE
+  uint32_t code8 = (sum * 8 + count / 2) / count;
+  int index = (int)(code8 >> 3) - LID_ADC_TABLE_START;
+  int tableSize = sizeof(LID_ADC_TABLE) / sizeof(LID_ADC_TABLE[0]);
+  double temp;
+  if (index < 0) {
+    temp = pgm_read_word_near(LID_ADC_TABLE) * 0.01;
+  } else if (index >= tableSize - 1) {
+    temp = pgm_read_word_near(LID_ADC_TABLE + tableSize - 1) * 0.01;
+  } else {
+    int lower = pgm_read_word_near(LID_ADC_TABLE + index);
+    int upper = pgm_read_word_near(LID_ADC_TABLE + index + 1);
+    temp = (lower + (upper - lower) * (int)(code8 & 7) / 8.0) * 0.01;
+  }
+  
+  //single pole IIR, with the noise as the filtered squared deviation
+  if (!iLidFilterPrimed) {
+    iLidTemp = temp;
+    iLidNoiseVariance = 0;
+    iLidFilterPrimed = true;
+  } else {
+    double deviation = temp - iLidTemp;
+    iLidTemp += LID_FILTER_ALPHA * deviation;
+    iLidNoiseVariance += LID_NOISE_ALPHA * (deviation * deviation - iLidNoiseVariance);
+  }
+  iLidControlTemp = ToControl(iLidTemp);
 }
 
 void Thermocycler::ReadPlateTemp() {
-  byte eeprom_output_data;
-  byte eeprom_input_data=0;
-  byte clr;
-  int address=0;
-  //data buffer
-  char buffer [128]; 
-
-  digitalWrite(SLAVESELECT, LOW);
-
-  //read data
-  while(digitalRead(DATAIN)) {
+  //non-blocking: selecting the ADC starts a conversion, and it pulls DATAIN
+  //low once the result is ready. Until then keep the last published sample.
+  if (!iPlateAdcConverting) {
+    digitalWrite(SLAVESELECT, LOW);
+    iPlateAdcConverting = true;
+    return;
   }
+  if (digitalRead(DATAIN))
+    return;
   
-  char buf[32];
   uint8_t spiBuf[4];
-  memset(spiBuf, 0, sizeof(spiBuf));
-
-  digitalWrite(SLAVESELECT, LOW);  
   for(int i = 0; i < 4; i++)
-    spiBuf[i] = spi_transfer(0xFF);
+    spiBuf[i] = Hardware::SpiTransfer(0xFF);
+
+  //deselect to end the read, then reselect to start the next conversion
+  digitalWrite(SLAVESELECT, HIGH);
+  digitalWrite(SLAVESELECT, LOW);
 
   unsigned long conv = (((unsigned long)spiBuf[3] >> 7) & 0x01) + ((unsigned long)spiBuf[2] << 1) + ((unsigned long)spiBuf[1] << 9) + (((unsigned long)spiBuf[0] & 0x1F) << 17); //((spiBuf[0] & 0x1F) << 16) + (spiBuf[1] << 8) + spiBuf[2];
   
   unsigned long adcDivisor = 0x1FFFFF;
   float voltage = (float)conv * 5.0 / adcDivisor;
-
-  unsigned int convHigh = (conv >> 16);
-  
-  digitalWrite(SLAVESELECT, HIGH);
   
   unsigned long voltage_mv = voltage * 1000;
   unsigned long resistance = voltage_mv * 22000 / (5000 - voltage_mv); // in hecto ohms
  
   iPlateTemp = TableLookup(PLATE_RESISTANCE_TABLE, sizeof(PLATE_RESISTANCE_TABLE) / sizeof(PLATE_RESISTANCE_TABLE[0]), -40, resistance);
+  iPlateControlTemp = ToControl(iPlateTemp);
 }
 
 void Thermocycler::SetPlateTarget(double target) {
@@ -412,6 +689,20 @@ void Thermocycler::SetPlateTarget(double target) {
   }
   
   iTargetPlateTemp = target;
+#ifdef PLATE_FEEDFORWARD
+  //feedforward drives the ramp, PID only trims the residual
+  iPlateControlMode = EPID;
+  iPlatePid.SetMode(AUTOMATIC);
+  if (iRamping) {
+    //start the model from the plate, holding where it is
+    iPlateRampPhase = ERampDrive;
+    iPlateRefTemp = iPlateTemp;
+    iPlateModelFaceTemp = iPlateTemp + PlateHoldOffset(iPlateTemp);
+    iPlatePidPwm = 0;
+    iPlatePid.ResetI();
+  }
+#else
+  iPlateRefTemp = iTargetPlateTemp;
   if (absf(iTargetPlateTemp - iPlateTemp) >= PLATE_BANGBANG_THRESHOLD) {
     iPlateControlMode = EBangBang;
     iPlatePid.SetMode(MANUAL);
@@ -419,28 +710,71 @@ void Thermocycler::SetPlateTarget(double target) {
     iPlateControlMode = EPID;
     iPlatePid.SetMode(AUTOMATIC);
   }
+#endif
   
   if (iRamping) {
-    if (iTargetPlateTemp >= iPlateTemp) {
-      iDecreasing = false;
-      if (iTargetPlateTemp < PLATE_PID_INC_LOW_THRESHOLD)
-        iPlatePid.SetTunings(PLATE_PID_INC_LOW_P, PLATE_PID_INC_LOW_I, PLATE_PID_INC_LOW_D);
-      else
-        iPlatePid.SetTunings(PLATE_PID_INC_P, PLATE_PID_INC_I, PLATE_PID_INC_D);
-    } else {
-      iDecreasing = true;
-      if (iTargetPlateTemp > PLATE_PID_DEC_HIGH_THRESHOLD)
-        iPlatePid.SetTunings(PLATE_PID_DEC_HIGH_P, PLATE_PID_DEC_HIGH_I, PLATE_PID_DEC_HIGH_D);
-      else if (iTargetPlateTemp < PLATE_PID_DEC_LOW_THRESHOLD)
-        iPlatePid.SetTunings(PLATE_PID_DEC_LOW_P, PLATE_PID_DEC_LOW_I, PLATE_PID_DEC_LOW_D);
-      else
-        iPlatePid.SetTunings(PLATE_PID_DEC_P, PLATE_PID_DEC_I, PLATE_PID_DEC_D);
-    }
+    iDecreasing = iTargetPlateTemp < iPlateTemp;
+    UpdatePlateGains();
+  }
+}
+
+// Gains for the current plate setpoint and ramp direction, from the tuned
+// schedule when there is one, otherwise PLATE_GAIN_TABLE. The PID moves the
+// proportional change into its integral, so this can run at any time.
+void Thermocycler::UpdatePlateGains() {
+  double temp = iPlateRefTemp;
+  SPidGains gains;
+  
+  if (iGainsTuned) {
+    //tuned at holds, so the same both ways
+    int i = 1;
+    while (i < iGains.numPlatePoints - 1 && iGains.plateTemps[i] < temp)
+      i++;
+    if (iGains.numPlatePoints == 1)
+      gains = iGains.plateGains[0];
+    else
+      InterpolateGains(temp, iGains.plateTemps[i - 1], iGains.plateGains[i - 1], iGains.plateTemps[i], iGains.plateGains[i], gains);
+      
+  } else {
+#ifdef PLATE_FEEDFORWARD
+    gains.kp = PLATE_PID_FF_P;
+    gains.ki = PLATE_PID_FF_I;
+    gains.kd = PLATE_PID_FF_D;
+#else
+    int i = 1;
+    while (i < PLATE_GAIN_TABLE_ROWS - 1 && pgm_read_word(&PLATE_GAIN_TABLE[i][0]) < temp)
+      i++;
+    SPidGains lower, upper;
+    int column = iDecreasing ? 4 : 1;
+    lower.kp = pgm_read_word(&PLATE_GAIN_TABLE[i - 1][column]);
+    lower.ki = pgm_read_word(&PLATE_GAIN_TABLE[i - 1][column + 1]);
+    lower.kd = pgm_read_word(&PLATE_GAIN_TABLE[i - 1][column + 2]);
+    upper.kp = pgm_read_word(&PLATE_GAIN_TABLE[i][column]);
+    upper.ki = pgm_read_word(&PLATE_GAIN_TABLE[i][column + 1]);
+    upper.kd = pgm_read_word(&PLATE_GAIN_TABLE[i][column + 2]);
+    InterpolateGains(temp, pgm_read_word(&PLATE_GAIN_TABLE[i - 1][0]), lower, pgm_read_word(&PLATE_GAIN_TABLE[i][0]), upper, gains);
+#endif
   }
+  
+  iPlatePid.SetTunings(gains.kp, gains.ki, gains.kd);
+  iScheduledPlateTemp = temp;
+}
+
+void Thermocycler::InterpolateGains(double temp, double lowerTemp, SPidGains& lower, double upperTemp, SPidGains& upper, SPidGains& gains) {
+  double fraction = constrain((temp - lowerTemp) / (upperTemp - lowerTemp), 0, 1);
+  gains.kp = lower.kp + (upper.kp - lower.kp) * fraction;
+  gains.ki = lower.ki + (upper.ki - lower.ki) * fraction;
+  gains.kd = lower.kd + (upper.kd - lower.kd) * fraction;
 }
 
 void Thermocycler::SetLidTarget(double target) {
   iTargetLidTemp = target;
+  iLidControlTarget = ToControl(target);
+  if (iGainsTuned)
+    iLidPid.SetTunings(iGains.lidGains.kp, iGains.lidGains.ki, iGains.lidGains.kd);
+  else
+    iLidPid.SetTunings(LID_PID_P, LID_PID_I, LID_PID_D);
+  
   if (absf(iTargetLidTemp - iLidTemp) >= LID_BANGBANG_THRESHOLD) {
     iLidControlMode = EBangBang;
     iLidPid.SetMode(MANUAL);
@@ -453,7 +787,19 @@ void Thermocycler::SetLidTarget(double target) {
 void Thermocycler::ControlPeltier() {
   ThermalDirection newDirection = OFF;
   
-  if (iProgramState == ERunning || (iProgramState == EComplete && ipCurrentStep != NULL)) {
+  if (iProgramState == ERunning || (iProgramState == EComplete && ipCurrentStep != NULL) || iProgramState == ETuning) {
+#ifdef PLATE_FEEDFORWARD
+    UpdatePlateReference();
+    if (absf(iPlateRefTemp - iScheduledPlateTemp) >= PLATE_SCHEDULE_STEP)
+      UpdatePlateGains();
+    ControlValue feedforward = ToControl(iPlateModelDrive * MAX_PELTIER_PWM);
+    iPlateControlRef = ToControl(iPlateRefTemp);
+    iPlatePid.SetOutputLimits(ToControl(MIN_PELTIER_PWM) - feedforward, ToControl(MAX_PELTIER_PWM) - feedforward);
+    if (iPlateRampPhase != ERampHold)
+      iPlatePid.ResetI(); //tracking lag on a ramp is not steady state error
+    iPlatePid.Compute();
+    iPeltierPwm = constrain(ControlToPwm(feedforward + iPlatePidPwm), MIN_PELTIER_PWM, MAX_PELTIER_PWM);
+#else
     // Check whether we should switch to PID control
     if (iPlateControlMode == EBangBang && absf(iTargetPlateTemp - iPlateTemp) < PLATE_BANGBANG_THRESHOLD) {
       iPlateControlMode = EPID;
@@ -463,8 +809,9 @@ void Thermocycler::ControlPeltier() {
  
     // Apply control mode
     if (iPlateControlMode == EBangBang) {
-      iPeltierPwm = iTargetPlateTemp > iPlateTemp ? MAX_PELTIER_PWM : MIN_PELTIER_PWM;
+      iPlatePidPwm = ToControl(iTargetPlateTemp > iPlateTemp ? MAX_PELTIER_PWM : MIN_PELTIER_PWM);
     }
+    iPlateControlRef = ToControl(iPlateRefTemp);
     iPlatePid.Compute();
     
     if (iDecreasing && iTargetPlateTemp > PLATE_PID_DEC_LOW_THRESHOLD) {
@@ -473,6 +820,10 @@ void Thermocycler::ControlPeltier() {
       else
         iDecreasing = false;
     } 
+    iPeltierPwm = ControlToPwm(iPlatePidPwm);
+#endif
+    if (iProgramState == ETuning && iTunePoint < NUM_PLATE_TUNE_TEMPS)
+      iPeltierPwm = ipTuner->Compute(iPlateTemp, iPeltierPwm);
     
     if (iPeltierPwm > 0)
       newDirection = HEAT;
@@ -488,10 +839,68 @@ void Thermocycler::ControlPeltier() {
   SetPeltier(newDirection, abs(iPeltierPwm));
 }
 
+#ifdef PLATE_FEEDFORWARD
+// Runs the plate model one control period ahead under the drive that gets it
+// to the target soonest: full drive toward the target, then full drive the
+// other way until the Peltier face is back at its holding offset, timed so the
+// block coasts onto the target. Bang-bang only sees the block; the model also
+// knows how much heat is still stored in the face, so it can brake on time.
+// The modelled block temperature becomes the PID setpoint and the modelled
+// drive the feedforward.
+void Thermocycler::UpdatePlateReference() {
+  if (iPlateRampPhase == ERampHold) {
+    iPlateRefTemp = iTargetPlateTemp;
+    iPlateModelFaceTemp = iTargetPlateTemp + PlateHoldOffset(iTargetPlateTemp);
+    iPlateModelDrive = PlateModelDrive(iPlateRefTemp, iPlateModelFaceTemp, 0);
+    return;
+  }
+  
+  double direction = iTargetPlateTemp >= iPlateRefTemp ? 1 : -1;
+  if (iPlateRampPhase == ERampDrive) {
+    //brake now if braking from the next state would already reach the target
+    double block = iPlateRefTemp;
+    double face = iPlateModelFaceTemp;
+    StepPlateModel(block, face, direction * PLATE_RAMP_DRIVE);
+    while ((face - block - PlateHoldOffset(block)) * direction > 0)
+      StepPlateModel(block, face, -direction * PLATE_RAMP_DRIVE);
+    if ((block - iTargetPlateTemp) * direction >= 0)
+      iPlateRampPhase = ERampBrake;
+  }
+  
+  iPlateModelDrive = (iPlateRampPhase == ERampDrive ? direction : -direction) * PLATE_RAMP_DRIVE;
+  StepPlateModel(iPlateRefTemp, iPlateModelFaceTemp, iPlateModelDrive);
+  if (iPlateRampPhase == ERampBrake && ((iPlateModelFaceTemp - iPlateRefTemp - PlateHoldOffset(iPlateRefTemp)) * direction <= 0
+      || (iPlateRefTemp - iTargetPlateTemp) * direction >= 0))
+    iPlateRampPhase = ERampHold; //landed, within a control period of motion
+}
+
+// face - block at steady state for a block temperature
+double Thermocycler::PlateHoldOffset(double blockTemp) {
+  return (blockTemp - PLATE_MODEL_AMBIENT) * PLATE_MODEL_BLOCK_TAU / PLATE_MODEL_AMBIENT_TAU;
+}
+
+// block' = (face - block) / BLOCK_TAU - (block - ambient) / AMBIENT_TAU
+// face' = drive * RATE - (face - block) / PELTIER_TAU
+void Thermocycler::StepPlateModel(double& blockTemp, double& faceTemp, double drive) {
+  const double dt = CONTROL_PERIOD_MS / 1000.0;
+  double pump = drive >= 0 ? drive * PLATE_MODEL_HEAT_RATE : drive * PLATE_MODEL_COOL_RATE;
+  double faceDelta = pump - (faceTemp - blockTemp) / PLATE_MODEL_PELTIER_TAU;
+  double blockDelta = (faceTemp - blockTemp) / PLATE_MODEL_BLOCK_TAU - (blockTemp - PLATE_MODEL_AMBIENT) / PLATE_MODEL_AMBIENT_TAU;
+  faceTemp += faceDelta * dt;
+  blockTemp += blockDelta * dt;
+}
+
+// drive that moves the face at faceRate, as a fraction of full scale
+double Thermocycler::PlateModelDrive(double blockTemp, double faceTemp, double faceRate) {
+  double pump = faceRate + (faceTemp - blockTemp) / PLATE_MODEL_PELTIER_TAU;
+  return pump >= 0 ? pump / PLATE_MODEL_HEAT_RATE : pump / PLATE_MODEL_COOL_RATE;
+}
+#endif
+
 void Thermocycler::ControlLid() {
   double drive = 0;
   
-  if (iProgramState == ERunning || iProgramState == ELidWait) {
+  if (iProgramState == ERunning || iProgramState == ELidWait || iProgramState == ETuning) {
     // Check whether we should switch to PID control
     if (iLidControlMode == EBangBang && absf(iTargetLidTemp - iLidTemp) < LID_BANGBANG_THRESHOLD) {
       iLidControlMode = EPID;
@@ -500,28 +909,117 @@ void Thermocycler::ControlLid() {
     }
     
     if (iLidControlMode == EBangBang) {
-      iLidPwm = iTargetLidTemp > iLidTemp ? MAX_LID_PWM : MIN_LID_PWM;
+      iLidPidPwm = ToControl(iTargetLidTemp > iLidTemp ? MAX_LID_PWM : MIN_LID_PWM);
     }
     iLidPid.Compute();
+    iLidPwm = ControlToPwm(iLidPidPwm);
+    if (iProgramState == ETuning && iTunePoint == NUM_PLATE_TUNE_TEMPS)
+      iLidPwm = ipTuner->Compute(iLidTemp, iLidPwm);
     drive = iLidPwm;   
   } else {
+    iLidPidPwm = 0;
     iLidPwm = 0;
   }
    
   analogWrite(3, drive);
 }
 
+#ifdef RUN_HISTORY
+// samples every interval, and marks the first time through each step and
+// every cycle after (see RunHistory), from the start of a run to its end
+void Thermocycler::RecordHistory() {
+  if (!RunHistory::IsRecording())
+    return;
+  
+  SStatus status;
+  GetStatus(status);
+  boolean running = status.state == ERunning && status.pStep != NULL;
+  
+  if (status.state != ELidWait && status.state != ERunning) {
+    RunHistory::End(status.state);
+    return;
+  }
+  if (running && (status.cycleNum != iHistoryCycle || iHistoryStep == HISTORY_NO_STEP ||
+      status.stepIndex > iHistoryStep)) {
+    if (iHistoryStep == HISTORY_NO_STEP || status.stepIndex > iHistoryStep)
+      iHistoryStep = status.stepIndex;
+    iHistoryCycle = status.cycleNum;
+    RunHistory::AddMark(status.stepIndex, status.cycleNum);
+  }
+  //one per interval even if late, so the nth is still n intervals in
+  if ((long)(millis() - iHistoryNextMs) >= 0) {
+    iHistoryNextMs += RunHistory::GetIntervalS() * 1000UL;
+    RunHistory::AddSample(status.plateTemp, status.lidTemp, status.peltierPwm);
+  }
+}
+#endif
+
+// Remaining time is the program's hold time from the current step on, the
+// current ramp, and iEtaFutureS for the ramps after it: their degrees per band
+// times the learned rate for that band and direction. Ramps are taken out of
+// the sum and the program's degrees as they start, and learning a rate
+// corrects the sum for the degrees still to ramp.
 void Thermocycler::UpdateEta() {
   if (iProgramState == ERunning) {
-    double secondPerDegree;
-    if (iElapsedRampDegrees == 0 || !iHasCooled)
-      secondPerDegree = 1.0;
-    else
-      secondPerDegree = iElapsedRampDurationMs / 1000 / iElapsedRampDegrees;
-      
-    unsigned long estimatedDurationS = iProgramHoldDurationS + iProgramRampDegrees * secondPerDegree;
-    unsigned long elapsedTimeS = GetElapsedTimeS();
-    iEstimatedTimeRemainingS = estimatedDurationS > elapsedTimeS ? estimatedDurationS - elapsedTimeS : 0;
+    Hardware::LockControl();
+    double remainingS = iEtaFutureS + ipProgram->GetTotalHoldS() - ipProgram->GetHoldOffsetS();
+    if (iRamping) {
+      double rampElapsedS = (millis() - iRampStartTime) / 1000.0;
+      if (iEtaStepRampS > rampElapsedS)
+        remainingS += iEtaStepRampS - rampElapsedS;
+    } else {
+      remainingS -= (millis() - iCycleStartTime) / 1000.0;
+    }
+    Hardware::UnlockControl();
+    
+    iEstimatedTimeRemainingS = remainingS > 0 ? remainingS + 0.5 : 0;
+  }
+}
+
+// takes the ramp to the step just made current out of the remaining program
+void Thermocycler::BeginEtaStep(double fromTemp) {
+  AddEtaRamp(fromTemp, ipCurrentStep->GetTemp(), -1);
+  iEtaStepRampS = PredictEtaRampS(fromTemp, ipCurrentStep->GetTemp());
+}
+
+double Thermocycler::PredictEtaRampS(double fromTemp, double toTemp) {
+  float degrees[ETA_NUM_BANDS];
+  int direction = Program::SplitRamp(fromTemp, toTemp, degrees);
+  double seconds = 0;
+  for (int i = 0; i < ETA_NUM_BANDS; i++)
+    seconds += degrees[i] * iEtaRates.secPerDegree[direction][i];
+  return seconds;
+}
+
+void Thermocycler::AddEtaRamp(double fromTemp, double toTemp, int sign) {
+  float degrees[ETA_NUM_BANDS];
+  int direction = Program::SplitRamp(fromTemp, toTemp, degrees);
+  float* pRampDegrees = ipProgram->GetRampDegrees(direction);
+  for (int i = 0; i < ETA_NUM_BANDS; i++) {
+    pRampDegrees[i] += sign * degrees[i];
+    iEtaFutureS += sign * degrees[i] * iEtaRates.secPerDegree[direction][i];
+  }
+}
+
+// Moves the rates of the bands a ramp crossed toward its measured duration,
+// each in proportion to its share of the prediction.
+void Thermocycler::LearnEtaRamp(double fromTemp, double toTemp, double measuredS) {
+  float degrees[ETA_NUM_BANDS];
+  int direction = Program::SplitRamp(fromTemp, toTemp, degrees);
+  double predictedS = PredictEtaRampS(fromTemp, toTemp);
+  if (absf(toTemp - fromTemp) < ETA_MIN_LEARN_DEGREES || predictedS <= 0)
+    return;
+  
+  double error = constrain(measuredS / predictedS, 0.25, 4.0) - 1;
+  const float* pRampDegrees = ipProgram->GetRampDegrees(direction);
+  boolean first = iEtaUnlearned & (1 << direction);
+  iEtaUnlearned &= ~(1 << direction);
+  for (int i = 0; i < ETA_NUM_BANDS; i++) {
+    //the first ramp each way sets all the bands, the defaults are only a guess
+    float& rate = iEtaRates.secPerDegree[direction][i];
+    double change = first ? rate * error : rate * ETA_LEARN_GAIN * error * degrees[i] * rate / predictedS;
+    rate += change;
+    iEtaFutureS += pRampDegrees[i] * change;
   }
 }
 
@@ -542,29 +1040,16 @@ void Thermocycler::SetPeltier(ThermalDirection dir, int pwm) {
 
 void Thermocycler::ProcessCommand(SCommand& command) {
   if (command.command == SCommand::EStart) {
-    //find display cycle
-    Cycle* pProgram = command.pProgram;
-    Cycle* pDisplayCycle = pProgram;
-    int largestCycleCount = 0;
-    
-    for (int i = 0; i < pProgram->GetNumComponents(); i++) {
-      ProgramComponent* pComp = pProgram->GetComponent(i);
-      if (pComp->GetType() == ProgramComponent::ECycle) {
-        Cycle* pCycle = (Cycle*)pComp;
-        if (pCycle->GetNumCycles() > largestCycleCount) {
-          largestCycleCount = pCycle->GetNumCycles();
-          pDisplayCycle = pCycle;
-        }
-      }
-    }
-    
     //start program by persisting and resetting device to overcome memory leak in C library
-    GetThermocycler().SetProgram(pProgram, pDisplayCycle, command.name, command.lidTemp);
+    GetThermocycler().SetProgram(command.pProgram, command.name, command.lidTemp);
     GetThermocycler().Start();
     
   } else if (command.command == SCommand::EStop) {
     GetThermocycler().Stop(); //redundant as we already stopped during parsing
   
+  } else if (command.command == SCommand::ETune) {
+    StartTuning();
+    
   } else if (command.command == SCommand::EConfig) {
     //update displayed
     ipDisplay->SetContrast(command.contrast);
@@ -574,74 +1059,25 @@ void Thermocycler::ProcessCommand(SCommand& command) {
   }
 }
 
-uint8_t Thermocycler::mcp342xRead(int32_t &data)
-{
-  // pointer used to form int32 data
-  uint8_t *p = (uint8_t *)&data;
-  // timeout - not really needed?
-  uint32_t start = millis();
-  do {
-    // assume 18-bit mode
-    Wire.requestFrom(MCP3422_ADDRESS, 4);
-    if (Wire.available() != 4) {
-      return false;
-    }
-    for (int8_t i = 2; i >= 0; i--) {
-      p[i] = Wire.receive();
-    }
-    // extend sign bits
-    p[3] = p[2] & 0X80 ? 0XFF : 0;
-    // read config/status byte
-    uint8_t s = Wire.receive();
-    if ((s & MCP342X_RES_FIELD) != MCP342X_18_BIT) {
-      // not 18 bits - shift bytes for 12, 14, or 16 bits
-      p[0] = p[1];
-      p[1] = p[2];
-      p[2] = p[3];
-    }
-    if ((s & MCP342X_BUSY) == 0) return true;
-  } while (millis() - start < 500); //allows rollover of millis()
-  return false;
-}
-//------------------------------------------------------------------------------
-// write mcp342x configuration byte
-uint8_t Thermocycler::mcp342xWrite(uint8_t config)
-{
-  Wire.beginTransmission(MCP3422_ADDRESS);
-  Wire.send(config);
-  Wire.endTransmission();
-}
-//------------------------------------------------------------------------------
 float Thermocycler::TableLookup(const unsigned long lookupTable[], unsigned int tableSize, int startValue, unsigned long searchValue) {
-  //simple linear search for now
-  int i;
-  for (i = 0; i < tableSize; i++) {
-    if (searchValue >= pgm_read_dword_near(lookupTable + i))
-      break;
+  //binary search for the first entry <= searchValue, the table is decreasing
+  unsigned int low = 0;
+  unsigned int high = tableSize;
+  while (low < high) {
+    unsigned int mid = (low + high) / 2;
+    if (searchValue >= pgm_read_dword_near(lookupTable + mid))
+      high = mid;
+    else
+      low = mid + 1;
   }
   
-  if (i > 0) {
-    unsigned long high_val = pgm_read_dword_near(lookupTable + i - 1);
-    unsigned long low_val = pgm_read_dword_near(lookupTable + i);
-    return i + startValue - (float)(searchValue - low_val) / (float)(high_val - low_val);
-  } else {
+  if (low == 0) {
     return startValue;
-  }
-}
-//------------------------------------------------------------------------------
-float Thermocycler::TableLookup(const unsigned int lookupTable[], unsigned int tableSize, int startValue, unsigned long searchValue) {
-  //simple linear search for now
-  int i;
-  for (i = 0; i < tableSize; i++) {
-    if (searchValue >= pgm_read_word_near(lookupTable + i))
-      break;
-  }
-  
-  if (i > 0) {
-    unsigned long high_val = pgm_read_word_near(lookupTable + i - 1);
-    unsigned long low_val = pgm_read_word_near(lookupTable + i);
-    return i + startValue - (float)(searchValue - low_val) / (float)(high_val - low_val);
+  } else if (low == tableSize) {
+    return startValue + (int)tableSize - 1;
   } else {
-    return startValue;
+    unsigned long high_val = pgm_read_dword_near(lookupTable + low - 1);
+    unsigned long low_val = pgm_read_dword_near(lookupTable + low);
+    return low + startValue - (float)(searchValue - low_val) / (float)(high_val - low_val);
   }
 }
@@ -20,10 +20,20 @@
 #define _THERMOCYCLER_H_
 
 #include "PID_v1.h"
+#include "fixed_pid.h"
 #include "program.h"
+#include "autotune.h"
 
 class Display;
 class SerialControl;
+
+#ifdef FIXED_POINT_PID
+typedef FixedPID<int32_t, int32_t, 8> ControlPID; //temperatures and gains in 1/256ths
+typedef int32_t ControlValue;
+#else
+typedef PID ControlPID;
+typedef double ControlValue;
+#endif
   
 class Thermocycler {
 public:
@@ -35,6 +45,7 @@ public:
     ERunning,
     EComplete,
     EError,
+    ETuning,
     EClear //for Display clearing only
   };
   
@@ -51,53 +62,87 @@ public:
     COOL
   };
   
-  Thermocycler(boolean restarted);
-  ~Thermocycler();
+  // What the display and status reports show, all from one control tick.
+  // Steps stay where they are until the next command, so pStep can be
+  // used after the tick has moved on.
+  struct SStatus {
+    ProgramState state;
+    ThermalState thermalState;
+    float plateTemp;
+    float lidTemp;
+    float lidNoise; //GetLidTempNoise()
+    int peltierPwm;
+    int lidPwm;
+    unsigned long elapsedS;
+    unsigned long remainingS;
+    int numCycles; //0 without a program
+    int cycleNum;
+    uint8_t stepIndex;
+    Step* pStep; //NULL without a current step
+  };
+  
+  Thermocycler(boolean restarted); //once, into static storage
   
   // accessors
+  void GetStatus(SStatus& status); //from the background only
   ProgramState GetProgramState() { return iProgramState; }
   ThermalState GetThermalState();
   Step* GetCurrentStep() { return ipCurrentStep; }
-  Cycle* GetDisplayCycle() { return ipDisplayCycle; }
-  int GetNumCycles();
-  int GetCurrentCycleNum();
   const char* GetProgName() { return iszProgName; }
   Display* GetDisplay() { return ipDisplay; }
-  ProgramComponentPool<Cycle, 4>& GetCyclePool() { return iCyclePool; }
-  ProgramComponentPool<Step, 20>& GetStepPool() { return iStepPool; }
+  Program& GetProgram() { return iProgram; }
   
   boolean Ramping() { return iRamping; }
   int GetPeltierPwm() { return iPeltierPwm; }
+  int GetLidPwm() { return iLidPwm; }
   float GetPlateTemp() { return iPlateTemp; }
-  float GetLidTemp() { return iLidTemp; }
+  float GetLidTemp() { return iLidTemp; } //filtered
+  float GetLidTempNoise() { return sqrt(iLidNoiseVariance); } //rms C of the unfiltered samples
   unsigned long GetTimeRemainingS() { return iEstimatedTimeRemainingS; }
   unsigned long GetElapsedTimeS() { return (millis() - iProgramStartTimeMs) / 1000; }
   
   // control
-  void SetProgram(Cycle* pProgram, Cycle* pDisplayCycle, const char* szProgName, int lidTemp); //takes ownership of cycles
+  void SetProgram(Program* pProgram, const char* szProgName, int lidTemp);
   void Stop();
   PcrStatus Start();
   void ProcessCommand(SCommand& command);
   
   // internal
-  void Loop();
+  void Loop(); //background work: eta, display and serial
+  void ControlTick(); //sensing and control, every CONTROL_PERIOD_MS
   
 private:
+  static void ControlTimerHandler();
   void CheckPower();
   void ReadLidTemp();
   void ReadPlateTemp();
   void ControlPeltier();
+#ifdef PLATE_FEEDFORWARD
+  void UpdatePlateReference();
+  double PlateHoldOffset(double blockTemp);
+  void StepPlateModel(double& blockTemp, double& faceTemp, double drive);
+  double PlateModelDrive(double blockTemp, double faceTemp, double faceRate);
+#endif
   void ControlLid();
   void UpdateEta();
+#ifdef RUN_HISTORY
+  void RecordHistory();
+#endif
+  void BeginEtaStep(double fromTemp);
+  double PredictEtaRampS(double fromTemp, double toTemp);
+  void AddEtaRamp(double fromTemp, double toTemp, int sign);
+  void LearnEtaRamp(double fromTemp, double toTemp, double measuredS);
+  void StartTuning();
+  void StartPlateTunePoint();
+  void UpdateTuning();
  
   //util functions
   void SetPlateTarget(double target);
   void SetLidTarget(double target);
+  void UpdatePlateGains();
+  static void InterpolateGains(double temp, double lowerTemp, SPidGains& lower, double upperTemp, SPidGains& upper, SPidGains& gains);
   void SetPeltier(ThermalDirection dir, int pwm);
-  uint8_t mcp342xWrite(uint8_t config);
-  uint8_t mcp342xRead(int32_t &data);
   float TableLookup(const unsigned long lookupTable[], unsigned int tableSize, int startValue, unsigned long searchValue);
-  float TableLookup(const unsigned int lookupTable[], unsigned int tableSize, int startValue, unsigned long searchValue);
   
 private:
   // constants
@@ -106,17 +151,18 @@ private:
   // components
   Display* ipDisplay;
   SerialControl* ipSerialControl;
-  ProgramComponentPool<Cycle, 4> iCyclePool;
-  ProgramComponentPool<Step, 20> iStepPool;
+  Program iProgram; //also the tuner's storage, see StartTuning()
   
   // state
   ProgramState iProgramState;
-  double iPlateTemp;
+  double iPlateTemp; //latest published plate ADC sample
   double iTargetPlateTemp;
+  boolean iPlateAdcConverting;
   double iLidTemp;
+  double iLidNoiseVariance;
+  boolean iLidFilterPrimed;
   double iTargetLidTemp;
-  Cycle* ipProgram;
-  Cycle* ipDisplayCycle;
+  Program* ipProgram; //iProgram once loaded, otherwise NULL
   char iszProgName[21];
   Step* ipCurrentStep;
   unsigned long iCycleStartTime;
@@ -127,27 +173,59 @@ private:
     EPID
   };
   boolean iRestarted;
+  boolean iCheckStoredProgram;
   
   ControlMode iPlateControlMode;
   ControlMode iLidControlMode;
   
   // peltier control
-  PID iPlatePid;
-  PID iLidPid;
+  ControlPID iPlatePid;
+  ControlPID iLidPid;
   ThermalDirection iThermalDirection; //holds actual real-time state
+  double iPlateRefTemp; //plate PID setpoint, the model block with feedforward
+  double iPlateModelFaceTemp;
+  double iPlateModelDrive; //feedforward, -1 to 1
+  enum RampPhase {
+    ERampDrive,
+    ERampBrake,
+    ERampHold
+  };
+  RampPhase iPlateRampPhase;
+  ControlValue iPlateControlTemp; //PID input, iPlateTemp in control units
+  ControlValue iPlateControlRef; //PID setpoint, iPlateRefTemp in control units
+  ControlValue iPlatePidPwm;
+  double iScheduledPlateTemp; //setpoint the plate gains were last scheduled for
   double iPeltierPwm;
+  ControlValue iLidControlTemp; //PID input, iLidTemp in control units
+  ControlValue iLidControlTarget;
+  ControlValue iLidPidPwm;
   double iLidPwm;
   
   // program eta calculation
   unsigned long iProgramStartTimeMs;
-  unsigned long iProgramHoldDurationS;
-  double iProgramRampDegrees;
-  double iElapsedRampDegrees;
-  unsigned long iElapsedRampDurationMs;
   double iRampStartTemp;
   unsigned long iRampStartTime;
   unsigned long iEstimatedTimeRemainingS;
-  boolean iHasCooled;
+  SEtaRates iEtaRates; //learned, seeded from EEPROM
+  double iEtaFutureS; //ramp time after the current step, of the program's ramp degrees
+  double iEtaStepRampS; //predicted ramp to the current step
+  boolean iStoreEtaRates;
+  uint8_t iEtaUnlearned; //directions still at the default rate, bit 0 heating, bit 1 cooling
+  
+#ifdef RUN_HISTORY
+  // run history
+  unsigned long iHistoryNextMs;
+  uint8_t iHistoryStep; //furthest into the program recorded, HISTORY_NO_STEP before the first
+  uint16_t iHistoryCycle;
+#endif
+  
+  // auto-tuning
+  RelayTuner* ipTuner; //plate, then lid, in iProgram while tuning
+  uint8_t iTunePoint; //NUM_PLATE_TUNE_TEMPS for the lid
+  SGainSchedule iGains; //tuned, cached from EEPROM, filled in while tuning
+  boolean iGainsTuned; //iGains is complete
+  boolean iStoreTunedGains;
+  boolean iReloadGains; //tuning failed part way through iGains
 };
 
 #endif
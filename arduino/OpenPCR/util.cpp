@@ -17,8 +17,6 @@
  */
 
 #include "pcr_includes.h"
-#include "thermocycler.h"
-#include "display.h"
 
 const char FLOAT_PAD_FORM_STR[] PROGMEM = "%3d.%d";
 const char FLOAT_FORM_STR[] PROGMEM = "%d.%d";
@@ -41,55 +39,20 @@ void sprintFloat(char* str, float val, int decimalDigits, boolean pad) {
     sprintf_P(str, FLOAT_FORM_STR, number, abs(decimal));
 }
 
-void* operator new(size_t size) {
-  void* pMem = malloc(size);
-
-#ifdef DEBUG_DISPLAY
-  if (pMem == NULL) {
-    gpThermocycler->GetDisplay()->SetDebugMsg("Out of Memory");  
-    delay(5000);
-  }
+#ifdef __AVR__
+void __cxa_pure_virtual(void) {};
 #endif
 
-  return pMem;
-}
-
-struct __freelist
-{
- size_t sz;
- struct __freelist *nx;
-};
-
-extern struct __freelist *__flp;
-extern uint8_t* __brkval;
-
-void fix28135_malloc_bug()
- {
-   for (__freelist *fp = __flp, *lfp = 0; fp; fp = fp->nx)
-   {
-     if (((uint8_t*)fp + fp->sz + 2) == __brkval)
-     {
-       __brkval = (uint8_t*)fp;
-       if (lfp)
-         lfp->nx = 0;
-       else
-         __flp = 0;
-       break;
-     }
-     lfp = fp;
-   }
- }
-
-
-void operator delete(void * ptr) {
-  free(ptr);
-  fix28135_malloc_bug();
+unsigned short htons(unsigned short val) {
+  return (val << 8) | (val >> 8);
 }
 
-void __cxa_pure_virtual(void) {};
-
-unsigned short htons(unsigned short val) {
-  return val << 8 + (byte)val;
+// CRC-16/CCITT, polynomial 0x1021, start with 0xFFFF
+uint16_t crc16Update(uint16_t crc, uint8_t val) {
+  crc ^= (uint16_t)val << 8;
+  for (int i = 0; i < 8; i++)
+    crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
 }
 
 double absf(double val) {